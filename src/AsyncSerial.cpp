@@ -4,6 +4,9 @@
  * Distributed under the Boost Software License, Version 1.0.
  * Created on September 7, 2009, 10:46 AM
  *
+ * v1.04: All ports share the io_context of DccIoContext. On OS X the tty is
+ * read through a stream_descriptor instead of a read thread polling with VTIME.
+ *
  * v1.03: C++11 support
  *
  * v1.02: Fixed a bug in BufferedAsyncSerial: Using the default constructor
@@ -14,23 +17,21 @@
  * v1.00: First release.
  *
  * IMPORTANT:
- * On Mac OS X boost asio's serial ports have bugs, and the usual implementation
- * of this class does not work. So a workaround class was written temporarily,
- * until asio (hopefully) will fix Mac compatibility for serial ports.
- *
- * Please note that unlike said in the documentation on OS X until asio will
- * be fixed serial port *writes* are *not* asynchronous, but at least
- * asynchronous *read* works.
- * In addition the serial port open ignores the following options: parity,
+ * On Mac OS X asio's serial ports have bugs, so the tty is opened and set up
+ * by hand and handed over to a posix::stream_descriptor. Reads and writes are
+ * asynchronous as on the other platforms.
+ * On OS X the serial port open ignores the following options: parity,
  * character size, flow, stop bits, and defaults to 8N1 format.
- * I know it is bad but at least it's better than nothing.
  *
  */
 
 #include "AsyncSerial.h"
+#include "DccIoContext.hpp"
+#include "SpscRingBuffer.hpp"
 
 #include <algorithm>
-
+#include <atomic>
+#include <future>
 #include <iostream>
 #include <mutex>
 #include <string>
@@ -43,319 +44,99 @@ using namespace std;
 // Class AsyncSerial
 //
 
-#ifndef __APPLE__
-
-class AsyncSerialImpl : private asio::noncopyable {
-public:
-  AsyncSerialImpl()
-      : io(), port(io), backgroundThread(), open(false), error(false) {}
-
-  asio::io_context io;            ///< Io service object
-  asio::serial_port port;         ///< Serial port object
-  std::thread backgroundThread;  ///< Thread that runs read/write operations
-  bool open;                     ///< True if port open
-  bool error;                    ///< Error flag
-  mutable std::mutex errorMutex; ///< Mutex for access to error
-
-  /// Data are queued here before they go in writeBuffer
-  std::vector<char> writeQueue;
-  std::shared_ptr<char> writeBuffer; ///< Data being written
-  size_t writeBufferSize;                ///< Size of writeBuffer
-  std::mutex writeQueueMutex;            ///< Mutex for access to writeQueue
-  char readBuffer[AsyncSerial::readBufferSize]; ///< data being read
-
-  /// Read complete callback
-  std::function<void(const char *, size_t)> callback;
-};
-
-AsyncSerial::AsyncSerial() : pimpl(new AsyncSerialImpl) {}
-
-AsyncSerial::AsyncSerial(const std::string &devname, unsigned int baud_rate,
-                         asio::serial_port_base::parity opt_parity,
-                         asio::serial_port_base::character_size opt_csize,
-                         asio::serial_port_base::flow_control opt_flow,
-                         asio::serial_port_base::stop_bits opt_stop)
-    : pimpl(new AsyncSerialImpl) {
-  open(devname, baud_rate, opt_parity, opt_csize, opt_flow, opt_stop);
-}
-
-void AsyncSerial::open(const std::string &devname, unsigned int baud_rate,
-                       asio::serial_port_base::parity opt_parity,
-                       asio::serial_port_base::character_size opt_csize,
-                       asio::serial_port_base::flow_control opt_flow,
-                       asio::serial_port_base::stop_bits opt_stop) {
-  if (isOpen())
-    close();
-
-  setErrorStatus(true); // If an exception is thrown, error_ remains true
-  pimpl->port.open(devname);
-  pimpl->port.set_option(asio::serial_port_base::baud_rate(baud_rate));
-  pimpl->port.set_option(opt_parity);
-  pimpl->port.set_option(opt_csize);
-  pimpl->port.set_option(opt_flow);
-  pimpl->port.set_option(opt_stop);
-
-
-
-  // This gives some work to the io_service before it is started
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncSerial::doRead, this));
-
-  // pimpl->io.get_executor().post(std::bind(&AsyncSerial::doRead, this), &a);
-
-  thread t(std::bind(&asio::io_context::run, &pimpl->io));
-  pimpl->backgroundThread.swap(t);
-  setErrorStatus(false); // If we get here, no error
-  pimpl->open = true;    // Port is now open
-}
-
-bool AsyncSerial::isOpen() const { return pimpl->open; }
-
-bool AsyncSerial::errorStatus() const {
-  lock_guard<mutex> l(pimpl->errorMutex);
-  return pimpl->error;
-}
-
-void AsyncSerial::close() {
-  if (!isOpen())
-    return;
-
-  pimpl->open = false;
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncSerial::doClose, this));
-  // pimpl->io.get_executor().post(std::bind(&AsyncSerial::doClose, this));
-  pimpl->backgroundThread.join();
-  pimpl->io.restart();
-  if (errorStatus()) {
-    throw(std::system_error(std::error_code(),
-                                      "Error while closing the device"));
-  }
-}
-
-void AsyncSerial::write(const char *data, size_t size) {
-  {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeQueue.insert(pimpl->writeQueue.end(), data, data + size);
-  }
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncSerial::doWrite, this));
-  // pimpl->io.get_executor().post(std::bind(&AsyncSerial::doWrite, this));
-}
-
-void AsyncSerial::write(const std::vector<char> &data) {
-  {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeQueue.insert(pimpl->writeQueue.end(), data.begin(), data.end());
-  }
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncSerial::doWrite, this));
-  // pimpl->io.get_executor().post(std::bind(&AsyncSerial::doWrite, this));
-}
-
-void AsyncSerial::writeString(const std::string &s) {
-  {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeQueue.insert(pimpl->writeQueue.end(), s.begin(), s.end());
-  }
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncSerial::doWrite, this));
-  // pimpl->io.get_executor().post(stderr::bind(&AsyncSerial::doWrite, this));
-}
-
-AsyncSerial::~AsyncSerial() {
-  if (isOpen()) {
-    try {
-      close();
-    } catch (...) {
-      // Don't throw from a destructor
-    }
-  }
-}
-
-void AsyncSerial::doRead() {
-  pimpl->port.async_read_some(
-      asio::buffer(pimpl->readBuffer, readBufferSize),
-      std::bind(&AsyncSerial::readEnd, this, std::placeholders::_1,
-                  std::placeholders::_2));
-}
-
-void AsyncSerial::readEnd(const std::error_code &error,
-                          size_t bytes_transferred) {
-  if (error) {
 #ifdef __APPLE__
-    if (error.value() == 45) {
-      // Bug on OS X, it might be necessary to repeat the setup
-      // http://osdir.com/ml/lib.boost.asio.user/2008-08/msg00004.html
-      doRead();
-      return;
-    }
-#endif //__APPLE__
-    // error can be true even because the serial port was closed.
-    // In this case it is not a real error, so ignore
-    if (isOpen()) {
-      doClose();
-      setErrorStatus(true);
-    }
-  } else {
-    if (pimpl->callback)
-      pimpl->callback(pimpl->readBuffer, bytes_transferred);
-    doRead();
-  }
-}
-
-void AsyncSerial::doWrite() {
-  // If a write operation is already in progress, do nothing
-  if (pimpl->writeBuffer == 0) {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeBufferSize = pimpl->writeQueue.size();
-    pimpl->writeBuffer.reset(new char[pimpl->writeQueue.size()]);
-    copy(pimpl->writeQueue.begin(), pimpl->writeQueue.end(),
-         pimpl->writeBuffer.get());
-    pimpl->writeQueue.clear();
-    async_write(
-        pimpl->port,
-        asio::buffer(pimpl->writeBuffer.get(), pimpl->writeBufferSize),
-        std::bind(&AsyncSerial::writeEnd, this, std::placeholders::_1));
-  }
-}
-
-void AsyncSerial::writeEnd(const std::error_code &error) {
-  if (!error) {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    if (pimpl->writeQueue.empty()) {
-      pimpl->writeBuffer.reset();
-      pimpl->writeBufferSize = 0;
-
-      return;
-    }
-    pimpl->writeBufferSize = pimpl->writeQueue.size();
-    pimpl->writeBuffer.reset(new char[pimpl->writeQueue.size()]);
-    copy(pimpl->writeQueue.begin(), pimpl->writeQueue.end(),
-         pimpl->writeBuffer.get());
-    pimpl->writeQueue.clear();
-    async_write(
-        pimpl->port,
-        asio::buffer(pimpl->writeBuffer.get(), pimpl->writeBufferSize),
-        std::bind(&AsyncSerial::writeEnd, this, std::placeholders::_1));
-  } else {
-    setErrorStatus(true);
-    doClose();
-  }
-}
-
-void AsyncSerial::doClose() {
-  std::error_code ec;
-  pimpl->port.cancel(ec);
-  if (ec)
-    setErrorStatus(true);
-  pimpl->port.close(ec);
-  if (ec)
-    setErrorStatus(true);
-}
-
-void AsyncSerial::setErrorStatus(bool e) {
-  lock_guard<mutex> l(pimpl->errorMutex);
-  pimpl->error = e;
-}
-
-void AsyncSerial::setReadCallback(
-    const std::function<void(const char *, size_t)> &callback) {
-  pimpl->callback = callback;
-}
-
-void AsyncSerial::clearReadCallback() {
-  std::function<void(const char *, size_t)> empty;
-  pimpl->callback.swap(empty);
-}
-
-#else //__APPLE__
 
 #include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
-
-
-#define UNUSED(p) ((p)=(p))
-
-class AsyncSerialImpl : private asio::noncopyable {
-public:
-  AsyncSerialImpl() : backgroundThread(), open(false), error(false) {}
-
-  std::thread backgroundThread;  ///< Thread that runs read operations
-  bool open;                     ///< True if port open
-  bool error;                    ///< Error flag
-  mutable std::mutex errorMutex; ///< Mutex for access to error
-
-  int fd; ///< File descriptor for serial port
-
-  char readBuffer[AsyncSerial::readBufferSize]; ///< data being read
-
-  /// Read complete callback
-  std::function<void(const char *, size_t)> callback;
-};
-
-AsyncSerial::AsyncSerial() : pimpl(std::make_unique<AsyncSerialImpl>()) {}
-
-AsyncSerial::AsyncSerial(const std::string &devname, unsigned int baud_rate,
-                         asio::serial_port_base::parity opt_parity,
-                         asio::serial_port_base::character_size opt_csize,
-                         asio::serial_port_base::flow_control opt_flow,
-                         asio::serial_port_base::stop_bits opt_stop)
-    : pimpl(new AsyncSerialImpl) {
-  open(devname, baud_rate, opt_parity, opt_csize, opt_flow, opt_stop);
-}
-
-void AsyncSerial::open(const std::string &devname, unsigned int baud_rate,
-                       asio::serial_port_base::parity opt_parity,
-                       asio::serial_port_base::character_size opt_csize,
-                       asio::serial_port_base::flow_control opt_flow,
-                       asio::serial_port_base::stop_bits opt_stop) {
-
-  UNUSED(opt_parity);  // stop compiler warnings
-  UNUSED(opt_csize);
-  UNUSED(opt_flow);
-  UNUSED(opt_stop);
-
-  if (isOpen())
-    close();
-
-  setErrorStatus(true); // If an exception is thrown, error remains true
+#include <IOKit/serial/ioss.h>
+
+/// asio's serial_port doesn't work on OS X; the tty is set up by hand and
+/// read through a stream_descriptor so it still goes through the reactor
+typedef asio::posix::stream_descriptor SerialStream;
+
+/**
+ * Opens and configures the tty. Reads return as soon as one byte is there
+ * (VMIN=1, VTIME=0); the descriptor itself is non blocking so a read is only
+ * issued when kqueue reports the fd as readable.
+ * Speeds without a Bxxx constant e.g. 460800 or 1000000 for USB-CDC boards are
+ * set with IOSSIOSPEED after the other attributes.
+ */
+static int openTty(const std::string &devname, unsigned int baud_rate,
+                   asio::serial_port_base::parity opt_parity,
+                   asio::serial_port_base::character_size opt_csize,
+                   asio::serial_port_base::flow_control opt_flow,
+                   asio::serial_port_base::stop_bits opt_stop) {
+  int fd = ::open(devname.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    throw(std::system_error(std::error_code(errno, std::system_category()),
+                            "Failed to open port"));
 
   struct termios new_attributes;
   speed_t speed;
-  int status;
-
-  // Open port
-  pimpl->fd = ::open(devname.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
-  if (pimpl->fd < 0)
-    throw(std::system_error(std::error_code(), "Failed to open port"));
 
-  // Set Port parameters.
-  status = tcgetattr(pimpl->fd, &new_attributes);
-  if (status < 0 || !isatty(pimpl->fd)) {
-    ::close(pimpl->fd);
+  if (tcgetattr(fd, &new_attributes) < 0 || !isatty(fd)) {
+    ::close(fd);
     throw(std::system_error(std::error_code(), "Device is not a tty"));
   }
   new_attributes.c_iflag = IGNBRK;
   new_attributes.c_oflag = 0;
   new_attributes.c_lflag = 0;
-  new_attributes.c_cflag = (CS8 | CREAD | CLOCAL); //8 data bit,Enable
-  // receiver,Ignore modem
-
-//   new_attributes.c_cflag &= ~PARENB; // No parity bit is added to the output characters
-//   new_attributes.c_cflag &= ~CSTOPB; // Only one stop-bit is used
-//   new_attributes.c_cflag &= ~CSIZE; // CSIZE is a mask for the number of bits per character
-//   new_attributes.c_cflag |= CS8;     // Set to 8 bits per character
-//   new_attributes.c_cflag &= ~CRTSCTS; // Disable hadrware flow control (RTS/CTS)
-//   new_attributes.c_cflag |= CREAD | CLOCAL; // Turn on READ & ignore ctrl lines (CLOCAL = 1)
-
-  /* In non canonical mode (Ctrl-C and other disabled, no echo,...) VMIN and
-  VTIME work this way: if the function read() has'nt read at least VMIN chars it
-  waits until has read at least VMIN chars (even if VTIME timeout expires); once
-  it has read at least vmin chars, if subsequent chars do not arrive before
-  VTIME expires, it returns error; if a char arrives, it resets the
-  timeout, so the internal timer will again start from zero (for the nex char,if
-  any)*/
-
-  new_attributes.c_cc[VMIN] = 0; // Minimum number of characters to read before returning error
-  new_attributes.c_cc[VTIME] = 1; // Set timeouts in tenths of second
+  new_attributes.c_cflag = (CREAD | CLOCAL); // enable receiver, ignore modem
+  new_attributes.c_cc[VMIN] = 1;
+  new_attributes.c_cc[VTIME] = 0;
+
+  switch (opt_csize.value()) {
+  case 5:
+    new_attributes.c_cflag |= CS5;
+    break;
+  case 6:
+    new_attributes.c_cflag |= CS6;
+    break;
+  case 7:
+    new_attributes.c_cflag |= CS7;
+    break;
+  default:
+    new_attributes.c_cflag |= CS8;
+    break;
+  }
+
+  switch (opt_parity.value()) {
+  case asio::serial_port_base::parity::odd:
+    new_attributes.c_cflag |= PARENB | PARODD;
+    new_attributes.c_iflag |= INPCK;
+    break;
+  case asio::serial_port_base::parity::even:
+    new_attributes.c_cflag |= PARENB;
+    new_attributes.c_iflag |= INPCK;
+    break;
+  default:
+    break;
+  }
+
+  switch (opt_flow.value()) {
+  case asio::serial_port_base::flow_control::hardware:
+    new_attributes.c_cflag |= CRTSCTS;
+    break;
+  case asio::serial_port_base::flow_control::software:
+    new_attributes.c_iflag |= IXON | IXOFF;
+    break;
+  default:
+    break;
+  }
+
+  switch (opt_stop.value()) {
+  case asio::serial_port_base::stop_bits::two:
+    new_attributes.c_cflag |= CSTOPB;
+    break;
+  case asio::serial_port_base::stop_bits::onepointfive:
+    ::close(fd);
+    throw(std::system_error(std::make_error_code(std::errc::operation_not_supported),
+                            "1.5 stop bits are not supported"));
+  default:
+    break;
+  }
 
   // Set baud rate
   switch (baud_rate) {
@@ -413,53 +194,186 @@ void AsyncSerial::open(const std::string &devname, unsigned int baud_rate,
   case 230400:
     speed = B230400;
     break;
-  default: {
-    ::close(pimpl->fd);
-    throw(std::system_error(std::error_code(),
-                                      "Unsupported baud rate"));
-  }
+  default:
+    speed = B9600; // replaced by IOSSIOSPEED below
+    break;
   }
 
   cfsetospeed(&new_attributes, speed);
   cfsetispeed(&new_attributes, speed);
 
-  // Make changes effective
-  status = tcsetattr(pimpl->fd, TCSANOW, &new_attributes);
-  if (status < 0) {
-    ::close(pimpl->fd);
-    throw(std::system_error(std::error_code(),
-                                      "Can't set port attributes"));
+  if (tcsetattr(fd, TCSANOW, &new_attributes) < 0) {
+    ::close(fd);
+    throw(std::system_error(std::error_code(errno, std::system_category()),
+                            "Can't set port attributes"));
   }
 
-  // These 3 lines clear the O_NONBLOCK flag
-  status = fcntl(pimpl->fd, F_GETFL, 0);
-  if (status != -1)
-    fcntl(pimpl->fd, F_SETFL, status & ~O_NONBLOCK);
+  if (speed != baud_rate) {
+    speed_t custom = baud_rate;
+    if (ioctl(fd, IOSSIOSPEED, &custom) < 0) {
+      ::close(fd);
+      throw(std::system_error(std::error_code(errno, std::system_category()),
+                              "Unsupported baud rate"));
+    }
+  }
+  return fd;
+}
+
+/**
+ * Lowest receive latency the driver supports; the driver otherwise
+ * buffers incoming data for a while before handing it out
+ */
+static int ttySetLowLatency(int fd, bool on) {
+  unsigned long latency = on ? 1 : 0; // microseconds; 0 is the driver default
+  return ioctl(fd, IOSSDATALAT, &latency) < 0 ? errno : 0;
+}
+
+#else
+
+typedef asio::serial_port SerialStream;
+
+#ifdef __linux__
+// AsyncSerialSpeed.cpp; needs the kernel termios2 which can't be mixed with <termios.h>
+int ttySetBaudRate(int fd, unsigned int baud_rate);
+int ttySetLowLatency(int fd, bool on);
+#endif
+
+#endif //__APPLE__
+
+class AsyncSerialImpl : private asio::noncopyable {
+public:
+  AsyncSerialImpl()
+      : strand(asio::make_strand(DccIoContext::get())), port(strand), open(false), error(false),
+        writeScheduled(false), writing(false), ops(0) {}
+
+  asio::strand<asio::io_context::executor_type> strand; ///< Serializes the handlers of this port on the shared io_context
+  SerialStream port;             ///< Serial port object
+  bool open;                     ///< True if port open
+  bool error;                    ///< Error flag
+  mutable std::mutex errorMutex; ///< Mutex for access to error
+
+  /// Data are queued here by write() and sent from the io thread
+  SpscRingBuffer<AsyncSerial::writeQueueSize> writeQueue;
+  std::atomic<bool> writeScheduled; ///< doWrite has been posted but not yet run
+  bool writing;                     ///< async_write in progress; io thread only
+  std::atomic<int> ops;             ///< handlers posted or in flight; close() waits for them
+  char readBuffer[AsyncSerial::readBufferSize]; ///< data being read
+
+  /// Read complete callback
+  std::function<void(const char *, size_t)> callback;
+  /// Port failure callback
+  std::function<void(const std::error_code &)> errorCallback;
+};
+
+AsyncSerial::AsyncSerial() : pimpl(new AsyncSerialImpl) {}
+
+AsyncSerial::AsyncSerial(const std::string &devname, unsigned int baud_rate,
+                         asio::serial_port_base::parity opt_parity,
+                         asio::serial_port_base::character_size opt_csize,
+                         asio::serial_port_base::flow_control opt_flow,
+                         asio::serial_port_base::stop_bits opt_stop)
+    : pimpl(new AsyncSerialImpl) {
+  open(devname, baud_rate, opt_parity, opt_csize, opt_flow, opt_stop);
+}
+
+void AsyncSerial::open(const std::string &devname, unsigned int baud_rate,
+                       asio::serial_port_base::parity opt_parity,
+                       asio::serial_port_base::character_size opt_csize,
+                       asio::serial_port_base::flow_control opt_flow,
+                       asio::serial_port_base::stop_bits opt_stop) {
+  if (isOpen()) {
+    try {
+      close();
+    } catch (...) {
+      // the old port may have failed already; we're replacing it anyway
+    }
+  }
+
+  setErrorStatus(true); // If an exception is thrown, error_ remains true
+#ifdef __APPLE__
+  pimpl->port.assign(openTty(devname, baud_rate, opt_parity, opt_csize, opt_flow, opt_stop));
+#else
+  pimpl->port.open(devname);
+  try {
+    pimpl->port.set_option(opt_parity);
+    pimpl->port.set_option(opt_csize);
+    pimpl->port.set_option(opt_flow);
+    pimpl->port.set_option(opt_stop);
+    // the speed goes last; the options above go through the plain termios
+    // calls which would drop a custom speed
+    std::error_code ec;
+    pimpl->port.set_option(asio::serial_port_base::baud_rate(baud_rate), ec);
+    if (ec) {
+#ifdef __linux__
+      int err = ttySetBaudRate(pimpl->port.native_handle(), baud_rate);
+      if (err != 0)
+        throw(std::system_error(std::error_code(err, std::system_category()),
+                                "Unsupported baud rate"));
+#else
+      throw(std::system_error(ec, "Unsupported baud rate"));
+#endif
+    }
+  } catch (...) {
+    std::error_code ignored;
+    pimpl->port.close(ignored); // don't keep the device busy
+    throw;
+  }
+#endif
+
+  pimpl->writeQueue.clear();
+  pimpl->writeScheduled = false;
+  pimpl->writing = false;
+
+  // Start reading on the shared io_context
+  pimpl->ops++;
+  asio::post(pimpl->strand, [this] { doRead(); pimpl->ops--; });
 
   setErrorStatus(false); // If we get here, no error
   pimpl->open = true;    // Port is now open
-
-  thread t(std::bind(&AsyncSerial::doRead, this));
-  pimpl->backgroundThread.swap(t);
 }
 
 bool AsyncSerial::isOpen() const { return pimpl->open; }
 
+bool AsyncSerial::setLowLatency(bool on) {
+#if defined(__APPLE__) || defined(__linux__)
+  if (!isOpen())
+    return false;
+  return ttySetLowLatency(pimpl->port.native_handle(), on) == 0;
+#else
+  (void)on;
+  return false;
+#endif
+}
+
 bool AsyncSerial::errorStatus() const {
-  std::lock_guard<mutex> l(pimpl->errorMutex);
+  lock_guard<mutex> l(pimpl->errorMutex);
   return pimpl->error;
 }
 
+size_t AsyncSerial::queued() const { return pimpl->writeQueue.used(); }
+
 void AsyncSerial::close() {
   if (!isOpen())
     return;
 
   pimpl->open = false;
-
-  ::close(pimpl->fd); // The thread waiting on I/O should return
-
-  pimpl->backgroundThread.join();
-
+  setErrorStatus(false); // only errors of the close itself are reported
+  if (pimpl->strand.running_in_this_thread()) {
+    // called from one of our handlers; the cancelled ones come back after it returns
+    doClose();
+  } else if (DccIoContext::runningInThisThread()) {
+    // waiting here could block the only io thread the close has to run on
+    pimpl->ops++;
+    asio::post(pimpl->strand, [this] { doClose(); pimpl->ops--; });
+    return;
+  } else {
+    std::promise<void> closed;
+    asio::post(pimpl->strand, [this, &closed] { doClose(); closed.set_value(); });
+    closed.get_future().wait();
+    // the cancelled operations still have to come back before the port can go away
+    while (pimpl->ops.load() > 0)
+      std::this_thread::yield();
+  }
   if (errorStatus()) {
     throw(std::system_error(std::error_code(),
                                       "Error while closing the device"));
@@ -467,18 +381,30 @@ void AsyncSerial::close() {
 }
 
 void AsyncSerial::write(const char *data, size_t size) {
-  if (::write(pimpl->fd, data, size) != size)
-    setErrorStatus(true);
+  while (size > 0) {
+    size_t n = pimpl->writeQueue.push(data, size);
+    data += n;
+    size -= n;
+    // only one doWrite needs to be pending; it sends whatever has been queued
+    if (!pimpl->writeScheduled.exchange(true)) {
+      pimpl->ops++;
+      asio::post(pimpl->strand, [this] { doWrite(); pimpl->ops--; });
+    }
+    if (size > 0) {
+      // queue is full; wait for the io thread unless nobody is draining it
+      if (!isOpen() || errorStatus())
+        return;
+      std::this_thread::yield();
+    }
+  }
 }
 
 void AsyncSerial::write(const std::vector<char> &data) {
-  if (::write(pimpl->fd, &data[0], data.size()) != (size_t)data.size())
-    setErrorStatus(true);
+  write(data.data(), data.size());
 }
 
 void AsyncSerial::writeString(const std::string &s) {
-  if (::write(pimpl->fd, &s[0], s.size()) != (size_t)s.size())
-    setErrorStatus(true);
+  write(s.data(), s.size());
 }
 
 AsyncSerial::~AsyncSerial() {
@@ -492,41 +418,88 @@ AsyncSerial::~AsyncSerial() {
 }
 
 void AsyncSerial::doRead() {
-  // Read loop in spawned thread
-  for (;;) {
-    int received = ::read(pimpl->fd, pimpl->readBuffer, readBufferSize);
-    if (received < 0) {
-      if (isOpen() == false)
-        return; // Thread interrupted because port closed
-      else {
-        setErrorStatus(true);
-        continue;
-      }
-    }
-    if (pimpl->callback)
-      pimpl->callback(pimpl->readBuffer, received);
-  }
+  pimpl->ops++;
+  pimpl->port.async_read_some(
+      asio::buffer(pimpl->readBuffer, readBufferSize),
+      [this](const std::error_code &error, size_t bytes_transferred) {
+        readEnd(error, bytes_transferred);
+        pimpl->ops--;
+      });
 }
 
 void AsyncSerial::readEnd(const std::error_code &error,
                           size_t bytes_transferred) {
-  // Not used
-  // UNUSED(error); 
-  (void)(error);
-  UNUSED(bytes_transferred);
+  if (error) {
+#ifdef __APPLE__
+    if (error.value() == 45) {
+      // Bug on OS X, it might be necessary to repeat the setup
+      // http://osdir.com/ml/lib.boost.asio.user/2008-08/msg00004.html
+      doRead();
+      return;
+    }
+#endif //__APPLE__
+    // error can be true even because the serial port was closed.
+    // In this case it is not a real error, so ignore
+    if (isOpen()) {
+      doClose();
+      setErrorStatus(true);
+      if (pimpl->errorCallback)
+        pimpl->errorCallback(error);
+    }
+  } else {
+    if (pimpl->callback)
+      pimpl->callback(pimpl->readBuffer, bytes_transferred);
+    doRead();
+  }
 }
 
 void AsyncSerial::doWrite() {
-  // Not used
-}
+  pimpl->writeScheduled = false;
+  // If a write operation is already in progress, do nothing
+  if (pimpl->writing)
+    return;
+
+  auto queued = pimpl->writeQueue.spans();
+  if (queued.size() == 0)
+    return;
 
-void AsyncSerial::writeEnd(const std::error_code &error) {
-  // Not used
-  (void)(error);
+  pimpl->writing = true;
+  pimpl->ops++;
+  std::array<asio::const_buffer, 2> buffers = {
+      asio::buffer(queued.first, queued.firstSize),
+      asio::buffer(queued.second, queued.secondSize)};
+  async_write(
+      pimpl->port, buffers,
+      [this](const std::error_code &error, size_t bytes_transferred) {
+        writeEnd(error, bytes_transferred);
+        pimpl->ops--;
+      });
+}
+
+void AsyncSerial::writeEnd(const std::error_code &error,
+                           size_t bytes_transferred) {
+  pimpl->writing = false;
+  if (!error) {
+    pimpl->writeQueue.consume(bytes_transferred);
+    doWrite(); // anything queued in the meantime
+  } else {
+    setErrorStatus(true);
+    doClose();
+    if (isOpen() && pimpl->errorCallback)
+      pimpl->errorCallback(error);
+  }
 }
 
 void AsyncSerial::doClose() {
-  // Not used
+  if (!pimpl->port.is_open())
+    return; // already closed after an error
+  std::error_code ec;
+  pimpl->port.cancel(ec);
+  if (ec)
+    setErrorStatus(true);
+  pimpl->port.close(ec);
+  if (ec)
+    setErrorStatus(true);
 }
 
 void AsyncSerial::setErrorStatus(bool e) {
@@ -539,12 +512,16 @@ void AsyncSerial::setReadCallback(
   pimpl->callback = callback;
 }
 
+void AsyncSerial::setErrorCallback(
+    const std::function<void(const std::error_code &)> &callback) {
+  pimpl->errorCallback = callback;
+}
+
 void AsyncSerial::clearReadCallback() {
   std::function<void(const char *, size_t)> empty;
   pimpl->callback.swap(empty);
 }
 
-#endif //__APPLE__
 
 //
 // Class CallbackAsyncSerial
@@ -74,13 +74,27 @@ public:
      */
     bool isOpen() const;
 
+    /**
+     * Asks the driver to hand out recieved data right away instead of
+     * buffering it ( ASYNC_LOW_LATENCY on Linux, IOSSDATALAT on OS X )
+     * \param on true for low latency, false for the driver default
+     * \return false if the driver doesn't support it
+     */
+    bool setLowLatency(bool on);
+
     /**
      * \return true if error were found
      */
     bool errorStatus() const;
 
     /**
-     * Close the serial device
+     * \return number of bytes waiting in the write queue
+     */
+    size_t queued() const;
+
+    /**
+     * Close the serial device. Called on an io thread the close is only started;
+     * the port must not be destroyed from there
      * \throws system::system_error if any error
      */
     void close();
@@ -106,12 +120,24 @@ public:
     */
     void writeString(const std::string& s);
 
+    /**
+     * Set the callback called on the io thread when the port fails while
+     * open e.g. the usb cable has been pulled. Not called by close().
+     */
+    void setErrorCallback(const std::function<void (const std::error_code&)>& callback);
+
     virtual ~AsyncSerial()=0;
 
     /**
-     * Read buffer maximum size
+     * Read buffer maximum size; large enough to take what the tty layer
+     * hands out in one read so a burst of diags needs a single callback
+     */
+    static const int readBufferSize=4096;
+
+    /**
+     * Write queue size, must be a power of two
      */
-    static const int readBufferSize=512;
+    static const size_t writeQueueSize=16384;
 private:
 
     /**
@@ -136,10 +162,11 @@ private:
 
     /**
      * Callback called at the end of an asynchronuous write operation,
-     * if there is more data to write, restarts a new write operation.
+     * releases the written data from the queue and, if there is more
+     * data to write, restarts a new write operation.
      * This callback is called by the io_service in the spawned thread.
      */
-    void writeEnd(const std::error_code& error);
+    void writeEnd(const std::error_code& error, size_t bytes_transferred);
 
     /**
      * Callback to close serial port
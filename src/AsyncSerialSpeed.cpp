@@ -0,0 +1,75 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * Linux specific tty settings for AsyncSerial. They need the kernel's termios2
+ * definitions which clash with <termios.h> as included by asio, hence the
+ * separate translation unit.
+ */
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+
+/**
+ * Sets any speed e.g. 460800 or 2000000 for USB-CDC boards with BOTHER
+ * \return 0 or errno
+ */
+int ttySetBaudRate(int fd, unsigned int baud_rate) {
+  struct termios2 tio;
+
+  if (ioctl(fd, TCGETS2, &tio) < 0)
+    return errno;
+
+  tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = baud_rate;
+  tio.c_ospeed = baud_rate;
+
+  if (ioctl(fd, TCSETS2, &tio) < 0)
+    return errno;
+  return 0;
+}
+
+/**
+ * ASYNC_LOW_LATENCY; the driver hands out recieved data right away instead
+ * of collecting it for a tick. Not supported by all drivers e.g. not by ptys.
+ * \return 0 or errno
+ */
+int ttySetLowLatency(int fd, bool on) {
+  struct serial_struct ss;
+
+  if (ioctl(fd, TIOCGSERIAL, &ss) < 0)
+    return errno;
+
+  if (on)
+    ss.flags |= ASYNC_LOW_LATENCY;
+  else
+    ss.flags &= ~ASYNC_LOW_LATENCY;
+
+  if (ioctl(fd, TIOCSSERIAL, &ss) < 0)
+    return errno;
+  return 0;
+}
+
+#endif // __linux__
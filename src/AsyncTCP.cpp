@@ -21,6 +21,7 @@
 #include "AsyncTCP.hpp"
 
 #include <algorithm>
+#include <future>
 #include <iostream>
 #include <mutex>
 #include <string>
@@ -28,7 +29,11 @@
 #include <memory>
 #include <asio.hpp>
 
+#include <fmt/core.h>
+
 #include "Diag.hpp"
+#include "DccIoContext.hpp"
+#include "SpscRingBuffer.hpp"
 
 using namespace std;
 
@@ -40,29 +45,34 @@ class AsyncTCPImpl : private asio::noncopyable {
 
 public:
 
-  asio::io_context io;                         ///< Io context object   
+  asio::strand<asio::io_context::executor_type> strand; ///< Serializes the handlers of this connection on the shared io_context
   asio::ip::tcp::socket csSocket;              ///< CommandStation socket
   asio::ip::tcp::resolver resolver;
+  asio::steady_timer coalesceTimer;           ///< delays the write to collect more data
+  AsyncTCPOptions options;
 
-  std::thread backgroundThread;               ///< Thread that runs read/write operations
   bool open;                                  ///< True if port open
   bool error;                                 ///< Error flag
   mutable std::mutex errorMutex;              ///< Mutex for access to error
 
-  /// Data are queued here before they go in writeBuffer
-  std::vector<char> writeQueue;
-
-  std::shared_ptr<char> writeBuffer;          ///< Data being written
-  size_t writeBufferSize;                     ///< Size of writeBuffer
-  std::mutex writeQueueMutex;                 ///< Mutex for access to writeQueue
+  /// Data are queued here by write() and sent from the io thread
+  SpscRingBuffer<AsyncTCP::writeQueueSize> writeQueue;
+  std::atomic<bool> writeScheduled;           ///< doWrite has been posted but not yet run
+  bool writing;                               ///< async_write in progress; only used on the io thread
+  std::atomic<int> ops;                       ///< handlers posted or in flight; close() waits for them
+  std::shared_ptr<AsyncTCPConnect> connecting; ///< connect in progress; only used on the strand
+  std::string unsent;                         ///< left in the write queue by the failed connection
   // asio::streambuf readBuffer;
   char readBuffer[AsyncTCP::readBufferSize];  ///< data being read
 
   /// Read complete callback
   std::function<void(const char *, size_t)> callback;
+  /// Connection failure callback
+  std::function<void(const std::error_code &)> errorCallback;
 
   // Constructor
-  AsyncTCPImpl(): io(), csSocket(io), resolver(io), backgroundThread(), open(false), error(false) {}
+  AsyncTCPImpl(): strand(asio::make_strand(DccIoContext::get())), csSocket(strand), resolver(strand), coalesceTimer(strand), open(false), error(false), 
+                  writeScheduled(false), writing(false), ops(0) {}
 };
 
 
@@ -73,28 +83,176 @@ AsyncTCP::AsyncTCP(const std::string &ipAddress, const std::string &port) : pimp
 }
 
 void AsyncTCP::open(const std::string &ipAddress, const std::string &port) {
-  
-  if (isOpen()) {
-    close();
+  auto ec = openAsync(ipAddress, port).get();
+  if (ec) {
+    throw std::system_error(ec, fmt::format("Can't connect to {}:{}", ipAddress, port));
   }
+}
 
-  setErrorStatus(true); // If an exception is thrown, error_ remains true
+/**
+ * State of one connect; lives as long as any of its handlers. Everything runs
+ * on the strand of the connection.
+ */
+struct AsyncTCPConnect {
+  std::promise<std::error_code> result;
+  std::vector<asio::ip::tcp::endpoint> endpoints;
+  std::vector<std::shared_ptr<asio::ip::tcp::socket>> attempts;
+  size_t next = 0;                            ///< next endpoint to try
+  size_t failed = 0;
+  bool done = false;
+  asio::steady_timer deadline;
+  asio::steady_timer stagger;                 ///< starts the next attempt while the current one is still pending
+
+  AsyncTCPConnect(asio::strand<asio::io_context::executor_type> &strand) : deadline(strand), stagger(strand) {}
+};
 
-  asio::connect(pimpl->csSocket, pimpl->resolver.resolve(ipAddress, port));
-  
-  // This gives some work to the io_service before it is started
+std::future<std::error_code> AsyncTCP::openAsync(const std::string &ipAddress, const std::string &port) {
 
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncTCP::doRead, this));
+  try {
+    close(); // also stops a connect still in progress
+  } catch (...) {
+    // the old connection may have failed already; we're replacing it anyway
+  }
 
-  // io_context:: run should not return so the thread is active all the time ..
+  setErrorStatus(true); // remains true unless the connect succeeds
+
+  auto c = std::make_shared<AsyncTCPConnect>(pimpl->strand);
+  auto f = c->result.get_future();
+
+  pimpl->ops++;
+  asio::post(pimpl->strand, [this, c, ipAddress, port] {
+    pimpl->connecting = c;
+    pimpl->ops++;
+    c->deadline.expires_after(pimpl->options.connectTimeout);
+    c->deadline.async_wait([this, c](const std::error_code &ec) {
+      if (!ec)
+        connectDone(c, nullptr, asio::error::timed_out);
+      pimpl->ops--;
+    });
+
+    pimpl->ops++;
+    pimpl->resolver.async_resolve(ipAddress, port,
+        [this, c](const std::error_code &ec, asio::ip::tcp::resolver::results_type results) {
+          if (ec) {
+            connectDone(c, nullptr, ec);
+          } else if (!c->done) {
+            for (auto &r : results)
+              c->endpoints.push_back(r.endpoint());
+            if (c->endpoints.empty())
+              connectDone(c, nullptr, asio::error::host_not_found);
+            else
+              connectNext(c);
+          }
+          pimpl->ops--;
+        });
+    pimpl->ops--;
+  });
+  return f;
+}
 
-  asio::executor_work_guard<asio::io_context::executor_type> workGuard(pimpl->io.get_executor());
+/**
+ * Happy eyeballs: an attempt is started on the next address whenever the current
+ * one failed or hasn't succeeded within the stagger delay; the first one to
+ * connect wins.
+ */
+void AsyncTCP::connectNext(std::shared_ptr<AsyncTCPConnect> c) {
+  if (c->done || c->next >= c->endpoints.size()) {
+    return;
+  }
+  auto ep = c->endpoints[c->next++];
+  auto sock = std::make_shared<asio::ip::tcp::socket>(pimpl->strand);
+  c->attempts.push_back(sock);
+
+  pimpl->ops++;
+  sock->async_connect(ep, [this, c, sock](const std::error_code &ec) {
+    if (!ec) {
+      connectDone(c, sock, ec);
+    } else if (!c->done) {
+      if (++c->failed == c->endpoints.size())
+        connectDone(c, nullptr, ec);
+      else
+        connectNext(c);
+    }
+    pimpl->ops--;
+  });
+
+  if (c->next < c->endpoints.size()) {
+    pimpl->ops++;
+    c->stagger.expires_after(std::chrono::milliseconds(ASYNC_TCP_STAGGER));
+    c->stagger.async_wait([this, c](const std::error_code &ec) {
+      if (!ec)
+        connectNext(c);
+      pimpl->ops--;
+    });
+  }
+}
 
-  thread t(std::bind(&asio::io_context::run, &pimpl->io));
-  pimpl->backgroundThread.swap(t);
-  setErrorStatus(false); // If we get here, no error
-  pimpl->open = true;    // Port is now open
+void AsyncTCP::connectDone(std::shared_ptr<AsyncTCPConnect> c, std::shared_ptr<asio::ip::tcp::socket> sock, std::error_code ec) {
+  if (c->done) {
+    return;
+  }
+  c->done = true;
+  pimpl->connecting.reset();
+  c->deadline.cancel();
+  c->stagger.cancel();
+  pimpl->resolver.cancel();
+  for (auto &a : c->attempts) {
+    if (a != sock) {
+      std::error_code e;
+      a->close(e);
+    }
+  }
+
+  if (!sock) {
+    c->result.set_value(ec);
+    return;
+  }
+
+  pimpl->csSocket = std::move(*sock);
+  applyOptions();
+  // nothing writes or sends while connecting; whatever the old connection didn't get out is
+  // handed back to the owner instead of going out on the new one behind its back
+  auto left = pimpl->writeQueue.spans();
+  pimpl->unsent.assign(left.first, left.firstSize).append(left.second, left.secondSize);
+  pimpl->writeQueue.clear();
+  pimpl->writeScheduled = false;
+  pimpl->writing = false;
+
+  setErrorStatus(false);
+  pimpl->open = true;
+  doRead(); // already on the strand
+  c->result.set_value(std::error_code());
+}
+
+void AsyncTCP::setOptions(const AsyncTCPOptions &o) { pimpl->options = o; }
+
+const AsyncTCPOptions &AsyncTCP::getOptions() const { return pimpl->options; }
+
+/**
+ * Options the platform doesn't support are logged and otherwise ignored;
+ * the connection works without them
+ */
+void AsyncTCP::applyOptions() {
+  auto &o = pimpl->options;
+  auto &sock = pimpl->csSocket;
+  std::error_code ec;
 
+  sock.set_option(asio::ip::tcp::no_delay(o.noDelay), ec);
+  if (ec)
+    WARN("Can't set TCP_NODELAY: {}", ec.message());
+  sock.set_option(asio::socket_base::keep_alive(o.keepAlive), ec);
+  if (ec)
+    WARN("Can't set SO_KEEPALIVE: {}", ec.message());
+  if (o.sendBuffer > 0) {
+    sock.set_option(asio::socket_base::send_buffer_size(o.sendBuffer), ec);
+    if (ec)
+      WARN("Can't set the send buffer to {}: {}", o.sendBuffer, ec.message());
+  }
+  if (o.recieveBuffer > 0) {
+    sock.set_option(asio::socket_base::receive_buffer_size(o.recieveBuffer), ec);
+    if (ec)
+      WARN("Can't set the recieve buffer to {}: {}", o.recieveBuffer, ec.message());
+  }
 }
 
 bool AsyncTCP::isOpen() const { return pimpl->open; }
@@ -104,54 +262,98 @@ bool AsyncTCP::errorStatus() const {
   return pimpl->error;
 }
 
+size_t AsyncTCP::queued() const { return pimpl->writeQueue.used(); }
+
+std::string AsyncTCP::unsent() {
+  std::string s;
+  s.swap(pimpl->unsent); // set by the connect; open() has returned before this is called
+  return s;
+}
+
 void AsyncTCP::close() {
-  if (!isOpen()) {
+  // also runs if the connection isn't open; a connect may be in progress or the handlers
+  // of a failed one may still be pending and they all refer to this
+  bool wasOpen = pimpl->open;
+  pimpl->open = false;
+  if (!wasOpen && pimpl->ops.load() == 0) {
+    return; // nothing refers to this anymore
+  }
+  if (wasOpen) {
+    setErrorStatus(false); // only errors of the close itself are reported
+  }
+  if (pimpl->strand.get_inner_executor().context().stopped()) {
+    // on exit; the pending handlers won't run anymore
+    doClose();
+  } else if (pimpl->strand.running_in_this_thread()) {
+    // called from one of our handlers; the cancelled ones come back after it returns
+    doClose();
+  } else if (DccIoContext::runningInThisThread()) {
+    // waiting here could block the only io thread the close has to run on
+    pimpl->ops++;
+    asio::post(pimpl->strand, [this] { doClose(); pimpl->ops--; });
     return;
+  } else {
+    std::promise<void> closed;
+    asio::post(pimpl->strand, [this, &closed] { doClose(); closed.set_value(); });
+    closed.get_future().wait();
+    // the cancelled operations still have to come back before the socket can go away
+    while (pimpl->ops.load() > 0) {
+      std::this_thread::yield();
+    }
   }
 
-  pimpl->open = false;
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncTCP::doClose, this));
-  pimpl->backgroundThread.join();
-  pimpl->io.restart();
-  
-  if (errorStatus()) {
+  if (wasOpen && errorStatus()) {
     throw(std::system_error(std::error_code(), "Error while closing the device"));
   }
 }
 
 void AsyncTCP::write(const char *data, size_t size) {
-  
-  {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeQueue.insert(pimpl->writeQueue.end(), data, data + size);
+
+  while (size > 0) {
+    size_t n = pimpl->writeQueue.push(data, size);
+    data += n;
+    size -= n;
+    // only one doWrite needs to be pending; it sends whatever has been queued until it runs
+    if (!pimpl->writeScheduled.exchange(true)) {
+      pimpl->ops++;
+      asio::post(pimpl->strand, [this] { scheduleWrite(); pimpl->ops--; });
+    }
+    if (size > 0) {
+      // queue is full; wait for the io thread to catch up unless nobody is draining it
+      if (!isOpen() || errorStatus()) {
+        return;
+      }
+      std::this_thread::yield();
+    }
   }
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncTCP::doWrite, this));
 }
 
-void AsyncTCP::write(const std::vector<char> &data) {
-  
-  {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeQueue.insert(pimpl->writeQueue.end(), data.begin(), data.end());
+void AsyncTCP::flush() {
+  if (pimpl->writeQueue.empty()) {
+    return;
   }
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncTCP::doWrite, this));
+  pimpl->ops++;
+  asio::post(pimpl->strand, [this] {
+    pimpl->coalesceTimer.cancel();
+    doWrite();
+    pimpl->ops--;
+  });
+}
+
+void AsyncTCP::write(const std::vector<char> &data) {
+  write(data.data(), data.size());
 }
 
 void AsyncTCP::writeString(const std::string &s) {
-  {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeQueue.insert(pimpl->writeQueue.end(), s.begin(), s.end());
-  }
-  asio::post(pimpl->io.get_executor(), std::bind(&AsyncTCP::doWrite, this));
+  write(s.data(), s.size());
 }
 
 AsyncTCP::~AsyncTCP() {
-  if (isOpen()) {
-    try {
-      close();
-    } catch (...) {
-      // Don't throw from a destructor
-    }
+  // close() waits for the pending handlers whether the connection has been opened or not
+  try {
+    close();
+  } catch (...) {
+    // Don't throw from a destructor
   }
 }
 
@@ -175,19 +377,23 @@ void AsyncTCP::doRead() {
   //                             std::placeholders::_1,    // error
   //                             std::placeholders::_2));  // bytes_transfered )  
 
+  pimpl->ops++;
   pimpl->csSocket.async_read_some(
       asio::buffer(pimpl->readBuffer, readBufferSize),
-      std::bind(&AsyncTCP::readEnd, 
-                this, 
-                std::placeholders::_1,    // error
-                std::placeholders::_2));  // bytes_transfered
+      [this](const std::error_code &error, size_t bytes_transferred) {
+        readEnd(error, bytes_transferred);
+        pimpl->ops--;
+      });
 }
 
 void AsyncTCP::readEnd(const std::error_code &error, size_t bytes_transferred) {
   if (error) {
+    // error can be true even because the connection was closed; not a real error then
     if (isOpen()) {
       doClose();
       setErrorStatus(true);
+      if (pimpl->errorCallback)
+        pimpl->errorCallback(error);
     }
   } else {
     if (pimpl->callback)
@@ -196,50 +402,73 @@ void AsyncTCP::readEnd(const std::error_code &error, size_t bytes_transferred) {
   }
 }
 
+void AsyncTCP::scheduleWrite() {
+  auto window = pimpl->options.coalesce;
+  if (window.count() == 0 || pimpl->writing) {
+    doWrite(); // a write in progress collects anyway; writeEnd sends the rest
+    return;
+  }
+  pimpl->ops++;
+  pimpl->coalesceTimer.expires_after(window);
+  pimpl->coalesceTimer.async_wait([this](const std::error_code &ec) {
+    if (!ec)
+      doWrite(); // cancelled by flush or close otherwise
+    pimpl->ops--;
+  });
+}
+
 void AsyncTCP::doWrite() {
+  pimpl->writeScheduled = false;
+
   // If a write operation is already in progress, do nothing
+  if (pimpl->writing) {
+    return;
+  }
 
-  if (pimpl->writeBuffer == 0) {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    pimpl->writeBufferSize = pimpl->writeQueue.size();
-    pimpl->writeBuffer.reset(new char[pimpl->writeQueue.size()]);
-    copy(pimpl->writeQueue.begin(), pimpl->writeQueue.end(),
-         pimpl->writeBuffer.get());
-    pimpl->writeQueue.clear();
-    async_write(
-        pimpl->csSocket,
-        asio::buffer(pimpl->writeBuffer.get(), pimpl->writeBufferSize),
-        std::bind(&AsyncTCP::writeEnd, this, std::placeholders::_1));
+  auto queued = pimpl->writeQueue.spans();
+  if (queued.size() == 0) {
+    return;
   }
+
+  pimpl->writing = true;
+  pimpl->ops++;
+  std::array<asio::const_buffer, 2> buffers = {
+      asio::buffer(queued.first, queued.firstSize),
+      asio::buffer(queued.second, queued.secondSize)};
+  async_write(
+      pimpl->csSocket,
+      buffers,
+      [this](const std::error_code &error, size_t bytes_transferred) {
+        writeEnd(error, bytes_transferred);
+        pimpl->ops--;
+      });
 }
 
-void AsyncTCP::writeEnd(const std::error_code &error) {
+void AsyncTCP::writeEnd(const std::error_code &error, size_t bytes_transferred) {
 
+  pimpl->writing = false;
   if (!error) {
-    lock_guard<mutex> l(pimpl->writeQueueMutex);
-    if (pimpl->writeQueue.empty()) {
-      pimpl->writeBuffer.reset();
-      pimpl->writeBufferSize = 0;
-
-      return;
-    }
-    pimpl->writeBufferSize = pimpl->writeQueue.size();
-    pimpl->writeBuffer.reset(new char[pimpl->writeQueue.size()]);
-    copy(pimpl->writeQueue.begin(), pimpl->writeQueue.end(),
-         pimpl->writeBuffer.get());
-    pimpl->writeQueue.clear();
-    async_write(
-        pimpl->csSocket,
-        asio::buffer(pimpl->writeBuffer.get(), pimpl->writeBufferSize),
-        std::bind(&AsyncTCP::writeEnd, this, std::placeholders::_1));
+    pimpl->writeQueue.consume(bytes_transferred);
+    doWrite();   // anything queued in the meantime
   } else {
     setErrorStatus(true);
     doClose();
+    if (isOpen() && pimpl->errorCallback)
+      pimpl->errorCallback(error);
   }
 }
 
 void AsyncTCP::doClose() {
 
+  if (pimpl->connecting) {
+    // cancels the resolve, the timers and the attempts
+    connectDone(pimpl->connecting, nullptr, asio::error::operation_aborted);
+  }
+  pimpl->resolver.cancel();
+  pimpl->coalesceTimer.cancel();
+  if (!pimpl->csSocket.is_open()) {
+    return; // already closed after an error
+  }
   std::error_code ec;
   pimpl->csSocket.cancel(ec);
   if (ec)
@@ -258,6 +487,10 @@ void AsyncTCP::setReadCallback(const std::function<void(const char *, size_t)> &
   pimpl->callback = callback;
 }
 
+void AsyncTCP::setErrorCallback(const std::function<void(const std::error_code &)> &callback) {
+  pimpl->errorCallback = callback;
+}
+
 void AsyncTCP::clearReadCallback() {
   std::function<void(const char *, size_t)> empty;
   pimpl->callback.swap(empty);
@@ -21,17 +21,37 @@
 #ifndef ASYNCTCP_H
 #define	ASYNCTCP_H
 
+#include <chrono>
+#include <future>
+#include <string>
 #include <vector>
 #include <memory>
 #include <functional>
 
 #include <asio.hpp>
 
+#define ASYNC_TCP_CONNECT_TIMEOUT 3000 // ms
+#define ASYNC_TCP_STAGGER 250          // ms before the next address is tried in parallel
+
+/**
+ * Socket settings applied when the connection is opened
+ */
+struct AsyncTCPOptions
+{
+    bool noDelay = true;                    ///< TCP_NODELAY; commands are small and shouldn't wait for an ack
+    bool keepAlive = true;                  ///< SO_KEEPALIVE; notices a commandstation which went away silently
+    int sendBuffer = 0;                     ///< SO_SNDBUF in bytes; 0 keeps the OS default
+    int recieveBuffer = 0;                  ///< SO_RCVBUF in bytes; 0 keeps the OS default
+    std::chrono::microseconds coalesce{0};  ///< writes within this window go out in one segment
+    std::chrono::milliseconds connectTimeout{ASYNC_TCP_CONNECT_TIMEOUT}; ///< resolve and connect together
+};
+
 
 /**
  * Used internally (pimpl)
  */
 class AsyncTCPImpl;
+struct AsyncTCPConnect;
 
 class AsyncTCP: private asio::noncopyable
 {
@@ -40,10 +60,27 @@ public:
     AsyncTCP( const std::string& ipAddress, const std::string& port );  
 
 
+    /**
+     * Resolves the address and connects within the connect timeout of the options;
+     * blocks until connected or the timeout is over. Callers which must not block use openAsync.
+     * \throws std::system_error if the connection can't be made
+     */
     void open( const std::string& ipAddress, const std::string& port );   
+
+    /**
+     * Same as open but returns right away; the resolve and the connect run on the
+     * io_context. All addresses the name resolves to are tried, staggered by
+     * ASYNC_TCP_STAGGER, and the first one to connect is used.
+     * \return becomes ready with the outcome; must not be waited for on an io thread
+     */
+    std::future<std::error_code> openAsync( const std::string& ipAddress, const std::string& port );
+    void setOptions(const AsyncTCPOptions& o);   // used by the next open
+    const AsyncTCPOptions& getOptions() const;
     bool isOpen() const;        // true if tcp socket is connected 
     bool errorStatus() const;   // true if error were found
-    void close();               // close the TCP conection; throws system::system_error if any error
+    size_t queued() const;      // bytes waiting in the write queue
+    std::string unsent();       // takes what was still queued when the last connection failed; empty after that
+    void close();               // close the TCP conection or stop a connect in progress; throws system::system_error if any error. Only started on an io thread
 
     /**
      * Write data asynchronously. Returns immediately.
@@ -67,9 +104,22 @@ public:
     */
     void writeString(const std::string& s);
 
+    /**
+     * Sends what has been queued right away instead of at the end of the
+     * coalescing window. Returns immediately.
+     */
+    void flush();
+
+    /**
+     * Set the callback called on the io thread when the connection fails
+     * while open e.g. the commandstation went away. Not called by close().
+     */
+    void setErrorCallback(const std::function<void (const std::error_code&)>& callback);
+
     virtual ~AsyncTCP()=0;
 
     static const int readBufferSize = 128; // was 512
+    static const size_t writeQueueSize = 16384; // must be a power of two
 
     void read() { doRead(); };
 
@@ -88,6 +138,21 @@ private:
     void readEnd(const std::error_code& error,
         size_t bytes_transferred);
 
+    void connectNext(std::shared_ptr<AsyncTCPConnect> c);
+    void connectDone(std::shared_ptr<AsyncTCPConnect> c, std::shared_ptr<asio::ip::tcp::socket> sock, std::error_code ec);
+
+    /**
+     * Sets the socket options after the connect
+     */
+    void applyOptions();
+
+    /**
+     * Starts the write at the end of the coalescing window or right away
+     * if there is none.
+     * This callback is called by the io_service in the spawned thread.
+     */
+    void scheduleWrite();
+
     /**
      * Callback called to start an asynchronous write operation.
      * If it is already in progress, does nothing.
@@ -97,10 +162,11 @@ private:
 
     /**
      * Callback called at the end of an asynchronuous write operation,
-     * if there is more data to write, restarts a new write operation.
+     * releases the written data from the queue and, if there is more
+     * data to write, restarts a new write operation.
      * This callback is called by the io_service in the spawned thread.
      */
-    void writeEnd(const std::error_code& error);
+    void writeEnd(const std::error_code& error, size_t bytes_transferred);
 
     /**
      * Callback to close serial port
@@ -0,0 +1,146 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <deque>
+#include <utility>
+
+#include "DccBatch.hpp"
+#include "DccRequest.hpp"
+#include "Diag.hpp"
+
+bool DccBatch::_open = false;
+std::vector<std::pair<std::string, DccBatchDone>> DccBatch::_cmds;
+
+void DccBatch::begin()
+{
+  if (_open)
+  {
+    WARN("A batch is already open with {} commands; new commands will be added to it", _cmds.size());
+    return;
+  }
+  _cmds.clear();
+  _open = true;
+}
+
+void DccBatch::abort()
+{
+  _cmds.clear();
+  _open = false;
+}
+
+DccBatchResult DccBatch::commit(DccBatchWriter writer, size_t window, const void *source)
+{
+  DccBatchResult result;
+  std::vector<std::pair<std::string, DccBatchDone>> cmds;
+
+  cmds.swap(_cmds);
+  _open = false;
+
+  if (window == 0)
+  {
+    window = 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::deque<std::pair<size_t, DccPendingReply>> inflight; // index into cmds and its pending reply
+  std::string out;
+  std::vector<uint64_t> ids; // of the requests in out
+  size_t next = 0;
+
+  while (next < cmds.size() || !inflight.empty())
+  {
+    // refill once half of the window is free and send everything in one go; refilling
+    // after every reply would send one command per write
+    out.clear();
+    ids.clear();
+    bool refill = window - inflight.size() >= std::max<size_t>(1, window / 2);
+    while (refill && next < cmds.size() && inflight.size() < window)
+    {
+      auto &[cmd, done] = cmds[next];
+      auto pending = DccRequest::expect(cmd, source);
+      out += cmd;
+      if (pending.id == 0)
+      {
+        result.noReply++;
+        if (done)
+          done(pending.reply.get());
+      }
+      else
+      {
+        ids.push_back(pending.id);
+        inflight.emplace_back(next, std::move(pending));
+      }
+      next++;
+      result.sent++;
+    }
+
+    if (!out.empty())
+    {
+      try
+      {
+        writer(out, ids);
+      }
+      catch (...)
+      {
+        for (auto &p : inflight)
+        {
+          DccRequest::cancel(p.second.id);
+        }
+        throw;
+      }
+      result.writes++;
+    }
+
+    if (inflight.empty())
+    {
+      continue;
+    }
+
+    // wait for the oldest one; replies come in the order the commands have been send
+    auto &[idx, pending] = inflight.front();
+    auto &cmd = cmds[idx].first;
+    auto reply = DccRequest::wait(pending);
+
+    if (reply.timedOut)
+    {
+      result.timedOut++;
+      WARN("No reply from the commandstation for {}", cmd);
+    }
+    else if (reply.frame.compare(0, 2, "<X") == 0)
+    {
+      result.failed++;
+      WARN("{} failed on the commandstation", cmd);
+    }
+    else
+    {
+      result.ok++;
+      DBG("{} completed with {}", cmd, reply.frame);
+    }
+    if (cmds[idx].second)
+    {
+      cmds[idx].second(reply);
+    }
+    inflight.pop_front();
+  }
+
+  result.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  return result;
+}
@@ -0,0 +1,90 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccBatch
+ * @brief Collects commands between batch begin and batch commit and pipelines them to the
+ * commandstation. On commit as many commands as the in-flight window allows are coalesced
+ * into a single write; each time a reply comes in the window is refilled. Completion of
+ * every command is tracked through the pending request table (DccRequest). The window is
+ * refilled once half of it is free so the commands keep going out several per write.
+ * Commands can carry a callback which gets their reply on commit e.g. to apply a setting
+ * only once the commandstation has accepted it.
+ * @note Commands for which no reply is known don't count against the window
+ * @author grbba
+ */
+
+#ifndef DccBatch_h
+#define DccBatch_h
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DccRequest.hpp"
+
+#define DCC_BATCH_WINDOW 8 // default number of commands waiting for their reply at the same time
+
+typedef std::function<void(const std::string &, const std::vector<uint64_t> &)> DccBatchWriter; // commands and their request ids
+typedef std::function<void(const DccReply &)> DccBatchDone;
+
+struct DccBatchResult
+{
+  size_t sent = 0;
+  size_t ok = 0;        // replied
+  size_t failed = 0;    // replied with <X>
+  size_t timedOut = 0;
+  size_t noReply = 0;   // no reply expected
+  size_t writes = 0;    // number of writes to the connection
+  std::chrono::microseconds elapsed{0};
+};
+
+class DccBatch
+{
+private:
+  static bool _open;
+  static std::vector<std::pair<std::string, DccBatchDone>> _cmds; // command and its callback; may be empty
+
+public:
+  static void begin();
+  static void abort();
+  static bool isOpen() { return _open; }
+  static size_t size() { return _cmds.size(); }
+
+  static void add(const std::string &cmd, DccBatchDone done = nullptr) { _cmds.emplace_back(cmd, done); }
+
+  /**
+   * @brief Sends the collected commands and waits for all of them to complete
+   *
+   * @param writer writes to the active connection
+   * @param window maximum number of commands waiting for their reply
+   * @param source connection the writer sends to; only its replies complete the commands
+   * @return per batch counts of the command completions
+   */
+  static DccBatchResult commit(DccBatchWriter writer, size_t window = DCC_BATCH_WINDOW, const void *source = nullptr);
+
+  DccBatch() = default;
+  ~DccBatch() = default;
+};
+
+#endif
@@ -0,0 +1,409 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * dcccli-bench : end to end benchmark against the simulator
+ *
+ * The simulator runs in process on its own thread. The scenarios are
+ *  - parser : the frame parser and response decoder on a canned stream
+ *  - tcp    : sendCmd/DccRequest round trips over AsyncTCP
+ *  - serial : the same over AsyncSerial on a pseudo terminal
+ *  - diag   : a sustained diag stream from the simulator
+ *  - mqtt   : the round trips through the in process broker to a simulated station
+ * Results are written as JSON e.g. to keep them along with a release.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include <CLI/CLI.hpp>
+#include <nlohmann/json.hpp>
+
+#include "Diag.hpp"
+#include "DccVersion.hpp"
+#include "DccConfig.hpp"
+#include "DccSim.hpp"
+#include "DccSession.hpp"
+#include "DccIoContext.hpp"
+#include "DccSupervisor.hpp"
+#include "DccRequest.hpp"
+#include "DccResponse.hpp"
+#include "DccFrameParser.hpp"
+#include "DccSerial.hpp"
+#include "DccTCP.hpp"
+#include "DccMQTT.hpp"
+#include "DccBroker.hpp"
+#include "ShellCmdExec.hpp"
+
+using namespace std::chrono;
+using json = nlohmann::json;
+
+// Allocation counting; the simulator thread opts out so only the cli side is counted
+static std::atomic<uint64_t> allocs{0};
+static thread_local bool counted = true;
+
+void *operator new(size_t n)
+{
+  if (counted)
+    allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct BenchConfig
+{
+  size_t count = 10000;       // commands per round trip run
+  size_t window = 16;         // commands in flight for the pipelined run
+  size_t chunk = 64;          // read size fed to the parser
+  size_t parseBytes = 64 << 20;
+  unsigned int diagRate = 100000;
+  int mqttQos = 0;
+  seconds duration{2};
+};
+
+static json percentiles(std::vector<double> &v)
+{
+  if (v.empty())
+    return json::object();
+  std::sort(v.begin(), v.end());
+  auto at = [&v](double q)
+  { return v[std::min(v.size() - 1, static_cast<size_t>(q * v.size()))]; };
+  return {{"p50", at(0.50)}, {"p99", at(0.99)}, {"p999", at(0.999)}, {"max", v.back()}};
+}
+
+static double elapsed(steady_clock::time_point start)
+{
+  return duration<double>(steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Frame parser and decoder on a canned mix of replies and diags
+ */
+static json benchParser(const BenchConfig &c)
+{
+  std::string stream;
+  for (int i = 0; i < 100; i++)
+  {
+    stream += fmt::format("<r {}|0|1 3>\n<H {} 1>\n<* SIM {:08} ........................ *>\n<T 1 {} 1>\n", i, i, i, i);
+  }
+
+  uint64_t frames = 0;
+  DccFrameParser parser([&frames](DccFrame type, std::string_view frame)
+                        {
+    if (type == DccFrame::DCC)
+    {
+      DccResponse r;
+      DccResponse::decode(frame, r);
+      frames++;
+    }
+    else if (type == DccFrame::DIAG)
+      frames++; });
+
+  size_t total = 0;
+  auto a = allocs.load();
+  auto start = steady_clock::now();
+  while (total < c.parseBytes)
+  {
+    for (size_t pos = 0; pos < stream.size(); pos += c.chunk)
+    {
+      auto n = std::min(c.chunk, stream.size() - pos);
+      parser.parse(stream.data() + pos, n);
+    }
+    total += stream.size();
+  }
+  auto t = elapsed(start);
+  auto n = allocs.load() - a;
+
+  return {{"bytes", total},
+          {"frames", frames},
+          {"bytesPerSec", total / t},
+          {"framesPerSec", frames / t},
+          {"allocsPerFrame", static_cast<double>(n) / frames}};
+}
+
+static bool awaitSim(std::shared_ptr<DccTransport> t)
+{
+  for (int i = 0; i < 10; i++)
+  {
+    auto p = DccRequest::expect("<s>", t.get());
+    t->write("<s>");
+    if (!DccRequest::wait(p, 500ms).timedOut)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Round trips through sendCmd; one at a time for the latency and with window commands
+ * in flight for the throughput
+ */
+static json benchRoundTrip(const std::string &name, const std::string &uri, const BenchConfig &c)
+{
+  auto t = DccSession::open(name, uri);
+  if (!t || !awaitSim(t))
+  {
+    return {{"error", fmt::format("can't connect to {}", uri)}};
+  }
+
+  std::vector<std::string> cmds;
+  cmds.reserve(c.count);
+  for (size_t i = 0; i < c.count; i++)
+    cmds.push_back(fmt::format("<R 1 {} 0>", i));
+
+  std::vector<double> lat;
+  lat.reserve(c.count);
+  json result;
+
+  // sequential
+  {
+    auto &s = t->getStats();
+    auto bytes = s.bytesIn.load();
+    auto frames = s.frames.load();
+    size_t timeouts = 0;
+    auto a = allocs.load();
+    auto start = steady_clock::now();
+    for (auto &cmd : cmds)
+    {
+      auto t0 = steady_clock::now();
+      auto p = sendCmd(cmd);
+      if (DccRequest::wait(p, 2s).timedOut)
+        timeouts++;
+      lat.push_back(duration<double, std::micro>(steady_clock::now() - t0).count());
+    }
+    auto e = elapsed(start);
+    auto n = allocs.load() - a;
+    frames = s.frames.load() - frames;
+
+    result["sequential"] = {{"commands", c.count},
+                            {"timeouts", timeouts},
+                            {"commandsPerSec", c.count / e},
+                            {"latencyUs", percentiles(lat)},
+                            {"bytesPerSec", (s.bytesIn.load() - bytes) / e},
+                            {"allocsPerCommand", static_cast<double>(n) / c.count},
+                            {"allocsPerFrame", frames ? static_cast<double>(n) / frames : 0.0}};
+  }
+
+  // pipelined
+  {
+    lat.clear();
+    std::deque<std::pair<steady_clock::time_point, DccPendingReply>> inflight;
+    size_t timeouts = 0;
+    auto drain = [&]()
+    {
+      auto &f = inflight.front();
+      if (DccRequest::wait(f.second, 2s).timedOut)
+        timeouts++;
+      lat.push_back(duration<double, std::micro>(steady_clock::now() - f.first).count());
+      inflight.pop_front();
+    };
+
+    auto start = steady_clock::now();
+    for (auto &cmd : cmds)
+    {
+      if (inflight.size() >= c.window)
+        drain();
+      inflight.emplace_back(steady_clock::now(), sendCmd(cmd));
+    }
+    while (!inflight.empty())
+      drain();
+    auto e = elapsed(start);
+
+    result["pipelined"] = {{"commands", c.count},
+                           {"window", c.window},
+                           {"timeouts", timeouts},
+                           {"commandsPerSec", c.count / e},
+                           {"latencyUs", percentiles(lat)}};
+  }
+
+  if (auto mqtt = std::dynamic_pointer_cast<DccMQTT>(t))
+  {
+    result["mqtt"] = mqtt->getMqttStats().toJson();
+  }
+  DccSession::close(name);
+  return result;
+}
+
+/**
+ * @brief Sustained diag stream; shows whether the reader keeps up with the rate
+ */
+static json benchDiag(const std::string &uri, const BenchConfig &c)
+{
+  auto t = DccSession::open("diag", uri);
+  if (!t)
+  {
+    return {{"error", fmt::format("can't connect to {}", uri)}};
+  }
+
+  auto &s = t->getStats();
+  std::this_thread::sleep_for(200ms); // let the stream settle
+  auto bytes = s.bytesIn.load();
+  auto diags = s.diags.load();
+  auto a = allocs.load();
+  auto start = steady_clock::now();
+  std::this_thread::sleep_for(c.duration);
+  auto e = elapsed(start);
+  auto n = allocs.load() - a;
+  bytes = s.bytesIn.load() - bytes;
+  diags = s.diags.load() - diags;
+
+  DccSession::close("diag");
+  return {{"rate", c.diagRate},
+          {"diags", diags},
+          {"diagsPerSec", diags / e},
+          {"bytesPerSec", bytes / e},
+          {"allocsPerFrame", diags ? static_cast<double>(n) / diags : 0.0}};
+}
+
+auto main(int argc, char **argv) -> int
+{
+  CLI::App app{"DCC++ EX Commandline Interface benchmark"};
+
+  BenchConfig c;
+  int latency = 0;
+  int duration = 2;
+  std::vector<std::string> scenarios = {"parser", "tcp", "serial", "diag", "mqtt"};
+  std::string output;
+
+  app.add_option("-n,--count", c.count, "Commands per round trip run")->check(CLI::PositiveNumber);
+  app.add_option("-w,--window", c.window, "Commands in flight for the pipelined run")->check(CLI::PositiveNumber);
+  app.add_option("--chunk", c.chunk, "Read size fed to the parser")->check(CLI::Range(1, 65536));
+  app.add_option("--latency", latency, "Reply latency of the simulator in microseconds")->check(CLI::NonNegativeNumber);
+  app.add_option("--diag-rate", c.diagRate, "Diag messages per second for the diag scenario");
+  app.add_option("--duration", duration, "Seconds the diag scenario runs")->check(CLI::PositiveNumber);
+  app.add_option("--mqtt-qos", c.mqttQos, "Qos of the commands in the mqtt scenario")->check(CLI::Range(0, 2));
+  app.add_option("-s,--scenario", scenarios, "Scenarios to run")->check(CLI::IsMember({"parser", "tcp", "serial", "diag", "mqtt"}));
+  app.add_option("-o,--output", output, "Write the results to this file instead of stdout");
+
+  CLI11_PARSE(app, argc, argv);
+  c.duration = seconds(duration);
+
+  Diag::setFileInfo(false);
+  Diag::setup();
+  spdlog::set_level(spdlog::level::warn);
+  static FILE *null = fopen("/dev/null", "w");
+  if (null)
+  {
+    DccFrameConsole::setStream(null); // the replies are still formatted, just not shown
+  }
+
+  DccRequest::setup();
+  DccTransportRegistry::add("serial", []
+                            { return std::make_shared<DccSerial>(); });
+  DccTransportRegistry::add("tcp", []
+                            { return std::make_shared<DccTCP>(); });
+  DccTransportRegistry::add("mqtt", []
+                            { return std::make_shared<DccMQTT>(); });
+  DccConfig::setMshield = true;
+
+  // simulators; one answering commands and one flooding diags
+  DccSimConfig sc;
+  sc.latency = microseconds(latency);
+  DccSimConfig dc;
+  dc.diagRate = c.diagRate;
+
+  asio::io_context simIo;
+  DccSim sim(simIo, sc);
+  DccSim flood(simIo, dc);
+  DccBroker broker(simIo);
+  DccBrokerStation station(broker, DCC_MQTT_PREFIX, "bench");
+  std::string pty;
+
+  try
+  {
+    sim.listen(0);
+    flood.listen(0);
+    broker.listen(0);
+#ifndef WIN32
+    pty = sim.openPty();
+#endif
+  }
+  catch (const std::exception &e)
+  {
+    ERR("Can't start the simulator: {}", e.what());
+    return EXIT_FAILURE;
+  }
+  flood.start();
+
+  std::thread simThread([&simIo]
+                        {
+    counted = false;
+    simIo.run(); });
+
+  json results;
+  results["version"] = fmt::format("{}.{}.{}", MAJOR, MINOR, PATCH);
+  results["timestamp"] = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+  results["config"] = {{"count", c.count}, {"window", c.window}, {"chunk", c.chunk}, {"latencyUs", latency}, {"mqttQos", c.mqttQos}};
+
+  for (auto &s : scenarios)
+  {
+    try
+    {
+      if (s == "parser")
+        results["parser"] = benchParser(c);
+      else if (s == "tcp")
+        results["tcp"] = benchRoundTrip("tcp", fmt::format("tcp://127.0.0.1:{}", sim.port()), c);
+      else if (s == "serial" && !pty.empty())
+        results["serial"] = benchRoundTrip("serial", fmt::format("serial://{}?baud=115200", pty), c);
+      else if (s == "diag")
+        results["diag"] = benchDiag(fmt::format("tcp://127.0.0.1:{}", flood.port()), c);
+      else if (s == "mqtt")
+        results["mqtt"] = benchRoundTrip("mqtt", fmt::format("mqtt://127.0.0.1:{}/bench?qos={}", broker.port(), c.mqttQos), c);
+    }
+    catch (const std::exception &e)
+    {
+      results[s] = {{"error", e.what()}};
+    }
+  }
+
+  DccSupervisor::stop();
+  DccSession::closeAll();
+  DccIoContext::stop();
+  Diag::shutdown();
+  asio::post(simIo, [&]
+             {
+    sim.stop();
+    flood.stop();
+    broker.stop();
+    simIo.stop(); });
+  simThread.join();
+
+  if (output.empty())
+  {
+    std::cout << results.dump(2) << std::endl;
+  }
+  else
+  {
+    std::ofstream f(output);
+    f << results.dump(2) << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,631 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fmt/format.h>
+
+#include "DccBroker.hpp"
+#include "Diag.hpp"
+
+// control packet types; the upper nibble of the first byte
+enum : uint8_t
+{
+  MQTT_CONNECT = 1,
+  MQTT_CONNACK,
+  MQTT_PUBLISH,
+  MQTT_PUBACK,
+  MQTT_PUBREC,
+  MQTT_PUBREL,
+  MQTT_PUBCOMP,
+  MQTT_SUBSCRIBE,
+  MQTT_SUBACK,
+  MQTT_UNSUBSCRIBE,
+  MQTT_UNSUBACK,
+  MQTT_PINGREQ,
+  MQTT_PINGRESP,
+  MQTT_DISCONNECT
+};
+
+// ---------------------------------------------------------------------------------------------
+// Encoding
+// ---------------------------------------------------------------------------------------------
+
+static void putLength(std::string &o, size_t n)
+{
+  do
+  {
+    auto b = static_cast<uint8_t>(n % 128);
+    n /= 128;
+    if (n)
+      b |= 0x80;
+    o += static_cast<char>(b);
+  } while (n);
+}
+
+static void putString(std::string &o, std::string_view s)
+{
+  o += static_cast<char>(s.size() >> 8);
+  o += static_cast<char>(s.size() & 0xff);
+  o.append(s);
+}
+
+/**
+ * @brief Packets carrying only a packet identifier i.e. the acks
+ */
+static void putAck(std::string &o, uint8_t type, uint16_t id, uint8_t flags = 0)
+{
+  o += static_cast<char>(type << 4 | flags);
+  o += '\x02';
+  o += static_cast<char>(id >> 8);
+  o += static_cast<char>(id & 0xff);
+}
+
+/**
+ * @brief Reads the fields of a packet; ok turns false when reading past the end
+ */
+struct DccBrokerReader
+{
+  std::string_view d;
+  bool ok = true;
+
+  bool more() const { return ok && !d.empty(); }
+
+  uint8_t byte()
+  {
+    if (d.empty())
+    {
+      ok = false;
+      return 0;
+    }
+    auto b = static_cast<uint8_t>(d[0]);
+    d.remove_prefix(1);
+    return b;
+  }
+
+  uint16_t u16()
+  {
+    uint16_t hi = byte();
+    return static_cast<uint16_t>(hi << 8 | byte());
+  }
+
+  std::string_view str()
+  {
+    auto n = u16();
+    if (!ok || d.size() < n)
+    {
+      ok = false;
+      return {};
+    }
+    auto s = d.substr(0, n);
+    d.remove_prefix(n);
+    return s;
+  }
+
+  std::string_view rest()
+  {
+    auto s = d;
+    d = {};
+    return s;
+  }
+};
+
+/**
+ * @brief + and # have to take a whole level and # has to be the last one
+ */
+static bool validFilter(std::string_view f)
+{
+  if (f.empty())
+    return false;
+  for (size_t i = 0; i < f.size(); i++)
+  {
+    if (f[i] != '+' && f[i] != '#')
+      continue;
+    bool start = (i == 0 || f[i - 1] == '/');
+    bool end = (i + 1 == f.size() || f[i + 1] == '/');
+    if (!start || !end || (f[i] == '#' && i + 1 != f.size()))
+      return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Clients
+// ---------------------------------------------------------------------------------------------
+
+class DccBrokerClient : public std::enable_shared_from_this<DccBrokerClient>
+{
+private:
+  DccBroker &broker;
+  asio::ip::tcp::socket socket;
+  std::string name;
+  std::array<char, 4096> buf;
+  std::string in;                           // bytes of an incomplete packet
+  std::string out;                          // collected while a write is in flight
+  std::string sending;                      // buffer of the write in flight
+  bool writing = false;
+  bool closing = false;                     // closed once out has been written
+
+  bool connected = false;
+  std::string id;
+  std::vector<std::string> filters;
+  std::set<uint16_t> received;              // qos 2 publishes waiting for their PUBREL
+  bool will = false;
+  std::string willTopic;
+  std::string willPayload;
+  bool willRetain = false;
+
+  void read()
+  {
+    socket.async_read_some(asio::buffer(buf), [this, self = shared_from_this()](const std::error_code &ec, size_t n)
+                           {
+      if (ec)
+      {
+        if (ec != asio::error::operation_aborted)
+        {
+          DBG("{} disconnected ({})", describe(), ec.message());
+          lost();
+        }
+        return;
+      }
+      broker.getStats().bytesIn += n;
+      in.append(buf.data(), n);
+      if (consume())
+        read(); });
+  }
+
+  void flush()
+  {
+    if (writing || out.empty() || !socket.is_open())
+      return;
+    writing = true;
+    sending.clear();
+    sending.swap(out);
+    broker.getStats().bytesOut += sending.size();
+    asio::async_write(socket, asio::buffer(sending), [this, self = shared_from_this()](const std::error_code &ec, size_t)
+                      {
+      writing = false;
+      if (ec)
+      {
+        lost();
+        return;
+      }
+      if (closing && out.empty())
+      {
+        broker.remove(self);
+        return;
+      }
+      flush(); });
+  }
+
+  /**
+   * @brief The connection went away without a DISCONNECT; the will is published
+   */
+  void lost()
+  {
+    auto self = shared_from_this();
+    if (will)
+    {
+      will = false;
+      broker.publish(willTopic, willPayload, willRetain);
+    }
+    broker.remove(self);
+  }
+
+  void refuse(const std::string &why)
+  {
+    WARN("{}: {}; closing the connection", describe(), why);
+    broker.remove(shared_from_this());
+  }
+
+  /**
+   * @brief Handles the complete packets in the input
+   * @return false if the connection has been closed
+   */
+  bool consume()
+  {
+    size_t pos = 0;
+    while (in.size() - pos >= 2)
+    {
+      // remaining length; one to four bytes of seven bits each
+      size_t len = 0;
+      size_t hdr = 1;
+      bool complete = false;
+      while (pos + hdr < in.size() && hdr <= 4)
+      {
+        auto b = static_cast<uint8_t>(in[pos + hdr]);
+        len |= static_cast<size_t>(b & 0x7f) << (7 * (hdr - 1));
+        hdr++;
+        if (!(b & 0x80))
+        {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete)
+      {
+        if (hdr > 4)
+        {
+          refuse("malformed remaining length");
+          return false;
+        }
+        break;
+      }
+      if (len > DCC_BROKER_PACKET)
+      {
+        refuse(fmt::format("packet of {} bytes", len));
+        return false;
+      }
+      if (in.size() - pos < hdr + len)
+        break;
+      auto type = static_cast<uint8_t>(in[pos]);
+      if (!packet(type >> 4, type & 0x0f, std::string_view(in).substr(pos + hdr, len)))
+      {
+        flush(); // a refused CONNECT still gets its answer
+        return false;
+      }
+      pos += hdr + len;
+    }
+    in.erase(0, pos);
+    flush();
+    return true;
+  }
+
+  bool packet(uint8_t type, uint8_t flags, std::string_view body)
+  {
+    DccBrokerReader r{body};
+
+    if (!connected && type != MQTT_CONNECT)
+    {
+      refuse(fmt::format("packet type {} before CONNECT", type));
+      return false;
+    }
+
+    switch (type)
+    {
+    case MQTT_CONNECT:
+    {
+      if (connected)
+      {
+        refuse("second CONNECT");
+        return false;
+      }
+      auto proto = r.str();
+      auto level = r.byte();
+      auto f = r.byte();
+      r.u16(); // keepalive
+      id = std::string(r.str());
+      if (f & 0x04)
+      {
+        willTopic = std::string(r.str());
+        willPayload = std::string(r.str());
+        willRetain = (f & 0x20) != 0;
+        will = true;
+      }
+      if (f & 0x80)
+        r.str(); // user
+      if (f & 0x40)
+        r.str(); // password
+      if (!r.ok)
+      {
+        refuse("malformed CONNECT");
+        return false;
+      }
+      if (!((proto == "MQTT" && level == 4) || (proto == "MQIsdp" && level == 3)))
+      {
+        // unacceptable protocol version; answered and closed
+        out += std::string("\x20\x02\x00\x01", 4);
+        closing = true;
+        will = false;
+        return false;
+      }
+      if (id.empty())
+        id = fmt::format("auto-{}", name);
+      connected = true;
+      broker.getStats().connects++;
+      broker.takeover(*this, id);
+      out += std::string("\x20\x02\x00\x00", 4);
+      DBG("{} connected as {}", name, id);
+      break;
+    }
+    case MQTT_PUBLISH:
+    {
+      uint8_t qos = (flags >> 1) & 0x03;
+      auto topic = std::string(r.str());
+      uint16_t pid = qos ? r.u16() : 0;
+      auto payload = r.rest();
+      if (!r.ok || qos == 3 || topic.find_first_of("+#") != std::string::npos)
+      {
+        refuse("malformed PUBLISH");
+        return false;
+      }
+      broker.getStats().publishesIn++;
+      if (qos == 2)
+      {
+        putAck(out, MQTT_PUBREC, pid);
+        if (!received.insert(pid).second)
+          break; // send again before our PUBREC arrived; already delivered
+      }
+      else if (qos == 1)
+      {
+        putAck(out, MQTT_PUBACK, pid);
+      }
+      broker.publish(topic, payload, flags & 0x01);
+      break;
+    }
+    case MQTT_PUBREL:
+    {
+      auto pid = r.u16();
+      received.erase(pid);
+      putAck(out, MQTT_PUBCOMP, pid);
+      break;
+    }
+    case MQTT_PUBACK:
+    case MQTT_PUBREC:
+    case MQTT_PUBCOMP:
+      break; // everything goes out at qos 0
+    case MQTT_SUBSCRIBE:
+    {
+      auto pid = r.u16();
+      std::vector<std::string> added;
+      std::string codes;
+      while (r.more())
+      {
+        auto f = r.str();
+        r.byte(); // requested qos; granted is 0
+        if (!r.ok)
+          break;
+        if (!validFilter(f))
+        {
+          codes += '\x80';
+          continue;
+        }
+        codes += '\x00';
+        added.emplace_back(f);
+      }
+      if (!r.ok || codes.empty())
+      {
+        refuse("malformed SUBSCRIBE");
+        return false;
+      }
+      out += static_cast<char>(MQTT_SUBACK << 4);
+      putLength(out, 2 + codes.size());
+      out += static_cast<char>(pid >> 8);
+      out += static_cast<char>(pid & 0xff);
+      out += codes;
+      for (auto &f : added)
+      {
+        DBG("{} subscribed to {}", id, f);
+        if (std::find(filters.begin(), filters.end(), f) == filters.end())
+          filters.push_back(f);
+        broker.sendRetained(*this, f);
+      }
+      break;
+    }
+    case MQTT_UNSUBSCRIBE:
+    {
+      auto pid = r.u16();
+      while (r.more())
+      {
+        auto f = r.str();
+        filters.erase(std::remove(filters.begin(), filters.end(), f), filters.end());
+      }
+      putAck(out, MQTT_UNSUBACK, pid);
+      break;
+    }
+    case MQTT_PINGREQ:
+      out += std::string("\xd0\x00", 2);
+      break;
+    case MQTT_DISCONNECT:
+      will = false;
+      broker.remove(shared_from_this());
+      return false;
+    default:
+      refuse(fmt::format("unknown packet type {}", type));
+      return false;
+    }
+    return true;
+  }
+
+public:
+  void start() { read(); }
+
+  void close()
+  {
+    std::error_code ec;
+    socket.close(ec);
+  }
+
+  /**
+   * @brief Sends the message at qos 0 if one of the subscriptions matches
+   * @return true if it has been send
+   */
+  bool deliver(const std::string &topic, std::string_view payload, bool retain)
+  {
+    if (!connected || !socket.is_open())
+      return false;
+    if (std::none_of(filters.begin(), filters.end(), [&topic](const std::string &f)
+                     { return DccBroker::matches(f, topic); }))
+      return false;
+    out += static_cast<char>(MQTT_PUBLISH << 4 | (retain ? 1 : 0));
+    putLength(out, 2 + topic.size() + payload.size());
+    putString(out, topic);
+    out.append(payload);
+    flush();
+    return true;
+  }
+
+  const std::string &getId() const { return id; }
+  bool isConnected() const { return connected; }
+  std::string describe() const { return id.empty() ? name : fmt::format("{} ({})", id, name); }
+
+  DccBrokerClient(DccBroker &b, asio::ip::tcp::socket &&s, const std::string &n)
+      : broker(b), socket(std::move(s)), name(n) {}
+};
+
+// ---------------------------------------------------------------------------------------------
+// Broker
+// ---------------------------------------------------------------------------------------------
+
+DccBroker::DccBroker(asio::io_context &i) : io(i)
+{
+}
+
+bool DccBroker::matches(std::string_view filter, std::string_view topic)
+{
+  if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#'))
+    return false;
+
+  size_t f = 0, t = 0;
+  while (true)
+  {
+    auto fe = filter.find('/', f);
+    auto level = filter.substr(f, fe == std::string_view::npos ? std::string_view::npos : fe - f);
+    if (level == "#")
+      return true;
+    auto te = topic.find('/', t);
+    if (level != "+" && level != topic.substr(t, te == std::string_view::npos ? std::string_view::npos : te - t))
+      return false;
+    if (fe == std::string_view::npos)
+      return te == std::string_view::npos;
+    if (te == std::string_view::npos)
+      return filter.substr(fe + 1) == "#"; // a/# matches a as well
+    f = fe + 1;
+    t = te + 1;
+  }
+}
+
+void DccBroker::add(std::shared_ptr<DccBrokerClient> c)
+{
+  clients.insert(c);
+  c->start();
+}
+
+void DccBroker::remove(std::shared_ptr<DccBrokerClient> c)
+{
+  if (clients.erase(c))
+  {
+    c->close();
+  }
+}
+
+void DccBroker::takeover(DccBrokerClient &c, const std::string &id)
+{
+  auto it = std::find_if(clients.begin(), clients.end(), [&](const std::shared_ptr<DccBrokerClient> &o)
+                         { return o.get() != &c && o->isConnected() && o->getId() == id; });
+  if (it != clients.end())
+  {
+    INFO("{} connected again; closing the previous connection", id);
+    remove(*it);
+  }
+}
+
+void DccBroker::sendRetained(DccBrokerClient &c, const std::string &filter)
+{
+  for (auto &[topic, payload] : retained)
+  {
+    if (matches(filter, topic) && c.deliver(topic, payload, true))
+      stats.publishesOut++;
+  }
+}
+
+void DccBroker::publish(const std::string &topic, std::string_view payload, bool retain)
+{
+  if (retain)
+  {
+    if (payload.empty())
+      retained.erase(topic);
+    else
+      retained[topic] = std::string(payload);
+  }
+  for (auto &c : clients)
+  {
+    if (c->deliver(topic, payload, false))
+      stats.publishesOut++;
+  }
+  for (auto &h : handlers)
+  {
+    if (matches(h.first, topic))
+      h.second(topic, payload);
+  }
+}
+
+void DccBroker::handle(const std::string &filter, const DccBrokerHandler &h)
+{
+  handlers.emplace_back(filter, h);
+}
+
+void DccBroker::listen(unsigned short p)
+{
+  acceptor = std::make_shared<asio::ip::tcp::acceptor>(io, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), p));
+  INFO("MQTT broker listening on port {}", port());
+  accept();
+}
+
+unsigned short DccBroker::port() const
+{
+  return acceptor ? acceptor->local_endpoint().port() : 0;
+}
+
+void DccBroker::accept()
+{
+  acceptor->async_accept([this](const std::error_code &ec, asio::ip::tcp::socket s)
+                         {
+    if (ec)
+      return; // acceptor closed
+    std::error_code e;
+    s.set_option(asio::ip::tcp::no_delay(true), e);
+    auto n = fmt::format("tcp:{}", s.remote_endpoint(e).port());
+    add(std::make_shared<DccBrokerClient>(*this, std::move(s), n));
+    accept(); });
+}
+
+void DccBroker::stop()
+{
+  std::error_code ec;
+  if (acceptor)
+    acceptor->close(ec);
+  auto all = clients;
+  for (auto &c : all)
+    remove(c);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Simulated station
+// ---------------------------------------------------------------------------------------------
+
+DccBrokerStation::DccBrokerStation(DccBroker &b, const std::string &prefix, const std::string &station)
+    : broker(b), replyTopic(prefix + "/" + station + "/reply")
+{
+  parser.setCallback([this](DccFrame type, std::string_view frame)
+                     {
+    if (type == DccFrame::DCC)
+      state.execute(frame, out); });
+
+  broker.handle(prefix + "/" + station + "/cmd", [this](const std::string &, std::string_view payload)
+                {
+    parser.parse(payload.data(), payload.size());
+    if (out.empty())
+      return;
+    broker.publish(replyTopic, out);
+    out.clear(); });
+  INFO("Station {} answers on {}", station, replyTopic);
+}
@@ -0,0 +1,144 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccBroker
+ * @brief Minimal MQTT 3.1.1 broker so the mqtt connection can be run and benchmarked without
+ * a broker on the network. Supported are clean sessions, publishes at qos 0, 1 and 2,
+ * subscriptions with the + and # wildcards, retained messages, wills and pings. Subscriptions
+ * are always granted at qos 0 which the protocol allows; there is no persistence, no
+ * authentication ( user and password are accepted as given ) and keepalives aren't enforced.
+ * Topics can also be served in process with handle() e.g. to put the commandstation
+ * simulator behind the broker.
+ * @note Like the simulator the broker is single threaded; the io_context it is given has to be
+ * run by one thread only and publish() has to be called on that thread.
+ * @author grbba
+ */
+
+#ifndef DccBroker_h
+#define DccBroker_h
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "DccSim.hpp"
+#include "DccFrameParser.hpp"
+
+#define DCC_BROKER_PORT 1883
+#define DCC_BROKER_PREFIX "dcc"     // topic prefix of the simulated stations; the default of the cli
+#define DCC_BROKER_PACKET (1 << 20) // clients sending larger packets are disconnected
+
+typedef std::function<void(const std::string &topic, std::string_view payload)> DccBrokerHandler;
+
+struct DccBrokerStats
+{
+  uint64_t connects = 0;
+  uint64_t publishesIn = 0;    // recieved from clients
+  uint64_t publishesOut = 0;   // send to subscribers
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+};
+
+class DccBrokerClient;
+
+class DccBroker
+{
+private:
+  asio::io_context &io;
+  std::shared_ptr<asio::ip::tcp::acceptor> acceptor;
+  std::set<std::shared_ptr<DccBrokerClient>> clients;
+  std::map<std::string, std::string> retained;           // topic -> payload
+  std::vector<std::pair<std::string, DccBrokerHandler>> handlers;
+  DccBrokerStats stats;
+
+  void accept();
+
+public:
+  /**
+   * @brief True if the topic matches the filter; + matches one level, # the rest.
+   * Wildcards at the first level don't match topics starting with $
+   */
+  static bool matches(std::string_view filter, std::string_view topic);
+
+  void add(std::shared_ptr<DccBrokerClient> c);
+  void remove(std::shared_ptr<DccBrokerClient> c);
+
+  /**
+   * @brief A client with the same id connected; the older session is closed
+   */
+  void takeover(DccBrokerClient &c, const std::string &id);
+
+  /**
+   * @brief Sends the retained messages matching a new subscription
+   */
+  void sendRetained(DccBrokerClient &c, const std::string &filter);
+
+  /**
+   * @brief Routes a message to the subscribers and the handlers; a retained message is kept
+   * for later subscribers, an empty one removes it
+   */
+  void publish(const std::string &topic, std::string_view payload, bool retain = false);
+
+  /**
+   * @brief Messages on topics matching the filter are also given to the handler
+   */
+  void handle(const std::string &filter, const DccBrokerHandler &h);
+
+  /**
+   * @brief Accepts clients on the port of the loopback interface; 0 picks a free one
+   */
+  void listen(unsigned short port);
+  void stop();                  // closes all clients and the acceptor
+  unsigned short port() const;  // the port actually listened on
+  DccBrokerStats &getStats() { return stats; }
+
+  DccBroker(asio::io_context &io);
+  ~DccBroker() = default;
+};
+
+/**
+ * @brief Puts a simulated commandstation behind the broker; the commands published on
+ * <prefix>/<station>/cmd are executed and the replies published on <prefix>/<station>/reply
+ */
+class DccBrokerStation
+{
+private:
+  DccBroker &broker;
+  std::string replyTopic;
+  DccSimState state;
+  DccFrameParser parser;
+  std::string out;              // replies to the commands of one publish; published together
+
+public:
+  DccBrokerStation(DccBroker &b, const std::string &prefix, const std::string &station);
+  DccBrokerStation(const DccBrokerStation &) = delete;
+  DccBrokerStation &operator=(const DccBrokerStation &) = delete;
+  ~DccBrokerStation() = default;
+};
+
+#endif
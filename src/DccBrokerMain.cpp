@@ -0,0 +1,83 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * dcccli-broker : local MQTT broker with simulated stations
+ *
+ *   dcccli-broker -p 1883 --station cs --station layout1
+ *
+ * and then e.g. 'open mqtt://localhost/layout1' or 'mqtt broker' in dcccli.
+ */
+
+#include <iostream>
+#include <list>
+#include <CLI/CLI.hpp>
+
+#include "DccBroker.hpp"
+#include "Diag.hpp"
+
+auto main(int argc, char **argv) -> int
+{
+  CLI::App app{"Local MQTT broker for the DCC-EX commandline interface"};
+
+  int port = DCC_BROKER_PORT;
+  std::vector<std::string> stations;
+  std::string prefix = DCC_BROKER_PREFIX;
+  std::string level = "info";
+
+  app.add_option("-p,--port", port, "TCP port to listen on at 127.0.0.1; 0 picks a free one")->check(CLI::Range(0, 65535));
+  app.add_option("-s,--station", stations, "Simulated commandstation answering on <prefix>/<station>/cmd");
+  app.add_option("--prefix", prefix, "Topic prefix of the stations");
+  app.add_option("-l,--loglevel", level, "Log level")->check(CLI::IsMember({"trace", "debug", "info", "warn", "error", "off"}));
+
+  CLI11_PARSE(app, argc, argv);
+  Diag::setFileInfo(false);
+  Diag::setup();
+  spdlog::set_level(spdlog::level::from_str(level));
+
+  asio::io_context io;
+  DccBroker broker(io);
+  std::list<DccBrokerStation> sims; // not copyable; a list keeps them in place
+
+  try
+  {
+    broker.listen(static_cast<unsigned short>(port));
+  }
+  catch (const std::exception &e)
+  {
+    ERR("{}", e.what());
+    return EXIT_FAILURE;
+  }
+  for (auto &s : stations)
+  {
+    sims.emplace_back(broker, prefix, s);
+  }
+
+  asio::signal_set signals(io, SIGINT, SIGTERM);
+  signals.async_wait([&](const std::error_code &, int)
+                     {
+    auto &st = broker.getStats();
+    INFO("Stopping; {} connects, {} publishes in, {} out", st.connects, st.publishesIn, st.publishesOut);
+    broker.stop(); });
+
+  io.run();
+  Diag::shutdown();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * dcccli-broker-test : commands and replies through DccBroker and a simulated station and the
+ * delivery of retained messages to late subscribers; run by ctest. The clients speak just
+ * enough MQTT 3.1.1 at qos 0 over blocking sockets so the test doesn't need paho.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <utility>
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include "DccBroker.hpp"
+#include "Diag.hpp"
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what)
+{
+  fmt::print("{} {}\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+class DccTestClient
+{
+private:
+  asio::ip::tcp::socket socket;
+
+  static void putString(std::string &o, const std::string &s)
+  {
+    o += static_cast<char>(s.size() >> 8);
+    o += static_cast<char>(s.size() & 0xff);
+    o += s;
+  }
+
+  void send(uint8_t first, const std::string &body)
+  {
+    std::string p(1, static_cast<char>(first));
+    size_t n = body.size();
+    do
+    {
+      auto b = static_cast<uint8_t>(n % 128);
+      n /= 128;
+      p += static_cast<char>(n ? (b | 0x80) : b);
+    } while (n);
+    p += body;
+    asio::write(socket, asio::buffer(p));
+  }
+
+public:
+  /**
+   * @brief The next packet; first byte and body
+   */
+  std::pair<uint8_t, std::string> next()
+  {
+    uint8_t first = 0;
+    asio::read(socket, asio::buffer(&first, 1));
+    size_t len = 0;
+    for (int shift = 0;; shift += 7)
+    {
+      uint8_t b = 0;
+      asio::read(socket, asio::buffer(&b, 1));
+      len |= static_cast<size_t>(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    std::string body(len, '\0');
+    if (len > 0)
+      asio::read(socket, asio::buffer(body));
+    return {first, body};
+  }
+
+  void subscribe(const std::string &filter)
+  {
+    std::string body("\x00\x01", 2);
+    putString(body, filter);
+    body += '\x00';
+    send(0x82, body);
+    auto [type, ack] = next();
+    check(type == 0x90 && ack == std::string("\x00\x01\x00", 3), fmt::format("subscribed to {}", filter));
+  }
+
+  void publish(const std::string &topic, const std::string &payload, bool retain = false)
+  {
+    std::string body;
+    putString(body, topic);
+    body += payload;
+    send(retain ? 0x31 : 0x30, body);
+  }
+
+  /**
+   * @brief Waits for the next publish; the flags are those of the first byte
+   */
+  void message(std::string &topic, std::string &payload, bool &retained)
+  {
+    auto [type, body] = next();
+    check((type >> 4) == 3, "recieved a publish");
+    size_t n = (body.size() < 2) ? 0 : (static_cast<uint8_t>(body[0]) << 8 | static_cast<uint8_t>(body[1]));
+    topic = body.substr(2, n);
+    payload = body.size() > 2 + n ? body.substr(2 + n) : "";
+    retained = (type & 0x01) != 0;
+  }
+
+  /**
+   * @brief Replies come in order so a PINGRESP tells that nothing else has been queued before it
+   */
+  bool ping()
+  {
+    send(0xc0, "");
+    return next().first == 0xd0;
+  }
+
+  DccTestClient(asio::io_context &io, unsigned short port, const std::string &id) : socket(io)
+  {
+    socket.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+    std::string body;
+    putString(body, "MQTT");
+    body += '\x04';                   // 3.1.1
+    body += '\x02';                   // clean session
+    body += std::string("\x00\x3c", 2); // keepalive
+    putString(body, id);
+    send(0x10, body);
+    auto [type, ack] = next();
+    check(type == 0x20 && ack == std::string("\x00\x00", 2), fmt::format("{} connected", id));
+  }
+};
+
+auto main() -> int
+{
+  Diag::setFileInfo(false);
+  Diag::setup();
+  spdlog::set_level(spdlog::level::warn);
+
+  asio::io_context io;
+  auto work = asio::make_work_guard(io);
+  DccBroker broker(io);
+  DccBrokerStation station(broker, DCC_BROKER_PREFIX, "cs");
+  broker.listen(0);
+  std::thread runner([&io] { io.run(); });
+
+  asio::io_context clients; // blocking calls only; never run
+  std::string topic, payload;
+  bool retained = false;
+
+  try
+  {
+    DccTestClient cli(clients, broker.port(), "test-cli");
+    cli.subscribe("dcc/cs/reply");
+
+    cli.publish("dcc/cs/cmd", "<s>");
+    cli.message(topic, payload, retained);
+    check(topic == "dcc/cs/reply", "status reply on dcc/cs/reply");
+    check(payload.find(DCC_SIM_VERSION) != std::string::npos && payload.find("<p0>") != std::string::npos,
+          "status reply carries the version and the power state");
+
+    cli.publish("dcc/cs/cmd", "<1>");
+    cli.message(topic, payload, retained);
+    check(payload == "<p1>\n", "power on is acknowledged");
+
+    // commands packed into one publish are answered in one publish
+    cli.publish("dcc/cs/cmd", "<0><s>");
+    cli.message(topic, payload, retained);
+    check(payload.find("<p0>\n") == 0 && payload.find(DCC_SIM_VERSION) != std::string::npos,
+          "both packed commands answered in order");
+    check(!retained, "replies aren't retained");
+
+    // retained messages go to whoever subscribes later; an empty one removes it
+    cli.publish("dcc/cs/power", "1", true);
+    cli.publish("dcc/cs/turnout/5", "1", true);
+    cli.publish("dcc/cs/turnout/5", "", true);
+    check(cli.ping(), "retained messages published");
+
+    DccTestClient late(clients, broker.port(), "test-late");
+    late.subscribe("dcc/cs/power");
+    late.message(topic, payload, retained);
+    check(topic == "dcc/cs/power" && payload == "1" && retained, "retained state delivered to a late subscriber");
+
+    late.subscribe("dcc/cs/turnout/+");
+    check(late.ping(), "removed retained message isn't delivered");
+  }
+  catch (const std::exception &e)
+  {
+    check(false, fmt::format("no error talking to the broker ({})", e.what()));
+  }
+
+  asio::post(io, [&broker] { broker.stop(); });
+  work.reset();
+  runner.join();
+
+  auto &st = broker.getStats();
+  check(st.connects == 2, "two clients connected");
+  Diag::shutdown();
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,296 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <fmt/core.h>
+#include <fmt/color.h>
+
+#include "DccCapture.hpp"
+#include "DccTransport.hpp"
+#include "DccFrameParser.hpp"
+#include "ShellCmdExec.hpp"
+#include "Diag.hpp"
+
+#define DCC_CAPTURE_HEADER 24 // magic and the two clocks
+#define DCC_CAPTURE_RECORD 15 // size of a record header
+
+std::mutex DccCapture::_mutex;
+std::condition_variable DccCapture::_cv;
+std::thread DccCapture::_thread;
+std::atomic<bool> DccCapture::_active{false};
+bool DccCapture::_stop = false;
+FILE *DccCapture::_file = nullptr;
+std::string DccCapture::_name;
+std::vector<char> DccCapture::_buffer;
+std::map<const DccTransport *, uint16_t> DccCapture::_sources;
+DccCaptureStats DccCapture::_stats;
+
+static void putLE(std::vector<char> &b, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+  {
+    b.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+  }
+}
+
+static uint64_t getLE(const char *p, int bytes)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++)
+  {
+    v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  }
+  return v;
+}
+
+static uint64_t nanos(std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+void DccCapture::start(const std::string &file)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_file != nullptr)
+  {
+    throw ShellCmdExecException(fmt::format("Already capturing to {}; call capture stop first", _name));
+  }
+  _file = fopen(file.c_str(), "wb");
+  if (_file == nullptr)
+  {
+    throw ShellCmdExecException(fmt::format("Can't create {}: {}", file, strerror(errno)));
+  }
+  _name = file;
+  _stats = DccCaptureStats();
+  _sources.clear();
+  _buffer.clear();
+  _buffer.reserve(2 * DCC_CAPTURE_FLUSH);
+
+  _buffer.insert(_buffer.end(), DCC_CAPTURE_MAGIC, DCC_CAPTURE_MAGIC + 8);
+  auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  putLE(_buffer, static_cast<uint64_t>(wall), 8);
+  putLE(_buffer, nanos(std::chrono::steady_clock::now()), 8);
+
+  _stop = false;
+  _thread = std::thread(run);
+  _active = true;
+}
+
+DccCaptureStats DccCapture::stop()
+{
+  _active = false;
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    if (_file == nullptr)
+    {
+      return _stats;
+    }
+    _stop = true;
+  }
+  _cv.notify_one();
+  _thread.join();
+
+  std::lock_guard<std::mutex> l(_mutex);
+  fclose(_file);
+  _file = nullptr;
+  return _stats;
+}
+
+/**
+ * @brief Appends a record to the buffer; the lock is held by the caller
+ */
+void DccCapture::append(uint64_t ns, uint16_t source, DccCaptureType type, const char *data, size_t len)
+{
+  putLE(_buffer, ns, 8);
+  putLE(_buffer, len, 4);
+  putLE(_buffer, source, 2);
+  _buffer.push_back(static_cast<char>(type));
+  _buffer.insert(_buffer.end(), data, data + len);
+}
+
+void DccCapture::record(DccTransport *source, DccCaptureType type, const char *data, size_t len)
+{
+  auto ns = nanos(std::chrono::steady_clock::now());
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    if (!_active)
+    {
+      return; // stopped while we waited
+    }
+    if (_buffer.size() + len + 2 * DCC_CAPTURE_RECORD > DCC_CAPTURE_BUFFER)
+    {
+      _stats.dropped++;
+      return;
+    }
+    auto it = _sources.find(source);
+    if (it == _sources.end())
+    {
+      auto name = source->describe();
+      it = _sources.insert({source, static_cast<uint16_t>(_sources.size())}).first;
+      append(ns, it->second, DccCaptureType::SOURCE, name.data(), name.size());
+    }
+    append(ns, it->second, type, data, len);
+    _stats.records++;
+    _stats.bytes += len;
+    wake = _buffer.size() >= DCC_CAPTURE_FLUSH;
+  }
+  if (wake)
+  {
+    _cv.notify_one();
+  }
+}
+
+/**
+ * @brief Writer thread; swaps the buffer at least every 100ms so the capture is on disk
+ * shortly after the traffic happened
+ */
+void DccCapture::run()
+{
+  std::vector<char> out;
+  out.reserve(2 * DCC_CAPTURE_FLUSH);
+  std::unique_lock<std::mutex> l(_mutex);
+  while (true)
+  {
+    _cv.wait_for(l, std::chrono::milliseconds(100), []
+                 { return _stop || _buffer.size() >= DCC_CAPTURE_FLUSH; });
+    out.swap(_buffer);
+    bool done = _stop;
+
+    l.unlock();
+    if (!out.empty() && fwrite(out.data(), 1, out.size(), _file) != out.size())
+    {
+      ERR("Writing the capture failed: {}", strerror(errno));
+    }
+    out.clear();
+    if (done)
+    {
+      fflush(_file);
+      return;
+    }
+    fflush(_file);
+    l.lock();
+  }
+}
+
+DccReplayStats DccCapture::replay(const std::string &file, bool realtime)
+{
+  FILE *f = fopen(file.c_str(), "rb");
+  if (f == nullptr)
+  {
+    throw ShellCmdExecException(fmt::format("Can't open {}: {}", file, strerror(errno)));
+  }
+  std::vector<char> data;
+  char chunk[64 * 1024];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(f);
+
+  if (data.size() < DCC_CAPTURE_HEADER || memcmp(data.data(), DCC_CAPTURE_MAGIC, 8) != 0)
+  {
+    throw ShellCmdExecException(fmt::format("{} is not a capture", file));
+  }
+
+  DccReplayStats stats;
+  std::map<uint16_t, std::unique_ptr<DccFrameParser>> parsers; // one per source; the streams are independent
+  DccFrameConsole console;
+
+  auto parserFor = [&](uint16_t source) -> DccFrameParser &
+  {
+    auto &p = parsers[source];
+    if (!p)
+    {
+      p = std::make_unique<DccFrameParser>();
+      p->setCallback([&](DccFrame type, std::string_view frame)
+                     {
+        if (type == DccFrame::DCC)
+          stats.frames++;
+        else if (type == DccFrame::DIAG)
+          stats.diags++;
+        if (realtime)
+          console.print(type, frame); });
+    }
+    return *p;
+  };
+
+  size_t pos = DCC_CAPTURE_HEADER;
+  uint64_t first = 0;
+  uint64_t last = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  while (pos + DCC_CAPTURE_RECORD <= data.size())
+  {
+    auto p = data.data() + pos;
+    auto ns = getLE(p, 8);
+    auto len = getLE(p + 8, 4);
+    auto source = static_cast<uint16_t>(getLE(p + 12, 2));
+    auto type = static_cast<DccCaptureType>(p[14]);
+    if (pos + DCC_CAPTURE_RECORD + len > data.size())
+    {
+      break;
+    }
+    const char *payload = p + DCC_CAPTURE_RECORD;
+    pos += DCC_CAPTURE_RECORD + len;
+
+    if (first == 0)
+    {
+      first = ns;
+    }
+    last = ns;
+    if (realtime)
+    {
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds(ns - first));
+    }
+
+    switch (type)
+    {
+    case DccCaptureType::IN:
+      stats.records++;
+      stats.bytes += len;
+      parserFor(source).parse(payload, len);
+      if (realtime)
+        console.flush();
+      break;
+    case DccCaptureType::OUT:
+      stats.records++;
+      if (realtime)
+        fmt::print(Diag::style(fg(fmt::color::medium_turquoise)), "> {}\n", std::string_view(payload, len));
+      break;
+    case DccCaptureType::SOURCE:
+      if (realtime)
+        INFO("Source {}: {}", source, std::string_view(payload, len));
+      break;
+    }
+  }
+  stats.elapsed = std::chrono::steady_clock::now() - start;
+  stats.captured = std::chrono::nanoseconds(last - first);
+
+  if (pos != data.size())
+  {
+    WARN("{} ends with an incomplete record; {} bytes ignored", file, data.size() - pos);
+  }
+  return stats;
+}
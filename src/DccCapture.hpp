@@ -0,0 +1,128 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccCapture
+ * @brief Records what goes over the connections to the commandstation in both directions and
+ * replays such a capture through the frame parser. The io threads only copy the data into a
+ * buffer under a short lock; a writer thread puts it on disk.
+ *
+ * File layout, all numbers little endian:
+ *  - header: "DCCCAP1\n", system clock at start (ns since epoch), steady clock at start (ns)
+ *  - records: steady clock (ns, u64), length (u32), source (u16), type (u8), data
+ * A SOURCE record names a source ( the uri of the connection ) before its first IN/OUT record.
+ * @author grbba
+ */
+
+#ifndef DccCapture_h
+#define DccCapture_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DCC_CAPTURE_MAGIC "DCCCAP1\n"
+#define DCC_CAPTURE_FLUSH (64 * 1024)        // the writer is woken up at this size
+#define DCC_CAPTURE_BUFFER (8 * 1024 * 1024) // records beyond this are dropped until the writer caught up
+
+class DccTransport;
+
+enum class DccCaptureType : uint8_t
+{
+  IN = 0,     // recieved from the commandstation
+  OUT = 1,    // send to the commandstation
+  SOURCE = 2  // data is the name of the source
+};
+
+struct DccCaptureStats
+{
+  uint64_t records = 0;
+  uint64_t bytes = 0;       // payload of IN/OUT records
+  uint64_t dropped = 0;     // records lost because the writer didn't keep up
+};
+
+struct DccReplayStats
+{
+  uint64_t records = 0;
+  uint64_t bytes = 0;       // recieved bytes fed to the parser
+  uint64_t frames = 0;
+  uint64_t diags = 0;
+  std::chrono::nanoseconds captured{0}; // time between the first and the last record
+  std::chrono::nanoseconds elapsed{0};  // time the replay took
+};
+
+class DccCapture
+{
+private:
+  static std::mutex _mutex;
+  static std::condition_variable _cv;
+  static std::thread _thread;
+  static std::atomic<bool> _active;
+  static bool _stop;
+  static FILE *_file;
+  static std::string _name;
+  static std::vector<char> _buffer;                 // filled by record(), emptied by the writer
+  static std::map<const DccTransport *, uint16_t> _sources;
+  static DccCaptureStats _stats;
+
+  static void run();
+  static void append(uint64_t ns, uint16_t source, DccCaptureType type, const char *data, size_t len);
+
+public:
+  /**
+   * @brief Starts writing the capture to file
+   * @throws ShellCmdExecException if a capture is running already or the file can't be created
+   */
+  static void start(const std::string &file);
+
+  /**
+   * @brief Writes out what has been recorded and closes the file
+   * @return what has been captured
+   */
+  static DccCaptureStats stop();
+
+  static bool active() { return _active.load(std::memory_order_relaxed); }
+  static std::string file() { return _name; }
+
+  /**
+   * @brief Adds a record; called by the transports for every chunk read or written
+   */
+  static void record(DccTransport *source, DccCaptureType type, const char *data, size_t len);
+
+  /**
+   * @brief Feeds the recieved data of a capture through the frame parser. At real speed the
+   * records are replayed with their original timing and shown as they would have been. At max
+   * speed nothing is shown; the result tells how fast the parser is.
+   * @throws ShellCmdExecException if the file can't be read or isn't a capture
+   */
+  static DccReplayStats replay(const std::string &file, bool realtime);
+
+  DccCapture() = default;
+  ~DccCapture() = default;
+};
+
+#endif
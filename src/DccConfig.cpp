@@ -20,6 +20,7 @@
 
 #include <fmt/core.h>
 #include <fmt/color.h>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 
@@ -37,6 +38,11 @@
 #endif
 #include <chrono>
 #include "DccSerial.hpp"
+#include "DccRequest.hpp"
+#include "DccSession.hpp"
+#include "DccIoContext.hpp"
+#include "DccMetrics.hpp"
+#include "ShellCmdExec.hpp"
 #include <CLI/CLI.hpp>
 
 // #include "../include/CLI11.hpp"
@@ -51,16 +57,15 @@ std::string     DccConfig::port;
 std::string     DccConfig::dccLayoutFile;
 std::string     DccConfig::dccSchemaFile    = CONFIG_DCCEX_SCHEMA;
 bool            DccConfig::isInteractive    = CONFIG_INTERACTIVE;
+bool            DccConfig::isScript         = false;
+std::string     DccConfig::scriptFile;
+int             DccConfig::metricsPort      = 0;
 bool            DccConfig::isUpload         = false;
 bool            DccConfig::isConnect        = false;
 bool            DccConfig::fileInfo         = CONFIG_FILEINFO;
 int             DccConfig::baud             = DCC_DEFAULT_BAUDRATE;
 DiagLevel       DccConfig::level            = LOGV_WARN; // by default show everything up to Warning level
-DccSerial       DccConfig::serial;
-DccTCP          DccConfig::ethernet;   
-CsConnection_t  DccConfig::active           = DCC_CONN_UNKOWN;
 CsMotorShield   DccConfig::mshield          = NOT_CONFIGURED;
-DccMQTT         DccConfig::broker;  
 bool            DccConfig::setMshield       = false;
 
 // contains the layout parsed from the layoutfile; DccConfig only contains the reference to the object
@@ -73,24 +78,52 @@ std::function<void(const std::string&)> verboseOptionLambda =
         Diag::setLogLevel(dl);
     };
 
+std::function<void(const std::int64_t)> timeoutLambda = 
+    [](const std::int64_t t) { 
+        DccRequest::setTimeout(std::chrono::milliseconds(t));
+    };
+
+std::function<void(const std::int64_t)> threadsLambda = 
+    [](const std::int64_t n) { 
+        DccIoContext::setThreads(static_cast<unsigned int>(n));
+    };
+
 std::function<void(const std::int64_t)> connectionLambda = 
     [](const std::int64_t v) { 
-        INFO("Connecting ...");
-        INFO("Port: {}", DccConfig::port);
-        INFO("Baud: {}", DccConfig::baud);
-        
-        DccConfig::serial.openPort(DccConfig::port, DccConfig::baud);
-        if(DccConfig::serial.isOpen()) {
-            DccConfig::active = DCC_SERIAL; // set the active connection to serial
-            fmt::print(fg(fmt::color::green), "Serial port {} opened at {} baud\n", DccConfig::port, DccConfig::baud);
-        }
-        sleep_for(8s); // let the cs reply bfore showing the prompt again
+        DccConfig::isConnect = true; // opened by connect() after the banner
     };
 
+void DccConfig::connect()
+{
+    INFO("Connecting ...");
+    INFO("Port: {}", DccConfig::port);
+    INFO("Baud: {}", DccConfig::baud);
+
+    auto uri = fmt::format("serial://{}?baud={}", DccConfig::port, DccConfig::baud);
+    try {
+        if(auto connection = DccSession::open("serial", uri)) {
+            fmt::print(Diag::style(fg(fmt::color::green)), "Serial port {} opened at {} baud\n", DccConfig::port, DccConfig::baud);
+            // opening the port resets the mcu; let the cs reply before showing the prompt
+            if (!awaitCommandStation(connection, 8s)) {
+                WARN("No reply from the commandstation on {}", connection->describe());
+            }
+        }
+    } catch (const std::exception &e) {
+        ERR("{}", e.what());
+    }
+}
+
 auto DccConfig::setup(int argc, char **argv) -> int
 {
     CLI::App app{"DCC++ EX Commandline Interface Help"};
 
+    DccRequest::setup(); // needs to be in place before any connection is opened
+
+    DccTransportRegistry::add("serial", [] { return std::make_shared<DccSerial>(); });
+    DccTransportRegistry::add("tcp", [] { return std::make_shared<DccTCP>(); });
+    DccTransportRegistry::add("mqtt", [] { return std::make_shared<DccMQTT>(); });
+    DccMQTTState::setup();
+
     app.get_formatter()->label("REQUIRED", "(mandatory)");
     app.get_formatter()->column_width(40);
 
@@ -116,6 +149,14 @@ auto DccConfig::setup(int argc, char **argv) -> int
         ->group("Connect");
 
 
+    // the pool is sized while parsing; -c only connects after setup
+    app.add_option_function<std::int64_t>("--threads", 
+                    threadsLambda,
+                    "number of threads serving all open connections.\n"
+                    "If omitted the default of 2 is used")
+        ->check(CLI::Range(1, 64))
+        ->group("Connect");
+
     auto connectFlag = app.add_flag_function(
         "-c,--commandstation",
         connectionLambda,
@@ -128,6 +169,12 @@ auto DccConfig::setup(int argc, char **argv) -> int
                                 "set the baud rate for serial connection. If omitted the default of 115200 is used")
         ->group("Connect");
 
+    app.add_option_function<std::int64_t>("-t,--timeout", 
+                    timeoutLambda,
+                    "time in ms to wait for the reply of the commandstation to a command.\n"
+                    "If omitted the default of 2000ms is used")
+        ->group("Connect");
+
     connectFlag->needs(portOption); // or IP adress onec thats there  
 
     app.add_option_function("-v,--verbose", 
@@ -139,6 +186,17 @@ auto DccConfig::setup(int argc, char **argv) -> int
                  "Interactive mode; Opens a shell from which commands can be "
                  "issued type --help for more info");
 
+    app.add_option<std::string>("--script", DccConfig::scriptFile,
+                 "Script mode; runs the shell commands from the file line by line without the "
+                 "interactive shell.\nExecution stops at the first command which fails")
+        ->check(CLI::ExistingFile)
+        ->excludes("-i");
+
+    app.add_option<int>("--metrics-port", DccConfig::metricsPort,
+                 "Serves the connection and command round trip metrics in OpenMetrics format\n"
+                 "on http://127.0.0.1:<port>/metrics e.g. for Prometheus; 9464 is the usual port")
+        ->check(CLI::Range(1, 65535));
+
     auto upLoadFlag = app.add_flag("-u,--upload", DccConfig::isUpload,
                  "upload the cs code to the mcu set in -m or --mcu connected to the port -p ")
         ->group("Upload");
@@ -156,6 +214,19 @@ auto DccConfig::setup(int argc, char **argv) -> int
         return DCC_FAILURE;
     }
 
+    DccConfig::isScript = !DccConfig::scriptFile.empty();
+
+    if (DccConfig::metricsPort > 0)
+    {
+        try
+        {
+            DccMetrics::start(static_cast<unsigned short>(DccConfig::metricsPort));
+        }
+        catch (const std::exception &e)
+        {
+            ERR("Can't serve the metrics on port {}: {}", DccConfig::metricsPort, e.what());
+        }
+    }
     Diag::setFileInfo(fileInfo); // if not set via commandline by default set to false
 
 /**
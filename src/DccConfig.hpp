@@ -29,6 +29,7 @@
 #ifndef DccConfig_h
 #define DccConfig_h
 
+#include <cstdint>
 #include <string>
 
 #include <fmt/core.h>
@@ -74,10 +75,6 @@
 #define DCC_FAILURE 0
 #define DCC_SUCCESS 1
 
-// #define DCC_SERIAL 0
-// #define DCC_ETHERNET 1
-// #define DCC_CONN_UNKOWN 2
-
 #ifdef OS_MAC
 #define DCC_AVRDUDE_ROOT "./cs-config/avrdude/macos"
 #endif
@@ -88,14 +85,6 @@
 #define DCC_AVRDUDE_ROOT "./cs-config/avrdude/linux"
 #endif
 
-enum CsConnection_t
-{
-    DCC_SERIAL,
-    DCC_ETHERNET,
-    DCC_MQTT,
-    DCC_CONN_UNKOWN
-};
-
 // Arduino defines ...
 
 // from MotorDrivers.h in the CS code
@@ -222,9 +211,6 @@ const std::map<CsMotorShield, MotorShield> MotorShields {
     };
 
 
-// typedef std::variant< DccSerial,
-//                       DccTCP > CsConnection_t;
-
 class DccConfig
 {
 private:
@@ -239,21 +225,26 @@ public:
      */
     static auto setup(int argc, char **argv) -> int;
 
+    /**
+     * @brief Opens the serial connection requested with -c; called after setup once the
+     * banner is out so the connection messages aren't cleared with the screen
+     */
+    static void connect();
+
     static std::string  dccLayoutFile;
     static std::string  dccSchemaFile;
     static std::shared_ptr<DccLayout> _playout;             // layout instatiated from dccLayoutFile
     static std::string  mcu;
     static std::string  port;
     static bool         isInteractive;      // run as interactive shell
+    static bool         isScript;           // run the commands from scriptFile
+    static std::string  scriptFile;
+    static int          metricsPort;        // serve the metrics on this port; 0 for none
     static bool         isUpload;           // Upload has been requested
     static bool         isConnect;          // Connection to the cs has been requested from the commandline
     static DiagLevel    level;
     static bool         fileInfo;
     static int          baud;               // baud rate for the serial connection; if not set then default is 115200
-    static DccSerial    serial;             // Serial port instance
-    static DccTCP       ethernet;           // Ethernet connection ( we only allow one ...)
-    static DccMQTT      broker;
-    static CsConnection_t active;           // Active connection type ( maps either to serial or ethernet)
     static CsMotorShield  mshield;          // Mototshield configure init with NOT_CONFIGURED
     static bool          setMshield;        // set by the mshield command to get through the smencmd mototshield available check
 
@@ -0,0 +1,243 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <fmt/core.h>
+#include <fmt/color.h>
+
+#include "DccFrameParser.hpp"
+#include "Diag.hpp"
+
+#define DCC_MAX_FRAME 4096 // a frame growing beyond this is considered garbage and dropped
+
+void DccFrameParser::emit(DccFrame type, std::string_view frame)
+{
+  if (callback && !frame.empty())
+    callback(type, frame);
+}
+
+/**
+ * @brief Completes the frame started in a previous chunk with len bytes of data and emits it
+ */
+void DccFrameParser::emitPending(DccFrame type, const char *data, size_t len)
+{
+  pending.append(data, len);
+  emit(type, pending);
+  pending.clear();
+}
+
+void DccFrameParser::reset()
+{
+  pending.clear();
+  state = _Text;
+}
+
+/**
+ * @brief Scans the chunk for frame delimiters. memchr is used for the scan as it
+ * is vectorized by the libc; only the delimiter positions are looked at byte by byte.
+ *
+ * @param data chunk as recieved from the serial port or the network
+ * @param len number of bytes in the chunk
+ * @return number of bytes dropped because a frame grew beyond DCC_MAX_FRAME
+ */
+size_t DccFrameParser::parse(const char *data, size_t len)
+{
+  const char *p = data;
+  const char *end = data + len;
+  const char *start = data; // start of the current frame in this chunk
+
+  // resolve the cases where the previous chunk ended right on a delimiter
+  if (len > 0 && state == _OpenDcc && pending.size() == 1)
+  {
+    if (*p == '*')
+    {
+      pending.clear();
+      state = _OpenDiag;
+      start = ++p;
+    }
+  }
+  else if (len > 0 && state == _PreCloseDiag)
+  {
+    if (*p == '>')
+    {
+      emitPending(DccFrame::DIAG, p, 0);
+      state = _Text;
+      p++;
+    }
+    else
+    {
+      pending.push_back('*'); // the '*' was part of the message
+      state = _OpenDiag;
+    }
+  }
+
+  while (p < end)
+  {
+    switch (state)
+    {
+    case _OpenDcc:
+    {
+      auto gt = static_cast<const char *>(memchr(p, '>', end - p));
+      if (gt == nullptr)
+      {
+        pending.append(start, end - start);
+        p = end;
+        break;
+      }
+      if (pending.empty())
+      {
+        emit(DccFrame::DCC, std::string_view(start, gt + 1 - start));
+      }
+      else
+      {
+        emitPending(DccFrame::DCC, start, gt + 1 - start);
+      }
+      state = _Text;
+      p = gt + 1;
+      break;
+    }
+    case _OpenDiag:
+    {
+      auto star = static_cast<const char *>(memchr(p, '*', end - p));
+      if (star == nullptr)
+      {
+        pending.append(start, end - start);
+        p = end;
+        break;
+      }
+      if (star + 1 == end)
+      {
+        pending.append(start, star - start); // keep the '*' out until we know
+        state = _PreCloseDiag;
+        p = end;
+        break;
+      }
+      if (star[1] != '>')
+      {
+        p = star + 1; // '*' inside the message
+        break;
+      }
+      if (pending.empty())
+      {
+        emit(DccFrame::DIAG, std::string_view(start, star - start));
+      }
+      else
+      {
+        emitPending(DccFrame::DIAG, start, star - start);
+      }
+      state = _Text;
+      p = star + 2;
+      break;
+    }
+    default:
+    {
+      auto lt = static_cast<const char *>(memchr(p, '<', end - p));
+      if (lt == nullptr)
+      {
+        emit(DccFrame::TEXT, std::string_view(p, end - p));
+        p = end;
+        break;
+      }
+      emit(DccFrame::TEXT, std::string_view(p, lt - p));
+      if (lt + 1 == end)
+      {
+        pending.assign(1, '<'); // can't tell yet if this is a diag
+        state = _OpenDcc;
+        p = end;
+        break;
+      }
+      if (lt[1] == '*')
+      {
+        state = _OpenDiag;
+        start = p = lt + 2;
+      }
+      else
+      {
+        state = _OpenDcc;
+        start = lt;
+        p = lt + 1;
+      }
+      break;
+    }
+    }
+  }
+
+  if (pending.size() > DCC_MAX_FRAME)
+  {
+    auto dropped = pending.size();
+    WARN("Dropping unterminated commandstation message of {} bytes", dropped);
+    reset();
+    return dropped;
+  }
+  return 0;
+}
+
+FILE *DccFrameConsole::_stream = stdout;
+
+void DccFrameConsole::print(DccFrame type, std::string_view frame)
+{
+  switch (type)
+  {
+  case DccFrame::TEXT:
+  {
+    // newlines are dropped; frames are terminated by one anyway
+    size_t pos = 0;
+    while (pos < frame.size())
+    {
+      auto nl = frame.find('\n', pos);
+      auto n = (nl == std::string_view::npos ? frame.size() : nl) - pos;
+      if (n > 0)
+        fmt::format_to(std::back_inserter(out), Diag::style(fg(fmt::color::magenta)), "{}", frame.substr(pos, n));
+      pos += n + 1;
+    }
+    break;
+  }
+  case DccFrame::DCC:
+  {
+    fmt::format_to(std::back_inserter(out), Diag::style(fg(fmt::color::magenta)), "{}\n", frame);
+    break;
+  }
+  case DccFrame::DIAG:
+  {
+    // diags go through the logger which writes from its own thread, so on the console they can
+    // show up after replies recieved later; the replies collected so far are at least written
+    // before the diag is queued
+    if (out.size() > 0)
+    {
+      fwrite(out.data(), 1, out.size(), _stream);
+      out.clear();
+    }
+    INFO("{}", frame);
+    break;
+  }
+  }
+}
+
+void DccFrameConsole::flush()
+{
+  if (out.size() > 0)
+  {
+    fwrite(out.data(), 1, out.size(), _stream);
+    out.clear();
+  }
+  fflush(_stream);
+}
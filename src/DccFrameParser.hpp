@@ -0,0 +1,95 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccFrameParser
+ * @brief Splits the byte stream recieved from the commandstation into frames.
+ * The buffer handed over by the serial/tcp callback is scanned in place for the
+ * '<', '<*' and '*>' delimiters and each completed frame is handed to the frame
+ * callback as a string_view. Only frames spanning two reads are copied into a
+ * small carry-over buffer.
+ * @note The views passed to the callback are only valid during the callback
+ * @author grbba
+ */
+
+#ifndef DccFrameParser_h
+#define DccFrameParser_h
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <functional>
+
+#include <fmt/format.h>
+
+#include "CliReciever.hpp"
+
+enum class DccFrame
+{
+  TEXT, // anything outside of <> e.g. boot messages of the mcu
+  DCC,  // <...> commandstation response; the view includes the brackets
+  DIAG  // <* ... *> commandstation diagnostic; the view excludes the delimiters
+};
+
+typedef std::function<void(DccFrame, std::string_view)> DccFrameCallback;
+
+class DccFrameParser
+{
+private:
+  recvState state = _Text;
+  std::string pending;           // carry-over for a frame split over two reads
+  DccFrameCallback callback;
+
+  void emit(DccFrame type, std::string_view frame);
+  void emitPending(DccFrame type, const char *data, size_t len);
+
+public:
+  void setCallback(const DccFrameCallback &cb) { callback = cb; }
+  size_t parse(const char *data, size_t len); // scan one chunk as recieved from the port; returns the bytes dropped as garbage
+  void reset();                                // drop any partial frame
+
+  DccFrameParser() = default;
+  DccFrameParser(const DccFrameCallback &cb) : callback(cb) {};
+  ~DccFrameParser() = default;
+};
+
+/**
+ * @brief Prints the frames as they come out of the parser. Output is collected
+ * and written to stdout once per chunk instead of once per character.
+ * @note Diags are logged with INFO so they also reach the log file; the async logger prints
+ * them from its own thread and a diag can appear after replies which came in after it.
+ */
+class DccFrameConsole
+{
+private:
+  fmt::memory_buffer out;
+  static FILE *_stream;
+
+public:
+  void print(DccFrame type, std::string_view frame);
+  void flush();                                // write what has been collected and flush the stream
+
+  static void setStream(FILE *f) { _stream = f; }   // stdout by default
+
+  DccFrameConsole() = default;
+  ~DccFrameConsole() = default;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccHistogram
+ * @brief Lock-free latency histogram with HDR style log-linear buckets. Values below 32 have
+ * a bucket of their own, above that every power of two is split into 32 buckets so the
+ * relative error stays below 3% over the whole range. Recording is a couple of relaxed atomic
+ * adds and can be done from any thread; reading gives a consistent enough picture for
+ * monitoring while values are being recorded.
+ * @note Values are in microseconds; anything beyond DCC_HISTOGRAM_MAX is counted as the max
+ * @author grbba
+ */
+
+#ifndef DccHistogram_h
+#define DccHistogram_h
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#define DCC_HISTOGRAM_BITS 5                                  // 32 sub buckets per power of two
+#define DCC_HISTOGRAM_MAX ((uint64_t(1) << 32) - 1)           // ~71 minutes in us
+
+class DccHistogram
+{
+public:
+  static constexpr size_t subBuckets = size_t(1) << DCC_HISTOGRAM_BITS;
+  static constexpr size_t buckets = (32 - DCC_HISTOGRAM_BITS + 1) * subBuckets;
+
+private:
+  std::array<std::atomic<uint64_t>, buckets> counts{};
+  std::atomic<uint64_t> total{0};
+  std::atomic<uint64_t> accumulated{0};
+  std::atomic<uint64_t> maximum{0};
+
+  static int log2(uint64_t v)
+  {
+    int e = 0;
+    while (v >>= 1)
+      e++;
+    return e;
+  }
+
+public:
+  static size_t bucket(uint64_t v)
+  {
+    if (v < subBuckets)
+      return static_cast<size_t>(v);
+    int e = log2(v);
+    return (e - DCC_HISTOGRAM_BITS + 1) * subBuckets + ((v >> (e - DCC_HISTOGRAM_BITS)) - subBuckets);
+  }
+
+  /**
+   * @brief Highest value counted in bucket i
+   */
+  static uint64_t upper(size_t i)
+  {
+    if (i < subBuckets)
+      return i;
+    int shift = static_cast<int>(i / subBuckets) - 1;
+    uint64_t low = static_cast<uint64_t>(i % subBuckets + subBuckets) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+  }
+
+  void record(uint64_t us)
+  {
+    if (us > DCC_HISTOGRAM_MAX)
+      us = DCC_HISTOGRAM_MAX;
+    counts[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    accumulated.fetch_add(us, std::memory_order_relaxed);
+    auto m = maximum.load(std::memory_order_relaxed);
+    while (us > m && !maximum.compare_exchange_weak(m, us, std::memory_order_relaxed))
+      ;
+  }
+
+  void record(std::chrono::nanoseconds d)
+  {
+    record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+  }
+
+  /**
+   * @brief Value below which the fraction q of the recorded values are; 0 if nothing recorded
+   */
+  uint64_t percentile(double q) const
+  {
+    uint64_t n = count();
+    if (n == 0)
+      return 0;
+    uint64_t target = static_cast<uint64_t>(q * n + 0.5);
+    if (target == 0)
+      target = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; i++)
+    {
+      seen += counts[i].load(std::memory_order_relaxed);
+      if (seen >= target)
+        return std::min(upper(i), max());
+    }
+    return max();
+  }
+
+  uint64_t count() const { return total.load(std::memory_order_relaxed); }
+  uint64_t max() const { return maximum.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return accumulated.load(std::memory_order_relaxed); }
+  double mean() const { return count() ? static_cast<double>(sum()) / count() : 0.0; }
+
+  /**
+   * @brief Number of values recorded up to v; exact to the bucket v falls in
+   */
+  uint64_t countAtMost(uint64_t v) const
+  {
+    uint64_t n = 0;
+    for (size_t i = 0; i < buckets && upper(i) <= v; i++)
+      n += counts[i].load(std::memory_order_relaxed);
+    return n;
+  }
+
+  /**
+   * @brief Cumulative counts at the bucket edges; used for exporting
+   */
+  template <typename F>
+  void forEach(F f) const
+  {
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets; i++)
+    {
+      auto c = counts[i].load(std::memory_order_relaxed);
+      if (c == 0)
+        continue;
+      seen += c;
+      f(upper(i), c, seen);
+    }
+  }
+
+  void reset()
+  {
+    for (auto &c : counts)
+      c.store(0, std::memory_order_relaxed);
+    total = 0;
+    accumulated = 0;
+    maximum = 0;
+  }
+
+  DccHistogram() = default;
+  ~DccHistogram() = default;
+};
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include "DccIoContext.hpp"
+#include "Diag.hpp"
+
+asio::io_context DccIoContext::_io;
+std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> DccIoContext::_work;
+std::vector<std::thread> DccIoContext::_pool;
+std::mutex DccIoContext::_mutex;
+unsigned int DccIoContext::_threads = DCC_IO_THREADS;
+
+asio::io_context &DccIoContext::get()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_pool.empty())
+  {
+    // keeps run() from returning while no connection is open
+    _work = std::make_unique<asio::executor_work_guard<asio::io_context::executor_type>>(_io.get_executor());
+    _io.restart();
+    for (unsigned int i = 0; i < _threads; i++)
+    {
+      _pool.emplace_back([]
+                         { _io.run(); });
+    }
+    DBG("Started {} io threads", _threads);
+  }
+  return _io;
+}
+
+void DccIoContext::stop()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_pool.empty())
+  {
+    return;
+  }
+  _work.reset();
+  _io.stop();
+  for (auto &t : _pool)
+  {
+    t.join();
+  }
+  _pool.clear();
+}
@@ -0,0 +1,74 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccIoContext
+ * @brief The io_context shared by all connections. A small pool of threads runs it
+ * so the number of threads doesn't grow with the number of open ports. Each connection
+ * serializes its own handlers on a strand.
+ * @author grbba
+ */
+
+#ifndef DccIoContext_h
+#define DccIoContext_h
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+
+#define DCC_IO_THREADS 2 // default size of the thread pool
+
+class DccIoContext
+{
+private:
+  static asio::io_context _io;
+  static std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> _work;
+  static std::vector<std::thread> _pool;
+  static std::mutex _mutex;
+  static unsigned int _threads;
+
+public:
+  /**
+   * @brief The shared io_context; the thread pool is started on first use
+   */
+  static asio::io_context &get();
+
+  static void setThreads(unsigned int n) { _threads = (n == 0) ? 1 : n; }
+  static unsigned int getThreads() { return _threads; }
+
+  /**
+   * @brief True if called from one of the threads of the pool e.g. in a read handler
+   */
+  static bool runningInThisThread() { return _io.get_executor().running_in_this_thread(); }
+
+  /**
+   * @brief Stops the io_context and joins the pool; handlers which haven't run yet are
+   * dropped so the connections have to be closed before. Called on exit
+   */
+  static void stop();
+
+  DccIoContext() = default;
+  ~DccIoContext() = default;
+};
+
+#endif
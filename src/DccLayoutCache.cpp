@@ -0,0 +1,228 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include "DccLayoutCache.hpp"
+#include "DccVersion.hpp"
+#include "Diag.hpp"
+
+std::mutex DccLayoutCache::_mutex;
+std::list<std::pair<std::string, std::shared_ptr<DccLayout>>> DccLayoutCache::_layouts;
+DccLayoutCacheStats DccLayoutCache::_stats;
+
+/**
+ * @brief 64 bit FNV-1a; good enough to tell two versions of a file apart
+ */
+class DccLayoutHash
+{
+private:
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+public:
+  void add(const char *data, size_t len)
+  {
+    for (size_t i = 0; i < len; i++)
+    {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 0x100000001b3ULL;
+    }
+  }
+
+  void add(uint64_t v) { add(reinterpret_cast<const char *>(&v), sizeof(v)); }
+
+  /**
+   * @brief Adds the content of the file preceded by its length so the boundary between two
+   * files is part of the key
+   */
+  bool addFile(const std::string &name)
+  {
+    std::ifstream f(name, std::ios::binary);
+    if (!f)
+      return false;
+    f.seekg(0, std::ios::end);
+    add(static_cast<uint64_t>(f.tellg()));
+    f.seekg(0, std::ios::beg);
+    std::array<char, 64 * 1024> buf;
+    while (f.read(buf.data(), buf.size()) || f.gcount() > 0)
+      add(buf.data(), static_cast<size_t>(f.gcount()));
+    return !f.bad();
+  }
+
+  uint64_t value() const { return h; }
+};
+
+std::string DccLayoutCache::key(const std::string &layoutFile, const std::string &schemaFile)
+{
+  DccLayoutHash h;
+  auto version = fmt::format("{}.{}.{}/{}", MAJOR, MINOR, PATCH, DCC_LAYOUT_LIB_VERSION);
+  h.add(version.data(), version.size());
+  if (!h.addFile(layoutFile))
+    return "";
+  if (schemaFile.empty())
+    h.add(uint64_t(0)); // built without validation
+  else if (!h.addFile(schemaFile))
+    return "";
+  return fmt::format("{:016x}", h.value());
+}
+
+std::shared_ptr<DccLayout> DccLayoutCache::build(const std::string &layoutFile, const std::string &schemaFile)
+{
+  auto k = key(layoutFile, schemaFile);
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    for (auto it = _layouts.begin(); !k.empty() && it != _layouts.end(); ++it)
+    {
+      if (it->first != k)
+        continue;
+      _stats.hits++;
+      _layouts.splice(_layouts.begin(), _layouts, it);
+      DBG("Layout {} unchanged [{}]; using the one built before", layoutFile, k);
+      return _layouts.front().second;
+    }
+    _stats.misses++;
+  }
+
+  // built outside of the lock; this is the slow part. A layout validated by an earlier run
+  // is built from its stored copy without the schema
+  auto start = std::chrono::steady_clock::now();
+  auto layout = std::make_shared<DccLayout>();
+  bool fromStore = false;
+  std::error_code ec;
+  if (!k.empty() && !schemaFile.empty() && std::filesystem::exists(storedFile(k), ec))
+  {
+    fromStore = layout->build(storedFile(k), "");
+    if (fromStore)
+    {
+      // prune() keeps the layouts written or used last
+      std::filesystem::last_write_time(storedFile(k), std::filesystem::file_time_type::clock::now(), ec);
+    }
+    else
+    {
+      DBG("Stored layout {} can't be built; removing it", storedFile(k));
+      std::filesystem::remove(storedFile(k), ec);
+      layout = std::make_shared<DccLayout>();
+    }
+  }
+  if (!fromStore)
+  {
+    if (!layout->build(layoutFile, schemaFile))
+      return nullptr;
+    if (!k.empty() && !schemaFile.empty())
+      store(k, layoutFile, schemaFile);
+  }
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  DBG("Layout {} built{} in {}ms [{}]", layoutFile, fromStore ? " from the validated copy" : "", ms, k);
+
+  if (k.empty())
+    return layout; // a file went away while building; nothing to key it by
+
+  std::lock_guard<std::mutex> l(_mutex);
+  if (fromStore)
+    _stats.stored++;
+  _layouts.emplace_front(k, layout);
+  if (_layouts.size() > DCC_LAYOUT_CACHE_ENTRIES)
+    _layouts.pop_back();
+  return layout;
+}
+
+/**
+ * @brief Written to a temporary file first so an interrupted run never leaves half a layout
+ * under the key; failing to store only costs the validation next time
+ */
+void DccLayoutCache::store(const std::string &key, const std::string &layoutFile, const std::string &schemaFile)
+{
+  std::error_code ec;
+  std::filesystem::create_directories(DCC_LAYOUT_CACHE_DIR, ec);
+  auto file = storedFile(key);
+  auto tmp = file + ".tmp";
+  try
+  {
+    std::ifstream in(layoutFile);
+    auto j = nlohmann::json::parse(in);
+    if (DccLayoutCache::key(layoutFile, schemaFile) != key)
+    {
+      return; // changed since it has been validated
+    }
+    std::ofstream o(tmp, std::ios::trunc);
+    o << j.dump(); // only read back by the cache; no need for the indentation
+    o.close();
+    if (!o)
+    {
+      throw std::runtime_error("write failed");
+    }
+    std::filesystem::rename(tmp, file);
+  }
+  catch (const std::exception &e)
+  {
+    std::filesystem::remove(tmp, ec);
+    DBG("Can't store the validated layout as {}: {}", file, e.what());
+  }
+  prune();
+}
+
+/**
+ * @brief Keeps the DCC_LAYOUT_CACHE_ENTRIES stored layouts written or used last; every layout
+ * file edited adds a new key so the directory would otherwise grow with each change
+ */
+void DccLayoutCache::prune()
+{
+  std::error_code ec;
+  std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> stored;
+  for (auto &e : std::filesystem::directory_iterator(DCC_LAYOUT_CACHE_DIR, ec))
+  {
+    if (e.path().extension() == ".json")
+    {
+      stored.emplace_back(e.last_write_time(ec), e.path());
+    }
+  }
+  if (stored.size() <= DCC_LAYOUT_CACHE_ENTRIES)
+  {
+    return;
+  }
+  std::sort(stored.begin(), stored.end(), [](const auto &a, const auto &b)
+            { return a.first > b.first; });
+  for (size_t i = DCC_LAYOUT_CACHE_ENTRIES; i < stored.size(); i++)
+  {
+    DBG("Removing the stored layout {}", stored[i].second.string());
+    std::filesystem::remove(stored[i].second, ec);
+  }
+}
+
+void DccLayoutCache::clear()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  _layouts.clear();
+}
+
+DccLayoutCacheStats DccLayoutCache::getStats()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  return _stats;
+}
@@ -0,0 +1,93 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccLayoutCache
+ * @brief Keeps the built layouts keyed by the content of the layout and the schema file so
+ * loading an unchanged layout again doesn't re-read, re-validate and recompute all the paths.
+ * The key is a hash over the bytes of both files, the version of the cli and the revision of
+ * the LayoutGraph library which validates and builds the layout; touching a file without
+ * changing it keeps the key, any change to either file or a new library builds the layout again.
+ * The layout a schema has accepted is also stored under DCC_LAYOUT_CACHE_DIR by its key so a
+ * later run builds it from there without validating it again; the directory keeps the
+ * DCC_LAYOUT_CACHE_ENTRIES layouts used last.
+ * @note The built model lives in the LayoutGraph library which has no serialization; only the
+ * validated layout goes to disk, the paths are computed again on every run.
+ * @author grbba
+ */
+
+#ifndef DccLayoutCache_h
+#define DccLayoutCache_h
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "DccLayout.hpp"
+
+#define DCC_LAYOUT_CACHE_ENTRIES 4 // layouts kept in memory and on disk; the least recently loaded one is dropped
+#define DCC_LAYOUT_CACHE_DIR "./cs-assets/cache" // validated layouts as <key>.json
+
+#ifndef DCC_LAYOUT_LIB_VERSION
+#define DCC_LAYOUT_LIB_VERSION "unknown" // revision of the LayoutGraph checkout; set by cmake
+#endif
+
+struct DccLayoutCacheStats
+{
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t stored = 0;    // misses built from a validated layout on disk
+};
+
+class DccLayoutCache
+{
+private:
+  static std::mutex _mutex;
+  static std::list<std::pair<std::string, std::shared_ptr<DccLayout>>> _layouts; // most recent first
+  static DccLayoutCacheStats _stats;
+
+  static std::string storedFile(const std::string &key) { return std::string(DCC_LAYOUT_CACHE_DIR "/") + key + ".json"; }
+  static void store(const std::string &key, const std::string &layoutFile, const std::string &schemaFile); // after the schema accepted it
+  static void prune();                                 // drops the stored layouts not used for the longest time
+
+public:
+  /**
+   * @brief Hash over the content of the files, the cli and the library version as 16 hex digits;
+   * empty if a file given can't be read
+   */
+  static std::string key(const std::string &layoutFile, const std::string &schemaFile);
+
+  /**
+   * @brief The layout built from the files; built only if the content changed since the last time
+   * @return nullptr if the layout can't be built
+   */
+  static std::shared_ptr<DccLayout> build(const std::string &layoutFile, const std::string &schemaFile);
+
+  static void clear();
+  static DccLayoutCacheStats getStats();
+
+  DccLayoutCache() = default;
+  ~DccLayoutCache() = default;
+};
+
+#endif
@@ -18,4 +18,536 @@
  * <https://www.gnu.org/licenses/>
  */
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <random>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
 #include "DccMQTT.hpp"
+#include "DccIoContext.hpp"
+#include "ShellCmdExec.hpp"
+#include "Diag.hpp"
+
+void DccMQTTStats::reset()
+{
+  publishes = 0;
+  packed = 0;
+  failed = 0;
+  states = 0;
+  delivery.reset();
+}
+
+nlohmann::json DccMQTTStats::toJson() const
+{
+  return {
+      {"publishes", publishes.load()},
+      {"packed", packed.load()},
+      {"failed", failed.load()},
+      {"states", states.load()},
+      {"deliveryUs", {{"count", delivery.count()},
+                      {"mean", delivery.mean()},
+                      {"p50", delivery.percentile(0.5)},
+                      {"p99", delivery.percentile(0.99)},
+                      {"max", delivery.max()}}}};
+}
+
+void DccMQTTDelivery::on_success(const mqtt::token &tok)
+{
+  owner.delivered(reinterpret_cast<uintptr_t>(tok.get_user_context()), true);
+}
+
+void DccMQTTDelivery::on_failure(const mqtt::token &tok)
+{
+  owner.delivered(reinterpret_cast<uintptr_t>(tok.get_user_context()), false);
+}
+
+DccMQTT::DccMQTT() : listener(*this)
+{
+  clientID = fmt::format("{}-{:06x}", DCC_MQTT_CLIENT, std::random_device{}() & 0xffffff);
+}
+
+/**
+ * @brief Opens the connection from mqtt://<broker>[:<port>]/<station>; the port defaults to 1883
+ */
+bool DccMQTT::open(const DccUri &uri)
+{
+  if (uri.host.empty())
+  {
+    auto s = fmt::format("No broker given in [{}]", uri.text);
+    throw ShellCmdExecException(s);
+  }
+  broker.brokerUri = fmt::format("tcp://{}:{}", uri.host, uri.port.empty() ? DCC_MQTT_PORT : uri.port);
+  broker.user = uri.get("user");
+  broker.pwd = uri.get("pwd");
+  broker.prefix = uri.get("prefix", DCC_MQTT_PREFIX);
+  clientID = uri.get("client", clientID);
+  qos = uri.getInt("qos", 0);
+  if (qos < 0 || qos > 2)
+  {
+    auto s = fmt::format("Wrong qos in [{}]; use 0, 1 or 2", uri.text);
+    throw ShellCmdExecException(s);
+  }
+  const int windows[] = {DCC_MQTT_WINDOW_QOS0, DCC_MQTT_WINDOW_QOS1, DCC_MQTT_WINDOW_QOS2};
+  window = uri.getInt("window", windows[qos]);
+  if (window <= 0)
+  {
+    auto s = fmt::format("Wrong window in [{}]; at least one publish has to be in flight", uri.text);
+    throw ShellCmdExecException(s);
+  }
+  auto path = uri.path.empty() ? std::string() : uri.path.substr(1);
+  if (!path.empty())
+  {
+    station = path;
+  }
+
+  connected = connect();
+  return connected;
+}
+
+std::string DccMQTT::describe()
+{
+  return fmt::format("mqtt{}/{}", broker.brokerUri.substr(broker.brokerUri.find("://")), station);
+}
+
+/**
+ * @brief Creates the client, connects and subscribes to the replies of the station
+ * @throws ShellCmdExecException if the broker can't be reached
+ */
+bool DccMQTT::connect()
+{
+  {
+    // the outbox stays; the transport takes it with unsent() and writes it again once connected
+    std::lock_guard<std::mutex> o(outMutex);
+    inflight.clear();
+  }
+  {
+    std::lock_guard<std::mutex> l(clientMutex);
+    if (client)
+    {
+      // a reconnect; the old client has lost its connection already and mustn't report it again
+      client->disable_callbacks();
+    }
+  }
+
+  // connected and subscribed without the lock so the io threads publishing and the state
+  // publisher aren't held up for up to the timeout; they use the old client until the swap
+  auto b = mqtt::connect_options_builder()
+               .clean_session(true)
+               .keep_alive_interval(std::chrono::seconds(20))
+               .max_inflight(window);
+  if (!broker.user.empty())
+  {
+    b.user_name(broker.user).password(broker.pwd);
+  }
+  connOpts = b.finalize();
+
+  auto timeout = std::chrono::milliseconds(DCC_MQTT_TIMEOUT);
+  try
+  {
+    auto c = std::make_unique<mqtt::async_client>(broker.brokerUri, clientID, nullptr);
+    c->set_callback(*this);
+
+    INFO("Connecting to MQTT broker at: {}", broker.brokerUri);
+    if (!c->connect(connOpts)->wait_for(timeout))
+    {
+      auto s = fmt::format("Timeout connecting to the MQTT broker {}", broker.brokerUri);
+      throw ShellCmdExecException(s);
+    }
+    if (!c->subscribe(replyTopic(), qos)->wait_for(timeout))
+    {
+      auto s = fmt::format("Timeout subscribing to {}", replyTopic());
+      throw ShellCmdExecException(s);
+    }
+    DBG("Subscribed to [{}] as client [{}] using QoS [{}]", replyTopic(), clientID, qos);
+
+    // the old client ends up in c and goes away after the lock has been released
+    std::lock_guard<std::mutex> l(clientMutex);
+    client.swap(c);
+  }
+  catch (const mqtt::exception &exc)
+  {
+    auto s = fmt::format("Unable to connect to MQTT server {}: {}", broker.brokerUri, exc.what());
+    throw ShellCmdExecException(s);
+  }
+  return DCC_SUCCESS;
+}
+
+void DccMQTT::disconnect()
+{
+  std::unique_ptr<mqtt::async_client> c;
+  {
+    std::lock_guard<std::mutex> l(clientMutex);
+    connected = false;
+    c = std::move(client);
+  }
+  if (!c)
+  {
+    return;
+  }
+  // outside of the lock; delivery callbacks still running find no client
+  c->disable_callbacks(); // no connection_lost for a disconnect we asked for
+  try
+  {
+    if (c->is_connected())
+    {
+      c->disconnect()->wait_for(std::chrono::milliseconds(DCC_MQTT_TIMEOUT));
+    }
+  }
+  catch (const mqtt::exception &exc)
+  {
+    DBG("Disconnecting from {}: {}", broker.brokerUri, exc.what());
+  }
+  c.reset();
+
+  std::lock_guard<std::mutex> o(outMutex);
+  outbox.clear();
+  inflight.clear();
+}
+
+void DccMQTT::setStation(const std::string &s)
+{
+  std::lock_guard<std::mutex> l(clientMutex);
+  if (client && client->is_connected())
+  {
+    try
+    {
+      client->unsubscribe(replyTopic())->wait_for(std::chrono::milliseconds(DCC_MQTT_TIMEOUT));
+      station = s;
+      client->subscribe(replyTopic(), qos)->wait_for(std::chrono::milliseconds(DCC_MQTT_TIMEOUT));
+    }
+    catch (const mqtt::exception &exc)
+    {
+      auto e = fmt::format("Unable to subscribe to {}: {}", replyTopic(), exc.what());
+      throw ShellCmdExecException(e);
+    }
+    return;
+  }
+  station = s;
+}
+
+/**
+ * @brief Queues the command; a pump posted to the io threads publishes everything queued until
+ * it runs so commands written in a burst go out together even while the window has room
+ */
+void DccMQTT::transmit(const char *data, size_t len)
+{
+  std::lock_guard<std::mutex> o(outMutex);
+  outbox.append(data, len);
+  if (pumpScheduled)
+  {
+    return;
+  }
+  pumpScheduled = true;
+  asio::post(DccIoContext::get(), [w = weak_from_this()]
+             {
+    auto t = std::static_pointer_cast<DccMQTT>(w.lock());
+    if (!t)
+      return; // closed in the meantime
+    std::lock_guard<std::mutex> o(t->outMutex);
+    t->pumpScheduled = false;
+    t->pump(); });
+}
+
+std::string DccMQTT::unsent()
+{
+  std::lock_guard<std::mutex> o(outMutex);
+  std::string s;
+  s.swap(outbox);
+  return s;
+}
+
+void DccMQTT::flushLink()
+{
+  std::lock_guard<std::mutex> o(outMutex);
+  pump();
+}
+
+void DccMQTT::pump()
+{
+  while (!outbox.empty() && inflight.size() < static_cast<size_t>(window))
+  {
+    // cut after a command so no command is split over two publishes
+    size_t n = outbox.size();
+    if (n > DCC_MQTT_PAYLOAD)
+    {
+      auto end = outbox.rfind('>', DCC_MQTT_PAYLOAD - 1);
+      n = (end == std::string::npos) ? DCC_MQTT_PAYLOAD : end + 1;
+    }
+    auto commands = std::count(outbox.begin(), outbox.begin() + n, '<');
+    auto seq = nextSeq++;
+    {
+      std::lock_guard<std::mutex> l(clientMutex);
+      if (!client)
+      {
+        // closed; while reconnecting the transport keeps the commands and doesn't get here
+        auto lost = std::count(outbox.begin(), outbox.end(), '<');
+        mqttStats.failed.fetch_add(1, std::memory_order_relaxed);
+        WARN("Connection {} is closed; {} commands not send", describe(), lost);
+        outbox.clear();
+        return;
+      }
+      inflight[seq] = std::chrono::steady_clock::now();
+      try
+      {
+        auto msg = mqtt::make_message(commandTopic(), outbox.data(), n, qos, false);
+        client->publish(msg, reinterpret_cast<void *>(static_cast<uintptr_t>(seq)), listener);
+      }
+      catch (const mqtt::exception &exc)
+      {
+        // the outbox is kept for the reconnect
+        inflight.erase(seq);
+        linkDown(exc.what());
+        return;
+      }
+    }
+    mqttStats.publishes.fetch_add(1, std::memory_order_relaxed);
+    if (commands > 1)
+    {
+      mqttStats.packed.fetch_add(1, std::memory_order_relaxed);
+    }
+    outbox.erase(0, n);
+  }
+}
+
+/**
+ * @brief A publish has completed at its qos; frees its slot in the window
+ */
+void DccMQTT::delivered(uint64_t seq, bool ok)
+{
+  std::lock_guard<std::mutex> o(outMutex);
+  auto it = inflight.find(seq);
+  if (it == inflight.end())
+  {
+    return; // from before a reconnect
+  }
+  mqttStats.delivery.record(std::chrono::steady_clock::now() - it->second);
+  inflight.erase(it);
+  if (!ok)
+  {
+    mqttStats.failed.fetch_add(1, std::memory_order_relaxed);
+  }
+  pump();
+}
+
+void DccMQTT::publishState(const std::string &object, const std::string &payload)
+{
+  std::lock_guard<std::mutex> l(clientMutex);
+  if (!client)
+  {
+    return; // retained messages already published stay with the broker
+  }
+  try
+  {
+    client->publish(broker.prefix + "/" + station + "/" + object, payload.data(), payload.size(), qos, true);
+    mqttStats.states.fetch_add(1, std::memory_order_relaxed);
+  }
+  catch (const mqtt::exception &exc)
+  {
+    DBG("Publishing the state of {}: {}", object, exc.what());
+  }
+}
+
+void DccMQTT::connection_lost(const std::string &cause)
+{
+  linkDown(cause.empty() ? std::string("connection to the broker lost") : cause);
+}
+
+void DccMQTT::message_arrived(mqtt::const_message_ptr msg)
+{
+  auto &payload = msg->get_payload_str();
+  recieve(payload.data(), payload.size());
+}
+
+// ---------------------------------------------------------------------------------------------
+// State publishing
+// ---------------------------------------------------------------------------------------------
+
+std::mutex DccMQTTState::_mutex;
+std::atomic<const void *> DccMQTTState::_source{nullptr};
+std::weak_ptr<DccTransport> DccMQTTState::_sourceRef;
+std::weak_ptr<DccMQTT> DccMQTTState::_target;
+std::chrono::milliseconds DccMQTTState::_interval{DCC_MQTT_STATE_INTERVAL};
+std::map<std::string, DccMQTTState::Entry> DccMQTTState::_state;
+std::unique_ptr<asio::steady_timer> DccMQTTState::_timer;
+bool DccMQTTState::_armed = false;
+
+static std::string onOff(int v) { return v ? "on" : "off"; }
+
+void DccMQTTState::setup()
+{
+  // <p0>, <p1> or <p1 MAIN|PROG|JOIN>
+  DccResponseDecoder::add('p', [](const DccResponse &r)
+                          {
+    if (r.argc == 0 || !r.args[0].isInt)
+      return;
+    std::string object = "power";
+    if (r.argc > 1)
+    {
+      object += "/";
+      for (auto c : r.textArg(1))
+        object += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    update(r, object, onOff(r.intArg(0))); });
+
+  // <H id state> or <H id addr sub state>; the state is the last argument
+  DccResponseDecoder::add('H', [](const DccResponse &r)
+                          {
+    if (r.argc != 2 && r.argc != 4)
+      return;
+    update(r, fmt::format("turnout/{}", r.intArg(0)), r.intArg(r.argc - 1) ? "thrown" : "closed"); });
+
+  // <Q id> active, <q id> inactive; <Q id pin pullup> is the definition of the sensor
+  DccResponseDecoder::add('Q', [](const DccResponse &r)
+                          {
+    if (r.argc == 1)
+      update(r, fmt::format("sensor/{}", r.intArg(0)), "active"); });
+  DccResponseDecoder::add('q', [](const DccResponse &r)
+                          {
+    if (r.argc == 1)
+      update(r, fmt::format("sensor/{}", r.intArg(0)), "inactive"); });
+
+  // <Y id state> or <Y id pin flags state>
+  DccResponseDecoder::add('Y', [](const DccResponse &r)
+                          {
+    if (r.argc != 2 && r.argc != 4)
+      return;
+    update(r, fmt::format("output/{}", r.intArg(0)), onOff(r.intArg(r.argc - 1))); });
+
+  // <l cab reg speedbyte functions>; speed 1 is the emergency stop, above that the step + 1
+  DccResponseDecoder::add('l', [](const DccResponse &r)
+                          {
+    if (r.argc != 4)
+      return;
+    auto sb = r.intArg(2);
+    auto step = sb & 0x7f;
+    update(r, fmt::format("loco/{}", r.intArg(0)),
+           fmt::format("{{\"speed\":{},\"forward\":{},\"estop\":{},\"functions\":{}}}",
+                       step > 1 ? step - 1 : 0, (sb & 0x80) ? "true" : "false", step == 1 ? "true" : "false",
+                       static_cast<unsigned int>(r.intArg(3, 0)))); });
+}
+
+void DccMQTTState::update(const DccResponse &r, const std::string &object, std::string value)
+{
+  if (r.source == nullptr || r.source != _source.load(std::memory_order_acquire))
+  {
+    return; // most of the time; publishing is off or the reply is from another connection
+  }
+  std::lock_guard<std::mutex> l(_mutex);
+  auto source = _sourceRef.lock();
+  auto target = _target.lock();
+  if (!source || !target || r.source != source.get())
+  {
+    return;
+  }
+  auto &e = _state[object];
+  if (value == (e.dirty ? e.pending : e.sent))
+  {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (!e.dirty && now - e.last >= _interval)
+  {
+    target->publishState(object, value);
+    e.sent = std::move(value);
+    e.last = now;
+    return;
+  }
+  if (value == e.sent)
+  {
+    // changed back before the held back value went out
+    e.dirty = false;
+    e.pending.clear();
+    return;
+  }
+  e.pending = std::move(value);
+  e.dirty = true;
+  arm();
+}
+
+void DccMQTTState::arm()
+{
+  if (_armed || !_timer)
+  {
+    return;
+  }
+  _armed = true;
+  _timer->expires_after(_interval);
+  _timer->async_wait([](const std::error_code &ec)
+                     { if (!ec) tick(); });
+}
+
+void DccMQTTState::tick()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  _armed = false;
+  auto target = _target.lock();
+  if (!target || _sourceRef.expired())
+  {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  bool waiting = false;
+  for (auto &[object, e] : _state)
+  {
+    if (!e.dirty)
+      continue;
+    if (now - e.last < _interval)
+    {
+      waiting = true;
+      continue;
+    }
+    target->publishState(object, e.pending);
+    e.sent.swap(e.pending);
+    e.pending.clear();
+    e.dirty = false;
+    e.last = now;
+  }
+  if (waiting)
+  {
+    arm();
+  }
+}
+
+void DccMQTTState::start(std::shared_ptr<DccTransport> source, std::shared_ptr<DccMQTT> target,
+                         std::chrono::milliseconds interval)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (!_timer)
+  {
+    _timer = std::make_unique<asio::steady_timer>(DccIoContext::get());
+  }
+  _timer->cancel();
+  _armed = false;
+  _state.clear();
+  _target = target;
+  _interval = interval;
+  _sourceRef = source;
+  _source.store(source.get(), std::memory_order_release);
+}
+
+void DccMQTTState::stop()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  _source.store(nullptr, std::memory_order_release);
+  _sourceRef.reset();
+  _timer.reset(); // cancels a pending tick; must not outlive the io_context
+  _armed = false;
+  _state.clear();
+  _target.reset();
+}
+
+void DccMQTTState::closed(DccTransport *t)
+{
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    auto target = _target.lock();
+    if (t == nullptr || (t != _source.load() && t != target.get()))
+    {
+      return;
+    }
+  }
+  stop();
+  INFO("State publishing stopped; {} has been closed", t->describe());
+}
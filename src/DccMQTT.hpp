@@ -18,19 +18,48 @@
  * <https://www.gnu.org/licenses/>
  */
 
+/**
+ * @class DccMQTT
+ * @brief Connection to a commandstation through an MQTT broker;
+ * mqtt://<broker>[:<port>]/<station>?prefix=<prefix>&qos=0|1|2&window=<n>&user=<user>&pwd=<pwd>&client=<id>
+ * The client lives as long as the connection. Commands are published to <prefix>/<station>/cmd;
+ * whatever the station publishes on <prefix>/<station>/reply goes through the same frame parser
+ * as the serial and tcp input. A lost broker connection is reported to the transport which
+ * reconnects with backoff like any other connection.
+ * At most window publishes are in flight. Commands are collected in an outbox and everything
+ * queued goes out together in the next publish, either from the io thread right after the write
+ * or once a slot in a full window has been delivered, so a bulk upload isn't bound by a broker
+ * round trip per command.
+ * @author grbba
+ */
+
 #ifndef DCCMQTT_H
 #define DCCMQTT_H
 
-#include <mqtt/async_client.h>
-#include <mqtt/topic.h>
-#include "ShellCmdExec.hpp"
-#include "Diag.hpp"
-
-const int QOS = 0;
-const int N_RETRY_ATTEMPTS = 5;
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 
-#define TOPIC "dcccli"
-#define CLIENT_ID "dcccli"
+#include <asio.hpp>
+#include <mqtt/async_client.h>
+#include "DccTransport.hpp"
+#include "DccResponse.hpp"
+
+#define DCC_MQTT_HOST "localhost"        // broker if none is given; e.g. dcccli-broker or a mosquitto on the same machine
+#define DCC_MQTT_PORT "1883"
+#define DCC_MQTT_PREFIX "dcc"             // topics are <prefix>/<station>/cmd|reply
+#define DCC_MQTT_STATION "cs"             // station if none is given in the uri
+#define DCC_MQTT_CLIENT "dcccli"          // the client id gets the pid appended so several cli's can connect
+#define DCC_MQTT_TIMEOUT 5000             // ms to wait for the connect and the subscribe
+#define DCC_MQTT_PAYLOAD 4096             // most bytes packed into one publish
+#define DCC_MQTT_WINDOW_QOS0 64           // publishes in flight by qos; qos 0 only waits for the socket
+#define DCC_MQTT_WINDOW_QOS1 16
+#define DCC_MQTT_WINDOW_QOS2 8
+#define DCC_MQTT_STATE_INTERVAL 100       // ms between two state publishes of the same object
 
 //----------------------
 // MQTT Broker
@@ -41,185 +70,163 @@ struct MQTTBroker
 	std::string brokerUri; // domain:port or IP:port
 	std::string user;
 	std::string pwd;
-	std::string prefix;
+	std::string prefix = DCC_MQTT_PREFIX;
 
 	MQTTBroker(std::string uri) : brokerUri(uri){};
 };
 
-// standard public mosquitto org broker for testing purposes not for production purposes
-// as all topic can be read/published to by anyone no use / no pwd
+// a broker on the same machine; public brokers let anyone read and publish on the topics so
+// they are never a default
+const MQTTBroker localBroker("tcp://" DCC_MQTT_HOST ":" DCC_MQTT_PORT);
 
-const MQTTBroker publicBroker("tcp://test.mosquitto.org:1883");
-
-class action_listener : public virtual mqtt::iaction_listener
+struct DccMQTTStats
 {
-	std::string name_;
-
-	void on_failure(const mqtt::token &tok) override
-	{
-		std::cout << name_ << " failure";
-		if (tok.get_message_id() != 0)
-			std::cout << " for token: [" << tok.get_message_id() << "]" << std::endl;
-		std::cout << std::endl;
-	}
-
-	void on_success(const mqtt::token &tok) override
-	{
-		std::cout << name_ << " success";
-		if (tok.get_message_id() != 0)
-			std::cout << " for token: [" << tok.get_message_id() << "]" << std::endl;
-		auto top = tok.get_topics();
-		if (top && !top->empty())
-			std::cout << "\ttoken topic: '" << (*top)[0] << "', ..." << std::endl;
-		std::cout << std::endl;
-	}
-
-public:
-	action_listener(const std::string &name) : name_(name) {}
+	std::atomic<uint64_t> publishes{0};
+	std::atomic<uint64_t> packed{0};    // publishes carrying more than one command
+	std::atomic<uint64_t> failed{0};    // publishes the broker didn't acknowledge
+	std::atomic<uint64_t> states{0};    // retained state messages
+	DccHistogram delivery;              // us from the publish to its completion at the qos
+
+	void reset();
+	nlohmann::json toJson() const;
 };
 
+class DccMQTT;
+
 /**
- * Local callback & listener class for use with the client connection.
- * This is primarily intended to receive messages, but it will also monitor
- * the connection to the broker. If the connection is lost, it will attempt
- * to restore the connection and re-subscribe to the topic.
+ * @brief Completion of the publishes; the user context of the token is the sequence number
  */
-class callback : public virtual mqtt::callback,
-				 public virtual mqtt::iaction_listener
-
+class DccMQTTDelivery : public virtual mqtt::iaction_listener
 {
-	// Counter for the number of connection retries
-	int nretry_;
-	// The MQTT client
-	mqtt::async_client &cli_;
-	// Options to use if we need to reconnect
-	mqtt::connect_options &connOpts_;
-	// An action listener to display the result of actions.
-	action_listener subListener_;
-
-	// This deomonstrates manually reconnecting to the broker by calling
-	// connect() again. This is a possibility for an application that keeps
-	// a copy of it's original connect_options, or if the app wants to
-	// reconnect with different options.
-	// Another way this can be done manually, if using the same options, is
-	// to just call the async_client::reconnect() method.
-	void reconnect()
-	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(2500));
-		try
-		{
-			cli_.connect(connOpts_, nullptr, *this);
-		}
-		catch (const mqtt::exception &exc)
-		{
-			std::cerr << "Error: " << exc.what() << std::endl;
-			exit(1);
-		}
-	}
-
-	// Re-connection failure
-	void on_failure(const mqtt::token &tok) override
-	{
-		std::cout << "Connection attempt failed" << std::endl;
-		if (++nretry_ > N_RETRY_ATTEMPTS)
-			exit(1);
-		reconnect();
-	}
-
-	// (Re)connection success
-	// Either this or connected() can be used for callbacks.
-	void on_success(const mqtt::token &tok) override {}
-
-	// (Re)connection success
-	void connected(const std::string &cause) override
-	{
-
-		INFO("Connected.");
-		// auto topicOpts = mqtt::topic_options_builder()
-		// cli_.subscribe(TOPIC, DFLT_QOS, nullptr, subListener_);
-	}
-
-	// Callback for when the connection is lost.
-	// This will initiate the attempt to manually reconnect.
-	void connection_lost(const std::string &cause) override
-	{
-		std::cout << "\nConnection lost" << std::endl;
-		if (!cause.empty())
-			std::cout << "\tcause: " << cause << std::endl;
-
-		std::cout << "Reconnecting..." << std::endl;
-		nretry_ = 0;
-		reconnect();
-	}
-
-	// Callback for when a message arrives.
-	void message_arrived(mqtt::const_message_ptr msg) override
-	{
-		std::cout << "Message arrived" << std::endl;
-		std::cout << "\ttopic: '" << msg->get_topic() << "'" << std::endl;
-		std::cout << "\tpayload: '" << msg->to_string() << "'\n"
-				  << std::endl;
-	}
+	DccMQTT &owner;
 
-	void delivery_complete(mqtt::delivery_token_ptr token) override {}
+	void on_failure(const mqtt::token &tok) override;
+	void on_success(const mqtt::token &tok) override;
 
 public:
-	callback(mqtt::async_client &cli, mqtt::connect_options &connOpts)
-		: nretry_(0), cli_(cli), connOpts_(connOpts), subListener_("Subscription") {}
+	DccMQTTDelivery(DccMQTT &m) : owner(m) {}
 };
 
-//---------
-
-class DccMQTT
+class DccMQTT : public DccTransport, public virtual mqtt::callback
 {
 private:
-	std::string clientID = "dcccli";
-	MQTTBroker broker = publicBroker; // by default the public broker
-	std::string topic = "foobar";
+	std::string clientID;
+	MQTTBroker broker = localBroker;
+	std::string station = DCC_MQTT_STATION;
+	int qos = 0;
+	std::atomic<bool> connected{false};              // read by the shell and the io threads
+
+	std::mutex clientMutex;                            // swapping the client against publishing; never held while connecting
+	std::unique_ptr<mqtt::async_client> client;
+	mqtt::connect_options connOpts;
+
+	std::mutex outMutex;                               // the outbox and the in flight publishes
+	std::string outbox;                                // commands waiting for the next publish
+	std::map<uint64_t, std::chrono::steady_clock::time_point> inflight; // sequence number -> publish time
+	uint64_t nextSeq = 1;
+	bool pumpScheduled = false;                        // a pump has been posted; transmit only queues
+	int window = DCC_MQTT_WINDOW_QOS0;                 // publishes in flight at most
+	DccMQTTDelivery listener;
+	DccMQTTStats mqttStats;
+
+	std::string commandTopic() const { return broker.prefix + "/" + station + "/cmd"; }
+	std::string replyTopic() const { return broker.prefix + "/" + station + "/reply"; }
+
+	bool connect();
+	void disconnect();
+	void pump();                                       // publishes from the outbox while the window allows; outMutex held
+	void delivered(uint64_t seq, bool ok);
+
+	friend class DccMQTTDelivery;
+
+	// mqtt::callback; called on the paho thread
+	void connection_lost(const std::string &cause) override;
+	void message_arrived(mqtt::const_message_ptr msg) override;
+
+protected:
+	void transmit(const char *data, size_t len) override;
+	void flushLink() override;
+	bool reconnect() override { return connected = connect(); }
+	std::string unsent() override;
+	void closeLink() override { disconnect(); }
 
 public:
-	DccMQTT() = default;
-	~DccMQTT() = default;
+	DccMQTT();
+	~DccMQTT() { disconnect(); }
+
+	bool open(const DccUri &uri) override;
+	bool isOpen() override { return connected; }
+	std::string describe() override;
+
+	/**
+	 * @brief Talks to another station on the same broker; resubscribes if connected
+	 */
+	void setStation(const std::string &s);
+	std::string getStation() const { return station; }
+
+	const DccMQTTStats &getMqttStats() const { return mqttStats; }
+	void resetMqttStats() { mqttStats.reset(); }
+	int getWindow() const { return window; }
+
+	/**
+	 * @brief Publishes a retained message on <prefix>/<station>/<object>; dropped while disconnected
+	 */
+	void publishState(const std::string &object, const std::string &payload);
+};
 
-	bool connect()
+/**
+ * @class DccMQTTState
+ * @brief Publishes the state the commandstation reports on one connection as retained messages
+ * on <prefix>/<station>/power[/<track>], turnout/<id>, sensor/<id>, output/<id> and loco/<cab>
+ * of an mqtt connection, so any number of dashboards and throttles can follow the layout from
+ * the broker instead of each opening a connection to the commandstation. Only changes are
+ * published and one object at most once per interval; changes in between are folded into the
+ * latest value which goes out when the interval is over.
+ * @note The decoder handlers are registered by setup(); publishing is switched on and off at runtime
+ * @author grbba
+ */
+class DccMQTTState
+{
+private:
+	struct Entry
 	{
-		mqtt::async_client cli(broker.brokerUri, clientID, nullptr);
-
-		auto connOpts = mqtt::connect_options_builder()
-							.clean_session(false)
-							.finalize();
-
-		callback cb(cli, connOpts);
-		cli.set_callback(cb);
-
-		try
-		{
-			INFO("Connecting to MQTT broker at: {}", broker.brokerUri);
-			// cli.connect(connOpts, nullptr, cb);
-			mqtt::token_ptr conntok = cli.connect(connOpts, nullptr, cb);
-			conntok->wait();
-
-			INFO("Subscribing to topic: [{}] for client [{}] using QoS [{}]", TOPIC, CLIENT_ID, QOS);
-
-			mqtt::token_ptr tok;
-			mqtt::topic top(cli, TOPIC, QOS);
-
-			std::string payload = "foobarcli";
-			tok = top.publish(payload);
-			tok->wait();
-
-			auto subOpts = mqtt::subscribe_options(true);
-			top.subscribe(subOpts)->wait();
-			std::cout << "Ok" << std::endl;
-		}
-		catch (const mqtt::exception &exc)
-		{
-			auto s = fmt::format("ERROR: Unable to connect to MQTT server: {}/{}\n", broker.brokerUri, exc.what());
-			throw ShellCmdExecException(s);
-		}
-
-		return DCC_SUCCESS;
-	}
+		std::string sent;                              // what the subscribers have
+		std::string pending;                           // newer value held back by the rate limit
+		bool dirty = false;
+		std::chrono::steady_clock::time_point last;    // of the last publish
+	};
+
+	static std::mutex _mutex;
+	static std::atomic<const void *> _source;         // connection whose state is published; nullptr if off
+	static std::weak_ptr<DccTransport> _sourceRef;    // the same; tells a closed source from a new one at its address
+	static std::weak_ptr<DccMQTT> _target;
+	static std::chrono::milliseconds _interval;
+	static std::map<std::string, Entry> _state;         // object -> entry
+	static std::unique_ptr<asio::steady_timer> _timer;
+	static bool _armed;
+
+	static void update(const DccResponse &r, const std::string &object, std::string value);
+	static void tick();
+	static void arm();                                  // _mutex held
+
+public:
+	static void setup();
+
+	/**
+	 * @brief Publishes the state seen on source through target; replaces a running publisher
+	 */
+	static void start(std::shared_ptr<DccTransport> source, std::shared_ptr<DccMQTT> target,
+					  std::chrono::milliseconds interval);
+	static void stop();                                 // also releases the timer; called on exit
+
+	/**
+	 * @brief A connection closes; publishing stops if it is the source or the target
+	 */
+	static void closed(DccTransport *t);
+	static bool running() { return _source.load() != nullptr; }
+
+	DccMQTTState() = default;
+	~DccMQTTState() = default;
 };
 
-#endif
\ No newline at end of file
+#endif
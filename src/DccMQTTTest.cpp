@@ -0,0 +1,117 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * dcccli-mqtt-test : the mqtt transport as the shell opens it, against DccBroker and a simulated
+ * station in the same process; a status request and commands packed into one publish make the
+ * round trip through paho, the broker and the station. Run by ctest.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <asio.hpp>
+#include <fmt/core.h>
+
+#include "DccBroker.hpp"
+#include "DccIoContext.hpp"
+#include "DccMQTT.hpp"
+#include "DccRequest.hpp"
+#include "DccSim.hpp"
+#include "DccTransport.hpp"
+#include "Diag.hpp"
+
+using namespace std::chrono_literals;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what)
+{
+  fmt::print("{} {}\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+auto main() -> int
+{
+  Diag::setFileInfo(false);
+  Diag::setup();
+  spdlog::set_level(spdlog::level::warn);
+  static FILE *null = fopen("/dev/null", "w");
+  if (null)
+  {
+    DccFrameConsole::setStream(null); // the replies are checked, not shown
+  }
+
+  DccRequest::setup();
+  DccTransportRegistry::add("mqtt", []
+                            { return std::make_shared<DccMQTT>(); });
+
+  asio::io_context io;
+  auto work = asio::make_work_guard(io);
+  DccBroker broker(io);
+  DccBrokerStation station(broker, DCC_MQTT_PREFIX, "cs");
+  broker.listen(0);
+  std::thread runner([&io] { io.run(); });
+
+  try
+  {
+    auto t = DccTransportRegistry::open(fmt::format("mqtt://127.0.0.1:{}/cs", broker.port()));
+    check(t != nullptr && t->isOpen(), "connected through the broker");
+    if (t)
+    {
+      auto status = DccRequest::expect("<s>", t.get());
+      t->write("<s>", {status.id});
+      auto r = DccRequest::wait(status, 2s);
+      check(!r.timedOut && r.frame == DCC_SIM_VERSION, "status reply from the station");
+
+      // one write, one publish; the station answers all of them in one publish as well
+      auto on = DccRequest::expect("<1>", t.get());
+      auto off = DccRequest::expect("<0>", t.get());
+      auto again = DccRequest::expect("<s>", t.get());
+      t->write("<1><0><s>", {on.id, off.id, again.id});
+      check(DccRequest::wait(on, 2s).frame == "<p1>", "power on answered");
+      check(DccRequest::wait(off, 2s).frame == "<p0>", "power off answered");
+      check(DccRequest::wait(again, 2s).frame == DCC_SIM_VERSION, "status answered after them");
+
+      auto mqtt = std::static_pointer_cast<DccMQTT>(t);
+      auto &st = mqtt->getMqttStats();
+      check(st.packed.load() >= 1, "the commands went out packed");
+      check(st.failed.load() == 0, "no publish failed");
+      t->close();
+    }
+  }
+  catch (const std::exception &e)
+  {
+    check(false, fmt::format("no error on the mqtt connection ({})", e.what()));
+  }
+
+  DccIoContext::stop();
+  asio::post(io, [&broker] { broker.stop(); });
+  work.reset();
+  runner.join();
+
+  check(broker.getStats().connects == 1, "one client connected");
+  Diag::shutdown();
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
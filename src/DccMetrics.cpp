@@ -0,0 +1,279 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <vector>
+#include <fmt/core.h>
+#include <fmt/format.h>
+
+#include "DccMetrics.hpp"
+#include "DccIoContext.hpp"
+#include "DccSession.hpp"
+#include "DccMQTT.hpp"
+#include "DccRequest.hpp"
+#include "DccVersion.hpp"
+#include "Diag.hpp"
+
+#define DCC_METRICS_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+std::mutex DccMetrics::_mutex;
+std::shared_ptr<asio::ip::tcp::acceptor> DccMetrics::_acceptor;
+
+// upper bounds of the latency buckets in us; a commandstation answers in ms, a cv read in 100s of ms
+static const uint64_t latencyBounds[] = {250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                        100000, 250000, 500000, 1000000, 2500000, 5000000};
+
+/**
+ * @brief One scrape; reads the request head, answers and closes the connection
+ */
+class DccMetricsClient : public std::enable_shared_from_this<DccMetricsClient>
+{
+private:
+  asio::ip::tcp::socket socket;
+  asio::streambuf request;
+  std::string response;
+
+  void reply(const std::string &status, const std::string &type, const std::string &body)
+  {
+    response = fmt::format("HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+                           status, type, body.size(), body);
+    asio::async_write(socket, asio::buffer(response), [self = shared_from_this()](const std::error_code &, size_t)
+                      {
+      std::error_code e;
+      self->socket.shutdown(asio::ip::tcp::socket::shutdown_both, e);
+      self->socket.close(e); });
+  }
+
+public:
+  DccMetricsClient(asio::ip::tcp::socket s) : socket(std::move(s)), request(DCC_METRICS_REQUEST) {}
+
+  void start()
+  {
+    asio::async_read_until(socket, request, "\r\n\r\n", [self = shared_from_this()](const std::error_code &ec, size_t)
+                           {
+      if (ec)
+      {
+        // closed by the peer or the request head is too large
+        if (ec == asio::error::not_found)
+          self->reply("431 Request Header Fields Too Large", "text/plain", "");
+        return;
+      }
+      std::istream in(&self->request);
+      std::string method, target;
+      in >> method >> target;
+      if (method != "GET" && method != "HEAD")
+      {
+        self->reply("405 Method Not Allowed", "text/plain", "Only GET is supported\n");
+        return;
+      }
+      if (target != "/metrics" && target != "/")
+      {
+        self->reply("404 Not Found", "text/plain", "Metrics are at /metrics\n");
+        return;
+      }
+      auto body = DccMetrics::render();
+      if (method == "HEAD")
+        body.clear();
+      self->reply("200 OK", DCC_METRICS_TYPE, body); });
+  }
+};
+
+void DccMetrics::start(unsigned short port)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_acceptor)
+  {
+    return;
+  }
+  auto &io = DccIoContext::get();
+  auto a = std::make_shared<asio::ip::tcp::acceptor>(io);
+  asio::ip::tcp::endpoint ep(asio::ip::address_v4::loopback(), port);
+  a->open(ep.protocol());
+  a->set_option(asio::ip::tcp::acceptor::reuse_address(true));
+  a->bind(ep);
+  a->listen();
+  _acceptor = a;
+  INFO("Serving metrics on http://127.0.0.1:{}/metrics", port);
+  accept(a);
+}
+
+void DccMetrics::accept(std::shared_ptr<asio::ip::tcp::acceptor> acceptor)
+{
+  acceptor->async_accept([acceptor](const std::error_code &ec, asio::ip::tcp::socket s)
+                         {
+    if (ec)
+      return; // acceptor closed
+    std::make_shared<DccMetricsClient>(std::move(s))->start();
+    accept(acceptor); });
+}
+
+void DccMetrics::stop()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (!_acceptor)
+  {
+    return;
+  }
+  std::error_code ec;
+  _acceptor->close(ec);
+  _acceptor.reset();
+}
+
+bool DccMetrics::running()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  return _acceptor != nullptr;
+}
+
+/**
+ * @brief Label values may contain anything; backslash, quote and newline have to be escaped
+ */
+static std::string escape(const std::string &s)
+{
+  std::string e;
+  e.reserve(s.size());
+  for (auto c : s)
+  {
+    switch (c)
+    {
+    case '\\':
+      e += "\\\\";
+      break;
+    case '"':
+      e += "\\\"";
+      break;
+    case '\n':
+      e += "\\n";
+      break;
+    default:
+      e += c;
+    }
+  }
+  return e;
+}
+
+std::string DccMetrics::render()
+{
+  auto sessions = DccSession::list();
+  fmt::memory_buffer out;
+  auto o = std::back_inserter(out);
+
+  std::vector<std::string> labels;
+  for (auto &s : sessions)
+  {
+    labels.push_back(fmt::format("session=\"{}\",uri=\"{}\"", escape(s.first), escape(s.second->describe())));
+  }
+
+  // one family per counter; the sample gets the _total suffix
+  auto counter = [&](const char *name, const char *unit, const char *help,
+                     const std::atomic<uint64_t> DccTransportStats::*field)
+  {
+    fmt::format_to(o, "# TYPE {} counter\n", name);
+    if (*unit)
+      fmt::format_to(o, "# UNIT {} {}\n", name, unit);
+    fmt::format_to(o, "# HELP {} {}\n", name, help);
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+      auto &st = sessions[i].second->getStats();
+      fmt::format_to(o, "{}_total{{{}}} {}\n", name, labels[i], (st.*field).load(std::memory_order_relaxed));
+    }
+  };
+
+  auto histogram = [&](const char *name, const std::string &label, const DccHistogram &h)
+  {
+    auto count = h.count();
+    auto sum = h.sum();
+    uint64_t n = 0;
+    for (auto b : latencyBounds)
+    {
+      n = h.countAtMost(b);
+      fmt::format_to(o, "{}_bucket{{{},le=\"{}\"}} {}\n", name, label, b / 1e6, n);
+    }
+    // values recorded while rendering may have made the buckets overtake the count
+    count = std::max(count, n);
+    fmt::format_to(o, "{}_bucket{{{},le=\"+Inf\"}} {}\n", name, label, count);
+    fmt::format_to(o, "{}_count{{{}}} {}\n", name, label, count);
+    fmt::format_to(o, "{}_sum{{{}}} {}\n", name, label, sum / 1e6);
+  };
+
+  fmt::format_to(o, "# TYPE dcccli info\n# HELP dcccli Version of the commandline interface\n");
+  fmt::format_to(o, "dcccli_info{{version=\"{}.{}.{}\"}} 1\n", MAJOR, MINOR, PATCH);
+  fmt::format_to(o, "# TYPE dcccli_pending_requests gauge\n# HELP dcccli_pending_requests Commands waiting for their reply\n");
+  fmt::format_to(o, "dcccli_pending_requests {}\n", DccRequest::pending());
+
+  fmt::format_to(o, "# TYPE dcccli_connection_up gauge\n# HELP dcccli_connection_up 1 if the connection to the commandstation is open\n");
+  for (size_t i = 0; i < sessions.size(); i++)
+  {
+    fmt::format_to(o, "dcccli_connection_up{{{}}} {}\n", labels[i], sessions[i].second->isOpen() ? 1 : 0);
+  }
+
+  counter("dcccli_received_bytes", "bytes", "Bytes recieved from the commandstation", &DccTransportStats::bytesIn);
+  counter("dcccli_sent_bytes", "bytes", "Bytes send to the commandstation", &DccTransportStats::bytesOut);
+  counter("dcccli_reads", "", "Chunks read from the connection", &DccTransportStats::reads);
+  counter("dcccli_writes", "", "Writes to the connection", &DccTransportStats::writes);
+  counter("dcccli_commands", "", "Commands send to the commandstation", &DccTransportStats::commands);
+  counter("dcccli_replies", "", "Replies parsed from the commandstation", &DccTransportStats::frames);
+  counter("dcccli_diags", "", "Diagnostic messages parsed from the commandstation", &DccTransportStats::diags);
+  counter("dcccli_parse_errors", "", "Replies which couldn't be decoded and garbage dropped by the parser", &DccTransportStats::parseErrors);
+  counter("dcccli_reconnects", "", "Connections reestablished after they had been lost", &DccTransportStats::reconnects);
+
+  fmt::format_to(o, "# TYPE dcccli_write_queue_high_water_bytes gauge\n# UNIT dcccli_write_queue_high_water_bytes bytes\n"
+                    "# HELP dcccli_write_queue_high_water_bytes Most bytes seen waiting in the write queue\n");
+  for (size_t i = 0; i < sessions.size(); i++)
+  {
+    fmt::format_to(o, "dcccli_write_queue_high_water_bytes{{{}}} {}\n", labels[i], sessions[i].second->getStats().queueHighWater.load());
+  }
+
+  fmt::format_to(o, "# TYPE dcccli_command_round_trip_seconds histogram\n# UNIT dcccli_command_round_trip_seconds seconds\n"
+                    "# HELP dcccli_command_round_trip_seconds Time from sending a command to its reply\n");
+  for (size_t i = 0; i < sessions.size(); i++)
+  {
+    histogram("dcccli_command_round_trip_seconds", labels[i], sessions[i].second->getStats().roundTrip);
+  }
+
+  fmt::format_to(o, "# TYPE dcccli_mqtt_delivery_seconds histogram\n# UNIT dcccli_mqtt_delivery_seconds seconds\n"
+                    "# HELP dcccli_mqtt_delivery_seconds Time from publishing commands to their completion at the qos\n");
+  for (size_t i = 0; i < sessions.size(); i++)
+  {
+    if (auto mqtt = std::dynamic_pointer_cast<DccMQTT>(sessions[i].second))
+    {
+      histogram("dcccli_mqtt_delivery_seconds", labels[i], mqtt->getMqttStats().delivery);
+    }
+  }
+
+  auto mqttCounter = [&](const char *name, const char *help, const std::atomic<uint64_t> DccMQTTStats::*field)
+  {
+    fmt::format_to(o, "# TYPE {} counter\n# HELP {} {}\n", name, name, help);
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+      if (auto mqtt = std::dynamic_pointer_cast<DccMQTT>(sessions[i].second))
+        fmt::format_to(o, "{}_total{{{}}} {}\n", name, labels[i], (mqtt->getMqttStats().*field).load(std::memory_order_relaxed));
+    }
+  };
+  mqttCounter("dcccli_mqtt_publishes", "Messages published to the broker", &DccMQTTStats::publishes);
+  mqttCounter("dcccli_mqtt_packed_publishes", "Publishes carrying more than one command", &DccMQTTStats::packed);
+  mqttCounter("dcccli_mqtt_failed_publishes", "Publishes the broker didn't acknowledge", &DccMQTTStats::failed);
+  mqttCounter("dcccli_mqtt_state_publishes", "Retained state messages published", &DccMQTTStats::states);
+
+  fmt::format_to(o, "# EOF\n");
+  return fmt::to_string(out);
+}
@@ -0,0 +1,67 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccMetrics
+ * @brief Serves the counters and round trip histograms of the open sessions in the OpenMetrics
+ * text format on http://127.0.0.1:<port>/metrics for Prometheus and the like. The server runs
+ * on the shared io_context; every scrape renders the metrics from the lock-free transport stats
+ * so nothing is done between scrapes.
+ * @author grbba
+ */
+
+#ifndef DccMetrics_h
+#define DccMetrics_h
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <asio.hpp>
+
+#define DCC_METRICS_REQUEST 8192       // requests larger than this are refused
+
+class DccMetrics
+{
+private:
+  static std::mutex _mutex;
+  static std::shared_ptr<asio::ip::tcp::acceptor> _acceptor;
+
+  static void accept(std::shared_ptr<asio::ip::tcp::acceptor> acceptor);
+
+public:
+  /**
+   * @brief Starts listening on the loopback interface
+   * @throws std::system_error if the port can't be bound
+   */
+  static void start(unsigned short port);
+  static void stop();
+  static bool running();
+
+  /**
+   * @brief The metrics of all open sessions in OpenMetrics text format
+   */
+  static std::string render();
+
+  DccMetrics() = default;
+  ~DccMetrics() = default;
+};
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <cstdint>
+
+#include "DccRequest.hpp"
+#include "DccTransport.hpp"
+#include "Diag.hpp"
+
+std::mutex DccRequest::_mutex;
+std::list<DccPendingRequest> DccRequest::_pending;
+std::atomic<size_t> DccRequest::_count(0);
+std::atomic<size_t> DccRequest::_stale(0);
+uint64_t DccRequest::_nextId = 1;
+std::chrono::milliseconds DccRequest::_timeout(DCC_DEFAULT_TIMEOUT);
+
+void DccRequest::setup()
+{
+  DccResponseDecoder::addAny(onResponse);
+}
+
+/**
+ * @brief Completes the oldest pending request waiting for this reply. Requests still waiting
+ * come first; a timed out one only takes the reply if nobody else is waiting for it, otherwise
+ * a single lost reply would shift every following reply onto the request before
+ */
+void DccRequest::onResponse(const DccResponse &r)
+{
+  if (_count.load(std::memory_order_acquire) == 0)
+    return;
+
+  std::lock_guard<std::mutex> l(_mutex);
+  auto now = std::chrono::steady_clock::now();
+  prune(now);
+  auto matches = [&r](const DccPendingRequest &p)
+  {
+    // <X> says a definition or a write failed; only requests waiting for <O> can get it, a
+    // read or a status request keeps waiting for its own reply
+    bool opcode = (p.opcode == r.opcode) || (p.opcode == 'O' && r.opcode == 'X');
+    bool source = (p.source == nullptr) || (p.source == r.source);
+    return opcode && source && (r.opcode == 'X' || !p.match || p.match(r));
+  };
+
+  for (auto it = _pending.begin(); it != _pending.end(); it++)
+  {
+    if (!it->stale && matches(*it))
+    {
+      it->reply.set_value({std::string(r.frame), false});
+      DccTransport::roundTrip(r.source, now - it->sent);
+      _pending.erase(it);
+      _count--;
+      return;
+    }
+  }
+  for (auto it = _pending.begin(); it != _pending.end(); it++)
+  {
+    if (it->stale && matches(*it))
+    {
+      // the late reply of a request which timed out; nobody is waiting for it anymore
+      DBG("Late reply {} to {} dropped", r.frame, it->cmd);
+      _pending.erase(it);
+      _count--;
+      _stale--;
+      return;
+    }
+  }
+}
+
+void DccRequest::prune(std::chrono::steady_clock::time_point now)
+{
+  if (_stale.load() == 0)
+    return;
+  for (auto it = _pending.begin(); it != _pending.end();)
+  {
+    if (it->stale && it->expires <= now)
+    {
+      it = _pending.erase(it);
+      _count--;
+      _stale--;
+    }
+    else
+      it++;
+  }
+}
+
+void DccRequest::expire(uint64_t id)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  for (auto &p : _pending)
+  {
+    if (p.id == id && !p.stale)
+    {
+      p.stale = true;
+      p.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(DCC_STALE_GRACE);
+      _stale++;
+      return;
+    }
+  }
+}
+
+DccPendingReply DccRequest::expect(const std::string &cmd, char opcode, DccReplyMatcher match, const void *source)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  prune(std::chrono::steady_clock::now());
+  DccPendingRequest &p = _pending.emplace_back();
+
+  p.id = _nextId++;
+  p.cmd = cmd;
+  p.source = source;
+  p.opcode = opcode;
+  p.match = match;
+  p.sent = std::chrono::steady_clock::now();
+  _count++;
+
+  return {p.id, p.reply.get_future(), source};
+}
+
+/**
+ * @brief Maps the command to the reply it produces on the commandstation
+ */
+DccPendingReply DccRequest::expect(const std::string &cmd, const void *source)
+{
+  DccResponse c;
+
+  if (DccResponse::decode(cmd, c))
+  {
+    switch (c.opcode)
+    {
+    case 'R':
+    {
+      // <R cv cb sub> -> <r cb|sub|cv value>; <R cv> -> <r cv value>
+      int cv = c.intArg(0);
+      if (c.argc == 3)
+      {
+        int cb = c.intArg(1);
+        int sub = c.intArg(2);
+        return expect(cmd, 'r', [=](const DccResponse &r)
+                      { return r.intArg(0) == cb && r.intArg(1) == sub && r.intArg(2) == cv; }, source);
+      }
+      if (c.argc == 1)
+      {
+        return expect(cmd, 'r', [=](const DccResponse &r)
+                      { return r.argc == 2 && r.intArg(0) == cv; }, source);
+      }
+      break;
+    }
+    case 'W':
+    {
+      // <W cv value cb sub> -> <r cb|sub|cv value>
+      if (c.argc == 4)
+      {
+        int cv = c.intArg(0);
+        int cb = c.intArg(2);
+        int sub = c.intArg(3);
+        return expect(cmd, 'r', [=](const DccResponse &r)
+                      { return r.intArg(0) == cb && r.intArg(1) == sub && r.intArg(2) == cv; }, source);
+      }
+      break;
+    }
+    case 's':
+    {
+      // <s> -> <iDCC-EX ...>
+      return expect(cmd, 'i', nullptr, source);
+    }
+    case '0':
+    case '1':
+    {
+      // power off/on -> <p0>|<p1>
+      return expect(cmd, 'p', nullptr, source);
+    }
+    case 'c':
+    {
+      // <cli s sid> sets up the motorshield -> <O>|<X>
+      if (c.textArg(0) == "li")
+      {
+        return expect(cmd, 'O', nullptr, source);
+      }
+      break;
+    }
+    case 'T':
+    {
+      // <T id state> -> <H id state>
+      if (c.argc == 2)
+      {
+        int id = c.intArg(0);
+        return expect(cmd, 'H', [=](const DccResponse &r)
+                      { return r.intArg(0) == id; }, source);
+      }
+      // turnout definition -> <O>|<X>
+      if (c.argc >= 3)
+      {
+        return expect(cmd, 'O', nullptr, source);
+      }
+      break;
+    }
+    case 'S':
+    case 'Z':
+    {
+      // sensor/output definition <S id pin pullup>|<Z id pin state> -> <O>|<X>
+      if (c.argc == 3)
+      {
+        return expect(cmd, 'O', nullptr, source);
+      }
+      break;
+    }
+    case 't':
+    {
+      // <t reg cab speed dir> -> <T reg speed dir>
+      if (c.argc == 4)
+      {
+        int reg = c.intArg(0);
+        return expect(cmd, 'T', [=](const DccResponse &r)
+                      { return r.intArg(0) == reg; }, source);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  return completed();
+}
+
+std::vector<std::pair<uint64_t, std::string>> DccRequest::unacknowledged(const void *source, std::chrono::steady_clock::time_point before)
+{
+  std::vector<std::pair<uint64_t, std::string>> cmds;
+  std::lock_guard<std::mutex> l(_mutex);
+  for (auto &p : _pending)
+  {
+    if (p.source == source && p.sent <= before && !p.stale)
+    {
+      cmds.emplace_back(p.id, p.cmd);
+    }
+  }
+  return cmds;
+}
+
+DccPendingReply DccRequest::completed()
+{
+  std::promise<DccReply> none;
+  none.set_value({});
+  return {0, none.get_future()};
+}
+
+void DccRequest::cancel(uint64_t id)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  for (auto it = _pending.begin(); it != _pending.end(); it++)
+  {
+    if (it->id == id)
+    {
+      if (it->stale)
+        _stale--;
+      _pending.erase(it);
+      _count--;
+      return;
+    }
+  }
+}
+
+DccReply DccRequest::wait(DccPendingReply &pending, std::chrono::milliseconds timeout)
+{
+  if (pending.id == 0)
+    return pending.reply.get();
+
+  DccTransport::flush(pending.source); // don't let the command sit in a coalescing window
+  auto t = (timeout.count() == 0) ? _timeout : timeout;
+  if (pending.reply.wait_for(t) == std::future_status::ready)
+    return pending.reply.get();
+
+  expire(pending.id);
+  // the reply may have come in between the timeout and the expiry
+  if (pending.reply.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready)
+    return pending.reply.get();
+  DBG("No reply within {}ms", t.count());
+  return {{}, true};
+}
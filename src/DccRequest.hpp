@@ -0,0 +1,133 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccRequest
+ * @brief Correlates the commands send to the commandstation with their replies.
+ * Before a command is written the reply it is expected to produce is registered in the
+ * pending request table e.g. <R cv cb sub> expects <r cb|sub|cv value> and <s> expects
+ * <iDCC-EX ...>. When the decoder sees a matching reply the oldest matching request is
+ * completed and its future becomes ready. Commands for which no reply is known get an
+ * already completed future. A request which timed out stays in the table for a grace period
+ * and swallows its late reply so the reply doesn't complete the next request of the same kind.
+ * @author grbba
+ */
+
+#ifndef DccRequest_h
+#define DccRequest_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DccResponse.hpp"
+
+#define DCC_DEFAULT_TIMEOUT 2000 // ms to wait for a reply of the commandstation
+#define DCC_STALE_GRACE 10000    // ms a timed out request waits for its late reply
+
+struct DccReply
+{
+  std::string frame;       // reply as recieved; empty if no reply was expected or it timed out
+  bool timedOut = false;
+};
+
+typedef std::function<bool(const DccResponse &)> DccReplyMatcher;
+
+struct DccPendingReply
+{
+  uint64_t id = 0;                                  // 0 if no reply is expected
+  std::future<DccReply> reply;
+  const void *source = nullptr;                     // connection the command went to
+};
+
+struct DccPendingRequest
+{
+  uint64_t id;
+  std::string cmd;                                  // command as send
+  const void *source;                               // connection the command went to; nullptr for any
+  char opcode;                                      // opcode of the expected reply
+  DccReplyMatcher match;                            // check on the arguments of the reply; may be empty
+  std::promise<DccReply> reply;
+  std::chrono::steady_clock::time_point sent;
+  bool stale = false;                               // timed out; a late reply is dropped
+  std::chrono::steady_clock::time_point expires;    // of a stale request
+};
+
+class DccRequest
+{
+private:
+  static std::mutex _mutex;
+  static std::list<DccPendingRequest> _pending;     // in the order the commands have been send
+  static std::atomic<size_t> _count;                // lets the reader skip the lock if nothing is pending
+  static std::atomic<size_t> _stale;                // timed out requests still in the table
+  static uint64_t _nextId;
+  static std::chrono::milliseconds _timeout;
+
+  static void onResponse(const DccResponse &r);
+  static void expire(uint64_t id);                  // timed out; kept to catch its late reply
+  static void prune(std::chrono::steady_clock::time_point now); // drops stale requests past their grace; _mutex held
+
+public:
+  /**
+   * @brief Registers the request table with the response decoder. Has to be called before
+   * any connection is opened
+   */
+  static void setup();
+
+  /**
+   * @brief Registers the reply expected for the command
+   * @param cmd the command in DCC++ EX format e.g. <R 1 0 0>
+   * @param source connection the command is send on; only replies from there complete it
+   * @return the pending reply which becomes ready when the reply arrives
+   */
+  static DccPendingReply expect(const std::string &cmd, const void *source = nullptr);
+  static DccPendingReply expect(const std::string &cmd, char opcode, DccReplyMatcher match, const void *source = nullptr);
+
+  /**
+   * @brief Waits for the reply; on timeout the request is removed from the table
+   * @param timeout 0 uses the configured timeout
+   */
+  static DccReply wait(DccPendingReply &pending, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+  /**
+   * @brief Id and command of the requests send on source before the time which are still
+   * waiting for their reply e.g. to send them again after a reconnect
+   */
+  static std::vector<std::pair<uint64_t, std::string>> unacknowledged(const void *source, std::chrono::steady_clock::time_point before);
+
+  static DccPendingReply completed();               // for commands where no reply is expected
+  static void cancel(uint64_t id);                  // drop a request e.g. if the write failed
+
+  static size_t pending() { return _count.load(std::memory_order_relaxed) - _stale.load(std::memory_order_relaxed); } // requests waiting for their reply
+  static void setTimeout(std::chrono::milliseconds t) { _timeout = t; }
+  static std::chrono::milliseconds getTimeout() { return _timeout; }
+
+  DccRequest() = default;
+  ~DccRequest() = default;
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * dcccli-request-test : the request table; replies are handed to the decoder as the reading
+ * thread of a connection would do it. Run by ctest.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <fmt/core.h>
+
+#include "DccRequest.hpp"
+#include "DccResponse.hpp"
+#include "Diag.hpp"
+
+using namespace std::chrono_literals;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what)
+{
+  fmt::print("{} {}\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+static bool ready(DccPendingReply &p)
+{
+  return p.reply.wait_for(0ms) == std::future_status::ready;
+}
+
+/**
+ * @brief A probe times out, the next one is send and then both replies come in; the waiting
+ * probe has to get the first of them and the late one is dropped
+ */
+static void lateReply()
+{
+  auto first = DccRequest::expect("<s>");
+  check(DccRequest::wait(first, 10ms).timedOut, "first probe times out");
+  check(DccRequest::pending() == 0, "a timed out request isn't pending anymore");
+
+  auto second = DccRequest::expect("<s>");
+  DccResponseDecoder::dispatch("<iDCC-EX V-4.0.0 / first>");
+  check(ready(second), "the waiting probe gets the reply");
+  auto reply = DccRequest::wait(second, 10ms);
+  check(!reply.timedOut && reply.frame == "<iDCC-EX V-4.0.0 / first>", "with the frame as recieved");
+
+  auto third = DccRequest::expect("<s>");
+  DccResponseDecoder::dispatch("<iDCC-EX V-4.0.0 / second>");
+  check(ready(third), "the late reply of the timed out probe doesn't shift the next reply");
+  DccRequest::wait(third, 10ms);
+
+  DccResponseDecoder::dispatch("<iDCC-EX V-4.0.0 / late>");
+  check(DccRequest::pending() == 0, "a reply nobody waits for is dropped");
+}
+
+/**
+ * @brief A cancelled probe leaves nothing behind to catch the next reply
+ */
+static void cancelled()
+{
+  auto probe = DccRequest::expect("<s>");
+  DccRequest::wait(probe, 10ms);
+  DccRequest::cancel(probe.id);
+
+  DccResponseDecoder::dispatch("<iDCC-EX V-4.0.0 / late>");
+  auto next = DccRequest::expect("<s>");
+  DccResponseDecoder::dispatch("<iDCC-EX V-4.0.0 / next>");
+  check(ready(next), "a cancelled probe doesn't take a reply");
+  auto reply = DccRequest::wait(next, 10ms);
+  check(reply.frame == "<iDCC-EX V-4.0.0 / next>", "the reply is the one send after the probe");
+}
+
+/**
+ * @brief Replies are matched by opcode and arguments, not only by order
+ */
+static void matched()
+{
+  auto cv1 = DccRequest::expect("<R 1 7 8>");
+  auto cv2 = DccRequest::expect("<R 2 7 8>");
+  DccResponseDecoder::dispatch("<r 7|8|2 3>");
+  check(ready(cv2) && !ready(cv1), "the reply for cv 2 goes to its read");
+  DccResponseDecoder::dispatch("<r 7|8|1 5>");
+  check(ready(cv1), "the reply for cv 1 goes to its read");
+  DccRequest::wait(cv1, 10ms);
+  DccRequest::wait(cv2, 10ms);
+}
+
+/**
+ * @brief <X> rejects a definition; it doesn't complete a request waiting for another reply
+ */
+static void rejected()
+{
+  auto status = DccRequest::expect("<s>");
+  auto def = DccRequest::expect("<T 1 20 1>");
+  DccResponseDecoder::dispatch("<X>");
+  check(ready(def) && !ready(status), "<X> goes to the definition");
+  check(DccRequest::wait(def, 10ms).frame == "<X>", "which sees the rejection");
+  DccResponseDecoder::dispatch("<iDCC-EX V-4.0.0>");
+  check(ready(status), "the status request still gets its reply");
+  DccRequest::wait(status, 10ms);
+}
+
+auto main() -> int
+{
+  Diag::setFileInfo(false);
+  Diag::setup();
+  spdlog::set_level(spdlog::level::warn);
+
+  DccRequest::setup();
+  lateReply();
+  cancelled();
+  matched();
+  rejected();
+  check(DccRequest::pending() == 0, "nothing left pending");
+
+  Diag::shutdown();
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,119 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <charconv>
+
+#include "DccResponse.hpp"
+#include "Diag.hpp"
+
+std::array<std::vector<DccResponseHandler>, DCC_OPCODES> DccResponseDecoder::_dispatch;
+std::vector<DccResponseHandler> DccResponseDecoder::_any;
+
+static inline bool isSeparator(char c)
+{
+  return c == ' ' || c == '|' || c == '\n' || c == '\r' || c == '\t';
+}
+
+bool DccResponse::decode(std::string_view frame, DccResponse &r)
+{
+  if (frame.size() < 3 || frame.front() != '<' || frame.back() != '>')
+    return false;
+
+  auto c = static_cast<unsigned char>(frame[1]);
+  if (c >= DCC_OPCODES || isSeparator(frame[1]))
+    return false;
+
+  r.opcode = frame[1];
+  r.frame = frame;
+  r.argc = 0;
+
+  auto p = frame.data() + 2;
+  auto end = frame.data() + frame.size() - 1; // without the closing '>'
+
+  while (p < end && r.argc < DCC_MAX_ARGS)
+  {
+    if (isSeparator(*p))
+    {
+      p++;
+      continue;
+    }
+
+    DccArg &a = r.args[r.argc++];
+    const char *s = p;
+
+    if (*p == '"')
+    {
+      // string argument; runs up to the closing quote
+      s = ++p;
+      while (p < end && *p != '"')
+        p++;
+      a.text = std::string_view(s, p - s);
+      a.isInt = false;
+      if (p < end)
+        p++;
+      continue;
+    }
+
+    while (p < end && !isSeparator(*p))
+      p++;
+    a.text = std::string_view(s, p - s);
+
+    auto [ptr, ec] = std::from_chars(s, p, a.value);
+    a.isInt = (ec == std::errc() && ptr == p);
+  }
+  return true;
+}
+
+void DccResponseDecoder::add(char opcode, DccResponseHandler handler)
+{
+  auto c = static_cast<unsigned char>(opcode);
+  if (c >= DCC_OPCODES)
+  {
+    ERR("Invalid opcode [{}] for a response handler", opcode);
+    return;
+  }
+  _dispatch[c].push_back(handler);
+}
+
+void DccResponseDecoder::addAny(DccResponseHandler handler)
+{
+  _any.push_back(handler);
+}
+
+bool DccResponseDecoder::dispatch(std::string_view frame, const void *source)
+{
+  DccResponse r;
+
+  if (!DccResponse::decode(frame, r))
+  {
+    DBG("Can't decode commandstation response {}", frame);
+    return false;
+  }
+  r.source = source;
+  for (auto &h : _dispatch[static_cast<unsigned char>(r.opcode)])
+  {
+    h(r);
+  }
+  for (auto &h : _any)
+  {
+    h(r);
+  }
+  return true;
+}
@@ -0,0 +1,93 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccResponseDecoder
+ * @brief Decodes the <...> replies of the commandstation and dispatches them by opcode.
+ * A reply like <r 1|2|3 45> is tokenized into its opcode ('r') and up to DCC_MAX_ARGS
+ * arguments separated by blanks or '|'. Numeric arguments are converted once with from_chars
+ * so handlers never need to re-parse strings. Handlers are registered per opcode in a
+ * 128 entry table which is indexed directly by the opcode character.
+ * @note Handlers have to be registered during setup i.e. before any connection is opened
+ * as dispatching happens on the reading thread without locking.
+ * @author grbba
+ */
+
+#ifndef DccResponse_h
+#define DccResponse_h
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+
+#define DCC_MAX_ARGS 16     // arguments beyond that are dropped
+#define DCC_OPCODES 128     // opcodes are plain ascii characters
+
+struct DccArg
+{
+  std::string_view text;    // the argument as recieved; quotes are removed for strings
+  int value = 0;            // numeric value if isInt
+  bool isInt = false;
+};
+
+struct DccResponse
+{
+  char opcode = 0;
+  uint8_t argc = 0;
+  std::array<DccArg, DCC_MAX_ARGS> args;
+  std::string_view frame;   // complete frame including the <>
+  const void *source = nullptr; // connection the frame has been recieved on
+
+  /**
+   * @brief Tokenizes a <...> frame; the views point into frame
+   * @return false if the frame is not a well formed response
+   */
+  static bool decode(std::string_view frame, DccResponse &r);
+
+  int intArg(uint8_t i, int def = -1) const { return (i < argc && args[i].isInt) ? args[i].value : def; }
+  std::string_view textArg(uint8_t i) const { return i < argc ? args[i].text : std::string_view(); }
+};
+
+typedef std::function<void(const DccResponse &)> DccResponseHandler;
+
+class DccResponseDecoder
+{
+private:
+  static std::array<std::vector<DccResponseHandler>, DCC_OPCODES> _dispatch;
+  static std::vector<DccResponseHandler> _any;            // called for every decoded response
+
+public:
+  static void add(char opcode, DccResponseHandler handler);
+  static void addAny(DccResponseHandler handler);
+
+  /**
+   * @brief Decodes the frame and calls the handlers registered for its opcode
+   * @return false if the frame could not be decoded
+   */
+  static bool dispatch(std::string_view frame, const void *source = nullptr);
+
+  DccResponseDecoder() = default;
+  ~DccResponseDecoder() = default;
+};
+
+#endif
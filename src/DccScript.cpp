@@ -0,0 +1,202 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <fstream>
+#include <iostream>
+#include <fmt/core.h>
+
+#include "DccScript.hpp"
+#include "ShellCmdConfig.hpp"
+#include "ShellCmdExec.hpp"
+#include "DccSession.hpp"
+#include "Diag.hpp"
+
+std::map<std::pair<int, std::string>, std::shared_ptr<cmdItem>> DccScript::_items;
+const std::map<std::string, int> DccScript::_menus = {
+    {"cs", DCC_CS_MENU},
+    {"lo", DCC_LO_MENU},
+    {"..", DCC_ROOT_MENU}};
+
+/**
+ * @brief Splits the line on whitespace; double quotes keep a parameter together
+ */
+static void tokenize(const std::string &line, std::vector<std::string> &tokens)
+{
+  tokens.clear();
+  size_t i = 0;
+  while (i < line.size())
+  {
+    while (i < line.size() && isspace(static_cast<unsigned char>(line[i])))
+      i++;
+    if (i >= line.size())
+      break;
+
+    std::string t;
+    if (line[i] == '"')
+    {
+      auto q = line.find('"', i + 1);
+      if (q == std::string::npos)
+      {
+        throw ShellCmdExecException("Missing closing quote");
+      }
+      t = line.substr(i + 1, q - i - 1);
+      i = q + 1;
+    }
+    else
+    {
+      auto s = i;
+      while (i < line.size() && !isspace(static_cast<unsigned char>(line[i])))
+        i++;
+      t = line.substr(s, i - s);
+    }
+    tokens.push_back(std::move(t));
+  }
+}
+
+/**
+ * @brief Builds the same menu items the interactive shell uses
+ */
+void DccScript::setup()
+{
+  if (!_items.empty())
+  {
+    return;
+  }
+
+  for (auto &menu : {rootMenuItems, csMenuItems, loMenuItems})
+  {
+    DccShellCmd items(menu);
+    for (auto &var : items.menuCommands)
+    {
+      _items.insert({{var.second->menuID, var.second->name}, var.second});
+    }
+  }
+  ShellCmdExec::setup();
+}
+
+/**
+ * @brief Looks the command up in the current menu; as in the shell the main menu commands
+ * are available from the sub menus. Commands given from the main menu are also looked up in
+ * the sub menus so '@yard status' works without switching to cs first.
+ */
+std::shared_ptr<cmdItem> DccScript::find(int menu, const std::string &name)
+{
+  auto it = _items.find({menu, name});
+  if (it == _items.end() && menu != DCC_ROOT_MENU)
+  {
+    it = _items.find({DCC_ROOT_MENU, name});
+  }
+  if (it == _items.end() && menu == DCC_ROOT_MENU)
+  {
+    for (auto &m : {DCC_CS_MENU, DCC_LO_MENU})
+    {
+      it = _items.find({m, name});
+      if (it != _items.end())
+        break;
+    }
+  }
+  return (it == _items.end()) ? nullptr : it->second;
+}
+
+void DccScript::execute(std::ostream &out, const std::string &line, int &menu)
+{
+  std::vector<std::string> tokens;
+
+  setup();
+  tokenize(line, tokens);
+  if (tokens.empty() || tokens[0][0] == '#')
+  {
+    return;
+  }
+
+  // @name <command> sends the command to the named session; the active session stays as is
+  if (tokens[0][0] == '@')
+  {
+    DccSessionScope scope(tokens[0].substr(1));
+    auto rest = line.substr(line.find(tokens[0]) + tokens[0].size());
+    int m = menu;
+    execute(out, rest, m);
+    return;
+  }
+
+  // a menu on its own switches the menu; in front of a command it only applies to that command
+  int cmdMenu = menu;
+  size_t first = 0;
+  auto m = _menus.find(tokens[0]);
+  if (m != _menus.end())
+  {
+    if (tokens.size() == 1)
+    {
+      menu = m->second;
+      return;
+    }
+    cmdMenu = m->second;
+    first = 1;
+  }
+
+  auto item = find(cmdMenu, tokens[first]);
+  if (item == nullptr)
+  {
+    throw ShellCmdExecException(fmt::format("Unknown command {}", tokens[first]));
+  }
+
+  auto call = ShellCmdExec::getFMap()->find({item->menuID, item->name});
+  if (call == ShellCmdExec::getFMap()->end())
+  {
+    throw ShellCmdExecException(fmt::format("No executor for {}", item->name));
+  }
+
+  DBG("Executing: MenuID {} CommandID {} Name {} ", item->menuID, item->itemID, item->name);
+  call->second(out, item, std::vector<std::string>(tokens.begin() + first + 1, tokens.end()));
+}
+
+int DccScript::run(const std::string &file)
+{
+  std::ifstream in(file);
+  if (!in.is_open())
+  {
+    ERR("Can't open script {}", file);
+    return DCC_FAILURE;
+  }
+
+  std::string line;
+  size_t lineNo = 0;
+  int menu = DCC_ROOT_MENU;
+
+  // one line at a time; nothing of the script is kept once executed
+  while (std::getline(in, line))
+  {
+    lineNo++;
+    try
+    {
+      execute(std::cout, line, menu);
+    }
+    catch (const std::exception &e)
+    {
+      ERR("{}:{}: {} in command [{}]", file, lineNo, e.what(), line);
+      std::cout.flush();
+      return DCC_FAILURE;
+    }
+  }
+  std::cout.flush();
+
+  INFO("Executed {} lines from {}", lineNo, file);
+  return DCC_SUCCESS;
+}
@@ -0,0 +1,73 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccScript
+ * @brief Runs the shell commands from a file without the interactive cli.
+ * Each line holds one command as it would be typed in the shell. The menus are switched
+ * the same way as in the shell ( cs, lo and .. to go back to the main menu ) or the menu
+ * is put in front of the command e.g. 'cs status'. '@<name> <command>' sends the command to
+ * the named session. Empty lines and lines starting with # are skipped. The file is read line by line so the size of the script doesn't matter.
+ * Execution stops at the first failing command.
+ * @author grbba
+ */
+
+#ifndef DccScript_h
+#define DccScript_h
+
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "DccShellCmd.hpp"
+
+#define DCC_ROOT_MENU 1
+#define DCC_CS_MENU 2
+#define DCC_LO_MENU 3
+
+class DccScript
+{
+private:
+    static std::map<std::pair<int, std::string>, std::shared_ptr<cmdItem>> _items;   // menu items by menu and name
+    static const std::map<std::string, int> _menus;
+
+    static void setup();
+    static std::shared_ptr<cmdItem> find(int menu, const std::string &name);
+
+public:
+    /**
+     * @brief Executes the file line by line
+     * @return DCC_SUCCESS if all commands have been executed
+     */
+    static int run(const std::string &file);
+
+    /**
+     * @brief Executes a single line in the given menu; the menu is updated if the line switches menus
+     * @throws ShellCmdExecException if the command is unknown or fails
+     */
+    static void execute(std::ostream &out, const std::string &line, int &menu);
+
+    DccScript() = default;
+    ~DccScript() = default;
+};
+
+#endif
@@ -20,93 +20,68 @@
  */
 
 #include <iostream>
-#include <vector>
 #include <fmt/core.h>
 #include <fmt/color.h>
 #include <fmt/ostream.h>
 
 #include "DccSerial.hpp"
+#include "ShellCmdExec.hpp"
 #include "Diag.hpp"
 
-std::stringstream  DccSerial::csMesg;       // commandstation message e.g. reslut of status, reda etc i;e. <> -> magenta
-std::stringstream  DccSerial:: dMesg; 
-recvState DccSerial::state = _Text;
-
-
-recvState DccSerial::nState(recvState s, char c)
+static std::string uriOneOf(const DccUri &uri, const std::string &key, const std::string &def, std::initializer_list<const char *> values)
 {
-  switch (c)
+  auto v = uri.get(key, def);
+  for (auto &a : values)
   {
-    case '\n': {
-      // ignore \n
-      return s;
-    }
-    case '<':
-    {
-      if( s == _OpenDiag ) { // the <> is part of a diag
-        dMesg << c;
-        return s;
-      }
-      csMesg << c;              // store the char in the csmesg
-      return _OpenDcc;
-    }
-    case '*':
-    {
-      if (s == _OpenDcc) {
-        csMesg.str(""); // clear the stream
-        return _OpenDiag;
-      }
-      if (s == _OpenDiag) {
-        return _PreCloseDiag;
-      }
-    }
-    case '>':
-    {
-      if (s == _OpenDcc) {
-          csMesg << c;
-          fmt::print(fg(fmt::color::magenta), "{}\n", csMesg.str());
-          csMesg.str(""); // clear the stream
-          return _CloseDcc; // print the dcc message 
-      }
-      if (s == _PreCloseDiag) {
-          INFO("{}", dMesg.str());
-          dMesg.str(""); // clear the stream
-          return _CloseDiag; // print the diag message 
-      } 
-    }
-    default:
+    if (v.compare(a) == 0)
     {
-      if (s == _OpenDcc) { DccSerial::csMesg << c; return _OpenDcc; };
-      if (s == _OpenDiag) { DccSerial::dMesg << c; return _OpenDiag; };
-      fmt::print(fg(fmt::color::magenta), "{}", c); // print the char
-      return _Text;
+      return v;
     }
   }
-  ERR("Can't understand incomming message");
-  return _Text;
+  auto s = fmt::format("Wrong value for {} supplied: [{}]", key, v);
+  throw ShellCmdExecException(s);
 }
 
 /**
- * @brief  Reciever callback
- *
- * @param data
- * @param len
+ * @brief Opens the port from serial://<device>?baud=<baud>; the device is the path of the uri
+ * ( serial:///dev/ttyACM0 ) or its host for ports without a path ( serial://COM3 )
  */
-void DccSerial::recieve(const char *data, unsigned int len)
+bool DccSerial::open(const DccUri &uri)
 {
-  std::vector<char> v(data, data + len);
+  auto d = uri.path.empty() ? uri.host : uri.path;
+
+  if (d.empty())
+  {
+    auto s = fmt::format("No serial port given in [{}]", uri.text);
+    throw ShellCmdExecException(s);
+  }
 
-  for (unsigned int i = 0; i < v.size(); i++)
+  int b = uri.getInt("baud", baud);
+  bits = uri.getInt("bits", 8);
+  stop = uri.getInt("stop", 1);
+  if (b <= 0 || bits < 5 || bits > 8 || (stop != 1 && stop != 2))
   {
-      state = nState(state, v[i]);
-      std::cout.flush(); // Flush screen buffer
+    auto s = fmt::format("Wrong serial settings in [{}]", uri.text);
+    throw ShellCmdExecException(s);
   }
+  parity = uriOneOf(uri, "parity", "none", {"none", "odd", "even"});
+  flow = uriOneOf(uri, "flow", "none", {"none", "software", "rtscts"});
+  lowLatency = uri.getInt("lowlatency", 1) != 0;
+
+  return openPort(d, b);
+}
+
+std::string DccSerial::describe()
+{
+  // every setting applied to the port so the description opens the same connection again
+  return fmt::format("serial://{}?baud={}&parity={}&bits={}&stop={}&flow={}&lowlatency={}",
+                     device, baud, parity, bits, stop, flow, lowLatency ? 1 : 0);
 }
 
 bool DccSerial::openPort(std::string d, int b)
 {
     // if already open and same port --> warning that the port is already open --> did you mean to open another port?
-  if (open)
+  if (portOpen)
   {
     if (d.compare(device) == 0) 
       {
@@ -116,18 +91,16 @@ bool DccSerial::openPort(std::string d, int b)
         // if open and open request to different port --> warning changing port --> close old port first before moving on
         WARN("switching port {} to {}", device, d);
         port.close();
+        portOpen = false;
       }
   }
 
   device = d;
   baud = b;
 
-  port.setCallback(recieve);
-  port.open(device, baud);
-
-  if (port.isOpen())
+  if (openPort())
   {
-    open = true;
+    portOpen = true;
   }
   else
   {
@@ -138,13 +111,29 @@ bool DccSerial::openPort(std::string d, int b)
 }
 
 /**
- * @brief
+ * @brief Opens device with the current settings; also used to reopen the port after it failed
  *
  */
 bool DccSerial::openPort()
 {
-  port.setCallback(recieve);
-  port.open(device, baud);
+  using asio::serial_port_base;
+  auto p = parity.compare("odd") == 0    ? serial_port_base::parity::odd
+           : parity.compare("even") == 0 ? serial_port_base::parity::even
+                                         : serial_port_base::parity::none;
+  auto f = flow.compare("rtscts") == 0     ? serial_port_base::flow_control::hardware
+           : flow.compare("software") == 0 ? serial_port_base::flow_control::software
+                                           : serial_port_base::flow_control::none;
+  auto sb = stop == 2 ? serial_port_base::stop_bits::two : serial_port_base::stop_bits::one;
+
+  port.setCallback([this](const char *data, size_t len) { recieve(data, len); });
+  port.setErrorCallback([this](const std::error_code &ec) { linkDown(ec.message()); });
+  port.open(device, baud, serial_port_base::parity(p), serial_port_base::character_size(bits),
+            serial_port_base::flow_control(f), serial_port_base::stop_bits(sb));
+
+  if (port.isOpen() && lowLatency && !port.setLowLatency(true))
+  {
+    DBG("Low latency mode not supported by {}", device);
+  }
   return port.isOpen();
 };
 
@@ -154,8 +143,11 @@ bool DccSerial::openPort()
  */
 void DccSerial::closePort()
 {
+  if (!portOpen)
+    return;
   port.clearCallback();
   port.close();
+  portOpen = false;
 };
 
 /**
@@ -168,9 +160,9 @@ void DccSerial::write()
   port.write(s, 3);
 };
 
-void DccSerial::write(const std::string *cmd)
+void DccSerial::transmit(const char *data, size_t len)
 {
-  port.write(cmd->c_str(), cmd->size());
+  port.write(data, len);
 };
 
 // void DccSerial::execute(shellCommand cmd, std::ostream &out, CmdParam_t p1,CmdParam_t p2,CmdParam_t p3) {
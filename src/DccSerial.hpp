@@ -22,7 +22,7 @@
 #ifndef DccSerial_h
 #define DccSerial_h
 
-#include "CliReciever.hpp"
+#include "DccTransport.hpp"
 #include "AsyncSerial.h"
 #include <variant>
 
@@ -38,28 +38,42 @@ typedef std::variant< std::ostream,
                       std::string,
                       int> CmdParam_t;
 
-class DccSerial {
+/**
+ * @brief Serial connection to the commandstation;
+ * serial://<device>?baud=<baud>&parity=none|odd|even&bits=5..8&stop=1|2&flow=none|software|rtscts&lowlatency=1|0
+ * Any baud rate the driver supports can be given e.g. 460800 or 2000000 for USB-CDC boards.
+ */
+class DccSerial : public DccTransport {
 
 
 private:
   CallbackAsyncSerial port;
   int baud = 115200;                                // default is 115200
   std::string device;
-  bool open = false;
- 
-
-  static std::stringstream  csMesg;       // commandstation message e.g. reslut of status, reda etc i;e. <> -> magenta
-  static std::stringstream  dMesg;        // comandstation diag message i.e. <* *> tagged -> yellowish 
-  static recvState state; 
-  static void recieve(const char *data, unsigned int len); // callback for reading 
-  static recvState nState(recvState s, char c);            // state machine for reading incomming message flow 
+  bool portOpen = false;
+  std::string parity = "none";
+  int bits = 8;
+  int stop = 1;
+  std::string flow = "none";
+  bool lowLatency = true;                           // ASYNC_LOW_LATENCY if the driver supports it
+
+protected:
+  void transmit(const char *data, size_t len) override;
+  size_t queued() override { return port.queued(); }
+  bool reconnect() override { return openPort(); }
+  void closeLink() override { closePort(); }
 
 public:
+  using DccTransport::write;
+
+  bool open(const DccUri &uri) override;          // open from serial://<device>?baud=<baud>&...
+  bool isOpen() override { return portOpen; };
+  std::string describe() override;
+
   bool openPort();                                // open the port
   bool openPort(std::string device, int baud );   // open the port
   void closePort();                               // close the port
   void write();                                   // write to the port
-  void write(const std::string *cmd);
 
   void setDevice(std::string d) { device = d; }
   void setBaud(int b) { baud = b; }
@@ -67,10 +81,8 @@ public:
   std::string getDevice() { return device; }
   int getBaud() { return baud; }
 
-  bool isOpen() { return open; };
-
   DccSerial() = default;
-  ~DccSerial() = default;
+  ~DccSerial() { closePort(); }
   DccSerial(std::string d, int b) : baud(b), device(d) {};
 };
 
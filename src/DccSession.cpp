@@ -0,0 +1,265 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fmt/core.h>
+
+#include "DccSession.hpp"
+#include "DccMQTT.hpp"
+#include "ShellCmdExec.hpp"
+#include "Diag.hpp"
+
+std::mutex DccSession::_mutex;
+std::map<std::string, std::shared_ptr<DccTransport>> DccSession::_sessions;
+std::map<std::string, DccUri> DccSession::_uris;
+std::string DccSession::_active;
+std::string DccSession::_scoped;
+std::map<std::string, std::string> DccSession::_connecting;
+std::vector<std::future<void>> DccSession::_opening;
+
+std::string DccSession::defaultName(const std::string &uri)
+{
+  auto scheme = uri.substr(0, uri.find("://"));
+  if (scheme.compare("tcp") == 0)
+  {
+    return "ethernet";
+  }
+  return scheme;
+}
+
+std::shared_ptr<DccTransport> DccSession::open(const std::string &name, const std::string &uri)
+{
+  DccUri u;
+  bool same = false;
+  if (DccUri::parse(uri, u))
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    auto it = _uris.find(name);
+    same = it != _uris.end() && it->second.scheme == u.scheme && it->second.host == u.host &&
+           it->second.port == u.port && it->second.path == u.path;
+  }
+  if (same)
+  {
+    // e.g. a serial port can't be opened a second time while the old connection holds it
+    close(name);
+  }
+
+  auto t = DccTransportRegistry::open(uri);
+  if (t)
+  {
+    adopt(name, u, t);
+  }
+  return t;
+}
+
+void DccSession::adopt(const std::string &name, const DccUri &u, std::shared_ptr<DccTransport> t)
+{
+  std::shared_ptr<DccTransport> old;
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    auto &s = _sessions[name];
+    old.swap(s);
+    s = t;
+    _uris[name] = u;
+    _active = name; // the last one opened wins
+  }
+  if (old)
+  {
+    INFO("Replacing {} [{}]", name, old->describe());
+    DccMQTTState::closed(old.get());
+    old->close();
+  }
+}
+
+void DccSession::openAsync(const std::string &name, const std::string &uri,
+                           std::function<void(std::shared_ptr<DccTransport>, const std::string &)> done)
+{
+  DccUri u;
+  if (!DccUri::parse(uri, u))
+  {
+    auto e = fmt::format("[{}] is not a valid connection; expected e.g. serial:///dev/ttyACM0 or tcp://10.0.0.5:2560", uri);
+    throw ShellCmdExecException(e);
+  }
+
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_connecting.find(name) != _connecting.end())
+  {
+    auto e = fmt::format("{} is still connecting to [{}]", name, _connecting[name]);
+    throw ShellCmdExecException(e);
+  }
+  _connecting[name] = uri;
+  _opening.erase(std::remove_if(_opening.begin(), _opening.end(), [](const std::future<void> &f)
+                                { return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }),
+                 _opening.end());
+
+  _opening.push_back(std::async(std::launch::async, [name, uri, u, done]
+                                {
+    std::shared_ptr<DccTransport> t;
+    std::string error;
+    try
+    {
+      t = DccTransportRegistry::open(uri);
+    }
+    catch (const std::exception &e)
+    {
+      error = e.what();
+    }
+    bool closed = false;
+    {
+      std::lock_guard<std::mutex> l(_mutex);
+      closed = _connecting.erase(name) == 0;
+    }
+    if (closed)
+    {
+      // closed while connecting; nobody is waiting for the connection anymore
+      DBG("Dropping {} [{}]; closed while connecting", name, uri);
+      if (t)
+        t->close();
+      return;
+    }
+    if (t)
+      adopt(name, u, t);
+    done(t, error); }));
+}
+
+std::vector<std::pair<std::string, std::string>> DccSession::connecting()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  return {_connecting.begin(), _connecting.end()};
+}
+
+bool DccSession::close(const std::string &name)
+{
+  std::shared_ptr<DccTransport> t;
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    auto it = _sessions.find(name);
+    if (it == _sessions.end())
+    {
+      // the open in progress closes the connection itself once it is there
+      auto c = _connecting.find(name);
+      if (c == _connecting.end())
+      {
+        return false;
+      }
+      INFO("Closing {} [{}] while connecting", name, c->second);
+      _connecting.erase(c);
+      return true;
+    }
+    t = it->second;
+    _sessions.erase(it);
+    _uris.erase(name);
+    if (_active == name)
+    {
+      _active.clear();
+    }
+  }
+  INFO("Closing {} [{}]", name, t->describe());
+  DccMQTTState::closed(t.get());
+  t->close();
+  return true;
+}
+
+void DccSession::closeAll()
+{
+  std::vector<std::future<void>> opening;
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    _connecting.clear(); // the opens in progress close their connections
+    opening.swap(_opening);
+  }
+  for (auto &o : opening)
+  {
+    o.wait(); // at most the connect timeout; one which got its connection already has adopted it
+  }
+
+  std::map<std::string, std::shared_ptr<DccTransport>> sessions;
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    sessions.swap(_sessions);
+    _uris.clear();
+    _active.clear();
+  }
+  for (auto &s : sessions)
+  {
+    DccMQTTState::closed(s.second.get());
+    s.second->close();
+  }
+}
+
+bool DccSession::use(const std::string &name)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_sessions.find(name) == _sessions.end())
+  {
+    return false;
+  }
+  _active = name;
+  return true;
+}
+
+std::shared_ptr<DccTransport> DccSession::get(const std::string &name)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  auto it = _sessions.find(name);
+  return (it == _sessions.end()) ? nullptr : it->second;
+}
+
+std::shared_ptr<DccTransport> DccSession::current()
+{
+  return get(currentName());
+}
+
+std::string DccSession::currentName()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  return _scoped.empty() ? _active : _scoped;
+}
+
+std::string DccSession::activeName()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  return _active;
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<DccTransport>>> DccSession::list()
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  return {_sessions.begin(), _sessions.end()};
+}
+
+DccSessionScope::DccSessionScope(const std::string &name)
+{
+  std::lock_guard<std::mutex> l(DccSession::_mutex);
+  if (DccSession::_sessions.find(name) == DccSession::_sessions.end())
+  {
+    auto s = fmt::format("No open session [{}]", name);
+    throw ShellCmdExecException(s);
+  }
+  previous = DccSession::_scoped;
+  DccSession::_scoped = name;
+}
+
+DccSessionScope::~DccSessionScope()
+{
+  std::lock_guard<std::mutex> l(DccSession::_mutex);
+  DccSession::_scoped = previous;
+}
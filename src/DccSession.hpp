@@ -0,0 +1,118 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccSession
+ * @brief Keeps the open connections to the commandstations by name e.g. main, yard, prog.
+ * Commands go to the active session which is the last one opened or the one selected with
+ * 'use <name>'. A single command can be send to another session with '@<name> <command>'
+ * without changing the active one ( see DccSessionScope ).
+ * All connections share the io_context thread pool of DccIoContext.
+ * @author grbba
+ */
+
+#ifndef DccSession_h
+#define DccSession_h
+
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DccTransport.hpp"
+
+class DccSession
+{
+private:
+  static std::mutex _mutex;
+  static std::map<std::string, std::shared_ptr<DccTransport>> _sessions;
+  static std::map<std::string, DccUri> _uris;     // the session was opened with
+  static std::string _active;
+  static std::string _scoped;              // set while a @name command is executed
+  static std::map<std::string, std::string> _connecting; // name -> uri of the opens still in progress
+  static std::vector<std::future<void>> _opening;        // their threads
+
+  static void adopt(const std::string &name, const DccUri &u, std::shared_ptr<DccTransport> t);
+
+public:
+  /**
+   * @brief Opens the uri and registers the connection under name; a session with the same
+   * name is replaced once the new connection is open so a failed open keeps it working. Only
+   * if both go to the same device or host:port the old one is closed first. The new session
+   * becomes the active one.
+   * @return the open connection or nullptr
+   */
+  static std::shared_ptr<DccTransport> open(const std::string &name, const std::string &uri);
+
+  /**
+   * @brief Same as open but returns right away; the connect runs on a thread of its own and done
+   * is called there with the open connection, or nullptr and the reason, once it is over. The
+   * session is connecting in the meantime; closing it drops the connection when it comes.
+   * @throws ShellCmdExecException if the session is connecting already
+   */
+  static void openAsync(const std::string &name, const std::string &uri,
+                        std::function<void(std::shared_ptr<DccTransport>, const std::string &)> done);
+  static std::vector<std::pair<std::string, std::string>> connecting(); // name and uri
+
+  static bool close(const std::string &name);
+  static void closeAll();
+
+  static bool use(const std::string &name);
+  static std::shared_ptr<DccTransport> get(const std::string &name);
+
+  /**
+   * @brief The connection the current command goes to i.e. the @name session if given or
+   * the active one
+   */
+  static std::shared_ptr<DccTransport> current();
+  static std::string currentName();
+  static std::string activeName();
+
+  static std::vector<std::pair<std::string, std::shared_ptr<DccTransport>>> list();
+
+  /**
+   * @brief Default session name for a connection e.g. serial or ethernet; keeps 'use serial' working
+   */
+  static std::string defaultName(const std::string &uri);
+
+  friend class DccSessionScope;
+
+  DccSession() = default;
+  ~DccSession() = default;
+};
+
+/**
+ * @brief Sends the commands executed while in scope to the named session
+ * @throws ShellCmdExecException if there is no such session
+ */
+class DccSessionScope
+{
+private:
+  std::string previous;
+
+public:
+  DccSessionScope(const std::string &name);
+  ~DccSessionScope();
+};
+
+#endif
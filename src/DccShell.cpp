@@ -37,7 +37,8 @@ namespace cli
 #include "DccShellCmd.hpp"
 #include "ShellCmdConfig.hpp"
 #include "ShellCmdExec.hpp"
-#include "DccSerial.hpp"
+#include "DccConfig.hpp"
+#include "DccScript.hpp"
 #include "Diag.hpp"
 
 using namespace std::this_thread;     // sleep_for, sleep_until
@@ -58,7 +59,7 @@ void executeMenu(std::ostream &out, const std::pair<int,std::shared_ptr<cmdItem>
     if (call != ShellCmdExec::getFMap()->end()) {
       call->second(out, var.second, params);
     } else {
-      out << fmt::format(fg(fmt::color::red) | fmt::emphasis::bold, "No executor for {}\n", var.second->name);
+      out << fmt::format(Diag::style(fg(fmt::color::red) | fmt::emphasis::bold), "No executor for {}\n", var.second->name);
     }
 }
 
@@ -115,7 +116,7 @@ void DccShell::buildMenus()
 
   cli.ExitAction(
       [&](auto &out) {
-        serial.closePort();
+        // connections, captures and the exporter are stopped by main once the shell returns
         out << "Goodbye and thanks for all the steam.\n";
         std::cout.setstate(std::ios_base::badbit);
       });
@@ -127,6 +128,22 @@ void DccShell::buildMenus()
         //     << " in command: " << cmd << ".\n";
       });
 
+  // @name <command> is not a menu item; it sends the command to the named session
+  cli.WrongCommandHandler(
+      [](std::ostream &out, const std::string &cmd) {
+        auto start = cmd.find_first_not_of(" \t");
+        if (start == std::string::npos || cmd[start] != '@') {
+          out << "Wrong command: " << cmd << "\n";
+          return;
+        }
+        try {
+          int menu = DCC_ROOT_MENU;
+          DccScript::execute(out, cmd, menu);
+        } catch (std::exception &e) {
+          ERR("{} in command [{}]\n", e.what(), cmd);
+        }
+      });
+
   cli::MainScheduler scheduler;
   cli::CliLocalSession localSession(cli, scheduler, std::cout, 200);
 
@@ -31,7 +31,6 @@
 #define ASYNC
 
 
-#include "DccSerial.hpp"
 #include "DccShellCmd.hpp"
 
 #include "../include/cli/cli.h"
@@ -40,8 +39,6 @@ class DccShell
 {
 private:
     
-    DccSerial serial;
-
     void buildMenus();
     void buildMenuCommands(cli::Menu * menu, DccShellCmd *menuItems);
 
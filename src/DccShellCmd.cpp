@@ -26,9 +26,9 @@
 
 #include "DccShellCmd.hpp"
 
-#define HEADING(x)  fmt::format(fg(fmt::color::medium_turquoise) | fmt::emphasis::bold, x);
-#define WARNING(x)  fmt::format(fg(fmt::color::orange) | fmt::emphasis::bold, x);
-#define ERROR(x)    fmt::format(fg(fmt::color::red) | fmt::emphasis::bold, x);
+#define HEADING(x)  fmt::format(Diag::style(fg(fmt::color::medium_turquoise) | fmt::emphasis::bold), x);
+#define WARNING(x)  fmt::format(Diag::style(fg(fmt::color::orange) | fmt::emphasis::bold), x);
+#define ERROR(x)    fmt::format(Diag::style(fg(fmt::color::red) | fmt::emphasis::bold), x);
 
 using namespace nlohmann;
 
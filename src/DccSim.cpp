@@ -0,0 +1,577 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <fmt/format.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <cstdlib>
+#endif
+
+#include "DccSim.hpp"
+#include "DccFrameParser.hpp"
+#include "DccResponse.hpp"
+#include "Diag.hpp"
+
+using namespace std::chrono;
+
+// ---------------------------------------------------------------------------------------------
+// Protocol
+// ---------------------------------------------------------------------------------------------
+
+DccSimState::DccSimState()
+{
+  // what a freshly decoded loco answers on the programming track
+  cvs = {{1, 3}, {7, 80}, {8, 13}, {29, 6}};
+}
+
+void DccSimState::execute(std::string_view frame, std::string &out)
+{
+  auto reply = std::back_inserter(out);
+  DccResponse c;
+
+  if (!DccResponse::decode(frame, c))
+  {
+    out += "<X>\n";
+    return;
+  }
+
+  switch (c.opcode)
+  {
+  case 's':
+  {
+    fmt::format_to(reply, "<p{}>\n" DCC_SIM_VERSION "\n", power ? 1 : 0);
+    for (auto &[id, t] : turnouts)
+      fmt::format_to(reply, "<H {} {}>\n", id, t.state);
+    for (auto &[id, o] : outputs)
+      fmt::format_to(reply, "<Y {} {}>\n", id, o.state);
+    break;
+  }
+  case '0':
+  case '1':
+  {
+    // <1> or <1 MAIN|PROG|JOIN>
+    power = (c.opcode == '1');
+    if (c.argc > 0)
+      fmt::format_to(reply, "<p{} {}>\n", c.opcode, c.textArg(0));
+    else
+      fmt::format_to(reply, "<p{}>\n", c.opcode);
+    break;
+  }
+  case 'R':
+  {
+    auto cv = c.intArg(0);
+    auto it = cvs.find(cv);
+    int value = (it == cvs.end()) ? -1 : it->second;
+
+    if (c.argc == 3)
+      fmt::format_to(reply, "<r {}|{}|{} {}>\n", c.intArg(1), c.intArg(2), cv, value);
+    else if (c.argc == 1)
+      fmt::format_to(reply, "<r {} {}>\n", cv, value);
+    else if (c.argc == 0)
+      fmt::format_to(reply, "<r {}>\n", cvs[1]); // loco address
+    else
+      out += "<X>\n";
+    break;
+  }
+  case 'W':
+  {
+    auto cv = c.intArg(0);
+    auto value = c.intArg(1);
+
+    if (c.argc == 4 || c.argc == 2)
+    {
+      bool ok = cv > 0 && cv <= 1024 && value >= 0 && value <= 255;
+      if (ok)
+        cvs[cv] = value;
+      if (c.argc == 4)
+        fmt::format_to(reply, "<r {}|{}|{} {}>\n", c.intArg(2), c.intArg(3), cv, ok ? value : -1);
+      else
+        fmt::format_to(reply, "<r {} {}>\n", cv, ok ? value : -1);
+    }
+    else if (c.argc == 1)
+    {
+      cvs[1] = cv; // <W addr>
+      fmt::format_to(reply, "<w {}>\n", cv);
+    }
+    else
+      out += "<X>\n";
+    break;
+  }
+  case 'D':
+  {
+    // <D CMD ON|OFF> and friends; remembered but the simulator doesn't get chattier
+    if (c.argc == 0)
+    {
+      out += "<X>\n";
+      break;
+    }
+    std::string opt(c.textArg(0));
+    if (c.argc > 1 && c.textArg(1) == "OFF")
+      diags.erase(opt);
+    else
+      diags.insert(opt);
+    fmt::format_to(reply, "<* D {} {} *>\n", opt, c.argc > 1 ? c.textArg(1) : "ON");
+    break;
+  }
+  case 'c':
+  {
+    // <cli s sid> selects the motorshield
+    if (c.textArg(0) == "li" && c.textArg(1) == "s" && c.argc == 3 && c.args[2].isInt)
+    {
+      mshield = c.intArg(2);
+      fmt::format_to(reply, "<* Motorshield set to {} *>\n<O>\n", mshield);
+    }
+    else
+      out += "<X>\n";
+    break;
+  }
+  case 'T':
+  {
+    if (c.argc == 0)
+    {
+      if (turnouts.empty())
+        out += "<X>\n";
+      for (auto &[id, t] : turnouts)
+        fmt::format_to(reply, "<H {} {} {} {}>\n", id, t.addr, t.sub, t.state);
+    }
+    else if (c.argc == 1)
+      out += turnouts.erase(c.intArg(0)) ? "<O>\n" : "<X>\n";
+    else if (c.argc == 2)
+    {
+      auto it = turnouts.find(c.intArg(0));
+      if (it == turnouts.end())
+      {
+        out += "<X>\n";
+        break;
+      }
+      // <T id 1|0> or <T id T|C>
+      auto s = c.textArg(1);
+      it->second.state = c.args[1].isInt ? (c.intArg(1) != 0) : (s == "T");
+      fmt::format_to(reply, "<H {} {}>\n", it->first, it->second.state);
+    }
+    else
+    {
+      turnouts[c.intArg(0)] = {c.intArg(1), c.intArg(2), 0};
+      out += "<O>\n";
+    }
+    break;
+  }
+  case 'S':
+  {
+    if (c.argc == 0)
+    {
+      if (sensors.empty())
+        out += "<X>\n";
+      for (auto &[id, s] : sensors)
+        fmt::format_to(reply, "<Q {} {} {}>\n", id, s.pin, s.pullup);
+    }
+    else if (c.argc == 1)
+      out += sensors.erase(c.intArg(0)) ? "<O>\n" : "<X>\n";
+    else if (c.argc == 3)
+    {
+      sensors[c.intArg(0)] = {c.intArg(1), c.intArg(2), 0};
+      out += "<O>\n";
+    }
+    else
+      out += "<X>\n";
+    break;
+  }
+  case 'Q':
+  {
+    for (auto &[id, s] : sensors)
+      fmt::format_to(reply, s.state ? "<Q {}>\n" : "<q {}>\n", id);
+    break;
+  }
+  case 'Z':
+  {
+    if (c.argc == 0)
+    {
+      if (outputs.empty())
+        out += "<X>\n";
+      for (auto &[id, o] : outputs)
+        fmt::format_to(reply, "<Y {} {} {} {}>\n", id, o.pin, o.flags, o.state);
+    }
+    else if (c.argc == 1)
+      out += outputs.erase(c.intArg(0)) ? "<O>\n" : "<X>\n";
+    else if (c.argc == 2)
+    {
+      auto it = outputs.find(c.intArg(0));
+      if (it == outputs.end())
+      {
+        out += "<X>\n";
+        break;
+      }
+      it->second.state = c.intArg(1) != 0;
+      fmt::format_to(reply, "<Y {} {}>\n", it->first, it->second.state);
+    }
+    else if (c.argc == 3)
+    {
+      outputs[c.intArg(0)] = {c.intArg(1), c.intArg(2), 0};
+      out += "<O>\n";
+    }
+    else
+      out += "<X>\n";
+    break;
+  }
+  case 't':
+  {
+    if (c.argc == 4)
+    {
+      // <t reg cab speed dir> -> <T reg speed dir>
+      throttles[c.intArg(0)] = {c.intArg(1), c.intArg(2), c.intArg(3)};
+      fmt::format_to(reply, "<T {} {} {}>\n", c.intArg(0), c.intArg(2), c.intArg(3));
+    }
+    else if (c.argc == 3)
+    {
+      // <t cab speed dir> -> <l cab reg speedbyte functions>
+      auto speed = c.intArg(1);
+      auto dir = c.intArg(2);
+      throttles[c.intArg(0)] = {c.intArg(0), speed, dir};
+      int sb = (dir ? 128 : 0) | (speed < 0 ? 1 : (speed == 0 ? 0 : speed + 1));
+      fmt::format_to(reply, "<l {} 0 {} 0>\n", c.intArg(0), sb);
+    }
+    else
+      out += "<X>\n";
+    break;
+  }
+  case '!':
+  {
+    for (auto &t : throttles)
+      t.second.speed = -1;
+    break;
+  }
+  case '#':
+  {
+    out += "<# 50>\n";
+    break;
+  }
+  case 'f':
+  case 'a':
+    break; // functions and accessories don't reply
+  default:
+    out += "<X>\n";
+    break;
+  }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Clients
+// ---------------------------------------------------------------------------------------------
+
+/**
+ * @brief One connected cli; replies are appended to out and written in one go while the
+ * previous write is in flight
+ */
+class DccSimClient : public std::enable_shared_from_this<DccSimClient>
+{
+protected:
+  DccSim &sim;
+  DccFrameParser parser;
+  std::string out;                          // collected while a write is in flight
+  std::string sending;                      // buffer of the write in flight
+  bool writing = false;
+  std::deque<std::pair<steady_clock::time_point, std::string>> delayed;
+  asio::steady_timer delay;
+  uint64_t dropped = 0;
+
+  virtual void flush() = 0;
+
+  void delayed_send()
+  {
+    auto now = steady_clock::now();
+    while (!delayed.empty() && delayed.front().first <= now)
+    {
+      out += delayed.front().second;
+      delayed.pop_front();
+    }
+    flush();
+    if (!delayed.empty())
+    {
+      delay.expires_at(delayed.front().first);
+      delay.async_wait([self = shared_from_this()](const std::error_code &ec)
+                       { if (!ec) self->delayed_send(); });
+    }
+  }
+
+public:
+  /**
+   * @brief Queues a reply; delayed by the configured latency
+   */
+  void reply(std::string &&s)
+  {
+    if (s.empty())
+      return;
+    auto latency = sim.getConfig().latency;
+    if (latency.count() == 0)
+    {
+      out += s;
+      flush();
+      return;
+    }
+    bool idle = delayed.empty();
+    delayed.emplace_back(steady_clock::now() + latency, std::move(s));
+    if (idle)
+    {
+      delay.expires_at(delayed.front().first);
+      delay.async_wait([self = shared_from_this()](const std::error_code &ec)
+                       { if (!ec) self->delayed_send(); });
+    }
+  }
+
+  /**
+   * @brief Diag chatter; dropped while the client doesn't keep up
+   */
+  void diag(std::string_view s)
+  {
+    if (out.size() > DCC_SIM_BACKLOG)
+    {
+      dropped++;
+      return;
+    }
+    out += s;
+  }
+
+  uint64_t getDropped() const { return dropped; }
+
+  virtual void start() = 0;
+  virtual void close() = 0;
+  virtual void send() { flush(); }
+  virtual std::string describe() = 0;
+
+  DccSimClient(DccSim &s, asio::io_context &io) : sim(s), delay(io)
+  {
+    parser.setCallback([this](DccFrame type, std::string_view frame)
+                       {
+      if (type == DccFrame::DCC)
+        sim.command(*this, frame); });
+  }
+  virtual ~DccSimClient() = default;
+};
+
+/**
+ * @brief Client on a tcp socket or the master side of the pty
+ */
+template <typename Stream>
+class DccSimStream : public DccSimClient
+{
+private:
+  Stream stream;
+  std::string name;
+  std::array<char, 4096> buf;
+
+  void read()
+  {
+    stream.async_read_some(asio::buffer(buf), [this, self = shared_from_this()](const std::error_code &ec, size_t n)
+                           {
+      if (ec)
+      {
+        if (ec != asio::error::operation_aborted)
+          INFO("{} disconnected ({})", name, ec.message());
+        sim.remove(self);
+        return;
+      }
+      parser.parse(buf.data(), n);
+      read(); });
+  }
+
+  void flush() override
+  {
+    if (writing || out.empty() || !stream.is_open())
+      return;
+    writing = true;
+    sending.clear();
+    sending.swap(out);
+    asio::async_write(stream, asio::buffer(sending), [this, self = shared_from_this()](const std::error_code &ec, size_t)
+                      {
+      writing = false;
+      if (ec)
+      {
+        sim.remove(self);
+        return;
+      }
+      flush(); });
+  }
+
+public:
+  void start() override { read(); }
+
+  void close() override
+  {
+    std::error_code ec;
+    delay.cancel();
+    stream.close(ec);
+  }
+
+  std::string describe() override { return name; }
+
+  DccSimStream(DccSim &s, asio::io_context &io, Stream &&st, const std::string &n)
+      : DccSimClient(s, io), stream(std::move(st)), name(n) {}
+};
+
+// ---------------------------------------------------------------------------------------------
+// Simulator
+// ---------------------------------------------------------------------------------------------
+
+DccSim::DccSim(asio::io_context &i, const DccSimConfig &c) : io(i), config(c), diagTimer(i)
+{
+}
+
+DccSim::~DccSim()
+{
+#ifndef WIN32
+  if (ptySlave >= 0)
+    ::close(ptySlave);
+#endif
+}
+
+void DccSim::add(std::shared_ptr<DccSimClient> c)
+{
+  INFO("{} connected", c->describe());
+  clients.insert(c);
+  c->start();
+}
+
+void DccSim::remove(std::shared_ptr<DccSimClient> c)
+{
+  if (clients.erase(c))
+  {
+    if (c->getDropped())
+      WARN("{}: {} diag messages dropped", c->describe(), c->getDropped());
+    c->close();
+  }
+}
+
+void DccSim::command(DccSimClient &c, std::string_view frame)
+{
+  TRC("{}", frame);
+  std::string r;
+  state.execute(frame, r);
+  c.reply(std::move(r));
+}
+
+void DccSim::listen(unsigned short p)
+{
+  acceptor = std::make_shared<asio::ip::tcp::acceptor>(io, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), p));
+  INFO("Listening on port {}", port());
+  accept();
+}
+
+unsigned short DccSim::port() const
+{
+  return acceptor ? acceptor->local_endpoint().port() : 0;
+}
+
+void DccSim::accept()
+{
+  acceptor->async_accept([this](const std::error_code &ec, asio::ip::tcp::socket s)
+                         {
+    if (ec)
+      return; // acceptor closed
+    std::error_code e;
+    s.set_option(asio::ip::tcp::no_delay(true), e);
+    auto n = fmt::format("tcp:{}", s.remote_endpoint(e).port());
+    add(std::make_shared<DccSimStream<asio::ip::tcp::socket>>(*this, io, std::move(s), n));
+    accept(); });
+}
+
+std::string DccSim::openPty()
+{
+#ifdef WIN32
+  throw std::runtime_error("Pseudo terminals are not available on this platform");
+#else
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+  {
+    auto ec = std::error_code(errno, std::system_category());
+    if (master >= 0)
+      ::close(master);
+    throw std::system_error(ec, "posix_openpt");
+  }
+  std::string path = ptsname(master);
+
+  // keep the slave open ourselves so a client disconnecting doesn't hang up the master
+  ptySlave = ::open(path.c_str(), O_RDWR | O_NOCTTY);
+  if (ptySlave >= 0)
+  {
+    termios t;
+    tcgetattr(ptySlave, &t);
+    cfmakeraw(&t);
+    tcsetattr(ptySlave, TCSANOW, &t);
+  }
+
+  asio::posix::stream_descriptor d(io, master);
+  add(std::make_shared<DccSimStream<asio::posix::stream_descriptor>>(*this, io, std::move(d), path));
+  return path;
+#endif
+}
+
+void DccSim::start()
+{
+  if (config.diagRate == 0)
+    return;
+  INFO("Sending {} diag messages/s", config.diagRate);
+  diagTimer.expires_after(milliseconds(DCC_SIM_TICK));
+  diagTimer.async_wait([this](const std::error_code &ec)
+                       { if (!ec) tick(); });
+}
+
+void DccSim::tick()
+{
+  diagCredit += config.diagRate * DCC_SIM_TICK / 1000.0;
+  auto n = static_cast<uint64_t>(diagCredit);
+  diagCredit -= n;
+
+  std::string msg;
+  for (uint64_t i = 0; i < n; i++)
+  {
+    msg.clear();
+    fmt::format_to(std::back_inserter(msg), "<* SIM {:08} ", diagCount++);
+    if (msg.size() < config.diagSize)
+      msg.append(config.diagSize - msg.size(), '.');
+    msg += " *>\n";
+    for (auto &c : clients)
+      c->diag(msg);
+  }
+  for (auto &c : clients)
+    c->send();
+
+  // scheduled from the last expiry so the rate doesn't drift with the time spent here
+  diagTimer.expires_at(diagTimer.expiry() + milliseconds(DCC_SIM_TICK));
+  diagTimer.async_wait([this](const std::error_code &ec)
+                       { if (!ec) tick(); });
+}
+
+void DccSim::stop()
+{
+  std::error_code ec;
+  diagTimer.cancel();
+  if (acceptor)
+    acceptor->close(ec);
+  auto all = clients;
+  for (auto &c : all)
+    remove(c);
+}
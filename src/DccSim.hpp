@@ -0,0 +1,155 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccSim
+ * @brief Commandstation simulator. Speaks the DCC-EX text protocol on a TCP port and/or a
+ * pseudo terminal so the cli can be run and benchmarked without a Mega on the desk.
+ * Supported are status, power, cv read/write, diag switches, the motorshield setup ( <cli s sid> ),
+ * turnouts, sensors, outputs and throttles. Replies can be delayed by a fixed latency and
+ * diagnostic messages can be send at a configurable rate up to sustained floods.
+ * @note The state ( cvs, turnouts ... ) is shared by all clients. The simulator is single threaded
+ * i.e. the io_context it is given has to be run by one thread only.
+ * @author grbba
+ */
+
+#ifndef DccSim_h
+#define DccSim_h
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+
+#include <asio.hpp>
+
+#define DCC_SIM_VERSION "<iDCC-EX V-4.0.0 / MEGA / STANDARD_MOTOR_SHIELD G-sim>"
+#define DCC_SIM_TICK 10 // ms between two batches of diag messages
+#define DCC_SIM_BACKLOG (1 << 20) // diag messages are dropped while a client has more than that unsent
+
+struct DccSimConfig
+{
+  std::chrono::microseconds latency{0};   // delay of every reply
+  unsigned int diagRate = 0;              // diag messages per second to every client; 0 is off
+  size_t diagSize = 48;                   // length of the text of a diag message
+};
+
+/**
+ * @brief Protocol engine; turns one command into its reply frames
+ */
+class DccSimState
+{
+private:
+  struct Turnout
+  {
+    int addr;
+    int sub;
+    int state;
+  };
+  struct Sensor
+  {
+    int pin;
+    int pullup;
+    int state;
+  };
+  struct Output
+  {
+    int pin;
+    int flags;
+    int state;
+  };
+  struct Throttle
+  {
+    int cab;
+    int speed;
+    int dir;
+  };
+
+  bool power = false;
+  int mshield = -1;
+  std::map<int, int> cvs;
+  std::map<int, Turnout> turnouts;
+  std::map<int, Sensor> sensors;
+  std::map<int, Output> outputs;
+  std::map<int, Throttle> throttles;
+  std::set<std::string> diags;
+
+public:
+  /**
+   * @brief Executes the command and appends the replies to out
+   * @param frame the command including the <>
+   */
+  void execute(std::string_view frame, std::string &out);
+
+  DccSimState();
+  ~DccSimState() = default;
+};
+
+class DccSimClient;
+
+class DccSim
+{
+private:
+  asio::io_context &io;
+  DccSimConfig config;
+  DccSimState state;
+  std::shared_ptr<asio::ip::tcp::acceptor> acceptor;
+  asio::steady_timer diagTimer;
+  std::set<std::shared_ptr<DccSimClient>> clients;
+  uint64_t diagCount = 0;
+  double diagCredit = 0;                   // fraction of a diag message carried over to the next tick
+  int ptySlave = -1;                       // kept open so the master doesn't see EOF between clients
+
+  void accept();
+  void tick();
+
+public:
+  void add(std::shared_ptr<DccSimClient> c);
+  void remove(std::shared_ptr<DccSimClient> c);
+
+  /**
+   * @brief Executes a <...> frame recieved from a client and queues the reply
+   */
+  void command(DccSimClient &c, std::string_view frame);
+
+  /**
+   * @brief Accepts clients on the port of the loopback interface
+   */
+  void listen(unsigned short port);
+
+  /**
+   * @brief Opens a pseudo terminal pair; the cli connects to the returned device
+   * @return path of the slave side e.g. /dev/pts/3
+   */
+  std::string openPty();
+
+  void start();   // starts the diag chatter
+  void stop();    // closes all clients and the acceptor
+  unsigned short port() const;  // the port actually listened on e.g. when 0 was given
+  const DccSimConfig &getConfig() const { return config; }
+
+  DccSim(asio::io_context &io, const DccSimConfig &c);
+  ~DccSim();
+};
+
+#endif
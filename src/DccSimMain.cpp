@@ -0,0 +1,103 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * dcccli-sim : commandstation simulator
+ *
+ *   dcccli-sim -p 2560 --pty --latency 5 --diag-rate 1000
+ *
+ * and then e.g. 'open ethernet localhost 2560' or 'open serial /dev/pts/3' in dcccli.
+ */
+
+#include <iostream>
+#include <CLI/CLI.hpp>
+
+#include "DccSim.hpp"
+#include "DccFrameParser.hpp"
+#include "Diag.hpp"
+
+auto main(int argc, char **argv) -> int
+{
+  CLI::App app{"DCC-EX commandstation simulator"};
+
+  int port = 2560;
+  bool pty = false;
+  bool noTcp = false;
+  int latency = 0;
+  unsigned int rate = 0;
+  size_t size = 48;
+  std::string level = "info";
+
+  app.add_option("-p,--port", port, "TCP port to listen on at 127.0.0.1; 0 picks a free one")->check(CLI::Range(0, 65535));
+  app.add_flag("--no-tcp", noTcp, "Don't listen on TCP");
+  app.add_flag("--pty", pty, "Open a pseudo terminal and print the device to connect to");
+  app.add_option("--latency", latency, "Delay of each reply in microseconds")->check(CLI::NonNegativeNumber);
+  app.add_option("--diag-rate", rate, "Diag messages per second send to every client");
+  app.add_option("--diag-size", size, "Length of a diag message")->check(CLI::Range(16, 4096));
+  app.add_option("-l,--loglevel", level, "Log level")->check(CLI::IsMember({"trace", "debug", "info", "warn", "error", "off"}));
+
+  CLI11_PARSE(app, argc, argv);
+  Diag::setFileInfo(false);
+  Diag::setup();
+  spdlog::set_level(spdlog::level::from_str(level));
+
+  if (noTcp && !pty)
+  {
+    ERR("Nothing to listen on; use --pty or drop --no-tcp");
+    return EXIT_FAILURE;
+  }
+
+  DccSimConfig config;
+  config.latency = std::chrono::microseconds(latency);
+  config.diagRate = rate;
+  config.diagSize = size;
+
+  asio::io_context io;
+  DccSim sim(io, config);
+
+  try
+  {
+    if (!noTcp)
+    {
+      sim.listen(static_cast<unsigned short>(port));
+    }
+    if (pty)
+    {
+      auto dev = sim.openPty();
+      INFO("Serial device {}", dev);
+    }
+  }
+  catch (const std::exception &e)
+  {
+    ERR("{}", e.what());
+    return EXIT_FAILURE;
+  }
+
+  asio::signal_set signals(io, SIGINT, SIGTERM);
+  signals.async_wait([&](const std::error_code &, int)
+                     {
+    INFO("Stopping");
+    sim.stop(); });
+
+  sim.start();
+  io.run();
+  Diag::shutdown();
+  return EXIT_SUCCESS;
+}
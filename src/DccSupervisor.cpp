@@ -0,0 +1,93 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include "DccSupervisor.hpp"
+#include "Diag.hpp"
+
+std::mutex DccSupervisor::_mutex;
+std::condition_variable DccSupervisor::_cv;
+std::thread DccSupervisor::_thread;
+bool DccSupervisor::_stop = false;
+std::multimap<std::chrono::steady_clock::time_point, std::weak_ptr<DccTransport>> DccSupervisor::_due;
+
+void DccSupervisor::schedule(std::weak_ptr<DccTransport> t, std::chrono::milliseconds delay)
+{
+  std::lock_guard<std::mutex> l(_mutex);
+  if (_stop)
+  {
+    return;
+  }
+  _due.insert({std::chrono::steady_clock::now() + delay, t});
+  if (!_thread.joinable())
+  {
+    _thread = std::thread(run);
+  }
+  _cv.notify_one();
+}
+
+void DccSupervisor::run()
+{
+  std::unique_lock<std::mutex> l(_mutex);
+  while (!_stop)
+  {
+    if (_due.empty())
+    {
+      _cv.wait(l);
+      continue;
+    }
+    auto next = _due.begin();
+    if (next->first > std::chrono::steady_clock::now())
+    {
+      _cv.wait_until(l, next->first);
+      continue;
+    }
+    auto t = next->second.lock();
+    _due.erase(next);
+    if (!t)
+    {
+      continue; // the session has been closed
+    }
+
+    l.unlock();
+    auto delay = t->retry();
+    l.lock();
+
+    if (delay.count() > 0 && !_stop)
+    {
+      _due.insert({std::chrono::steady_clock::now() + delay, t});
+    }
+  }
+}
+
+void DccSupervisor::stop()
+{
+  {
+    std::lock_guard<std::mutex> l(_mutex);
+    _stop = true;
+    _due.clear();
+  }
+  _cv.notify_one();
+  if (_thread.joinable())
+  {
+    _thread.join();
+  }
+  std::lock_guard<std::mutex> l(_mutex);
+  _stop = false;
+}
@@ -0,0 +1,63 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccSupervisor
+ * @brief Reopens the connections which have been lost. A single thread sleeps until the next
+ * reconnect attempt is due so nothing wakes up while all connections are fine. The attempts run
+ * here and not on the io_context as closing and reopening a port waits for its io handlers.
+ * @author grbba
+ */
+
+#ifndef DccSupervisor_h
+#define DccSupervisor_h
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "DccTransport.hpp"
+
+class DccSupervisor
+{
+private:
+  static std::mutex _mutex;
+  static std::condition_variable _cv;
+  static std::thread _thread;
+  static bool _stop;
+  static std::multimap<std::chrono::steady_clock::time_point, std::weak_ptr<DccTransport>> _due;
+
+  static void run();
+
+public:
+  /**
+   * @brief Calls retry() on the transport after the delay; started on first use
+   */
+  static void schedule(std::weak_ptr<DccTransport> t, std::chrono::milliseconds delay);
+  static void stop();
+
+  DccSupervisor() = default;
+  ~DccSupervisor() = default;
+};
+
+#endif
@@ -19,96 +19,57 @@
  */
 
 #include <iostream>
-#include <vector>
 #include <fmt/core.h>
 #include <fmt/color.h>
 #include <fmt/ostream.h>
 
 #include "DccTCP.hpp"
+#include "DccConfig.hpp"
+#include "ShellCmdExec.hpp"
 #include "Diag.hpp"
 
-std::stringstream  DccTCP::csMesg;       // commandstation message e.g. reslut of status, reda etc i;e. <> -> magenta
-std::stringstream  DccTCP:: dMesg; 
-recvState DccTCP::state = _Text;
-
-
-recvState DccTCP::nState(recvState s, char c)
-{
-  switch (c)
-  {
-    case '\n': {
-      // ignore \n
-      return s;
-    }
-    case '<':
-    {
-      if( s == _OpenDiag ) { // the <> is part of a diag
-        DccTCP::dMesg << c;
-        return s;
-      }
-      DccTCP::csMesg << c;              // store the char in the csmesg
-      return _OpenDcc;
-    }
-    case '*':
-    {
-      if (s == _OpenDcc) {
-        csMesg.str(""); // clear the stream
-        // DccTCP::dMesg << c;
-        return _OpenDiag;
-      }
-      if (s == _OpenDiag) {
-        // DccTCP::dMesg << c;
-        return _PreCloseDiag;
-      }
-    }
-    case '>':
-    {
-      if (s == _OpenDcc) {
-          DccTCP::csMesg << c;
-          fmt::print(fg(fmt::color::magenta), "{}\n", csMesg.str());
-          // fmt::print("print dcc message {}\n", csMesg.str());
-          csMesg.str(""); // clear the stream
-          // csMesg.clear();
-          return _CloseDcc; // print the dcc message 
-      }
-      if (s == _PreCloseDiag) {
-          // DccTCP::dMesg << c;
-          INFO("{}", dMesg.str());
-          dMesg.str(""); // clear the stream
-          // fmt::print("print diag message\n"); 
-          return _CloseDiag; // print the diag message 
-      } 
-    }
-    default:
-    {
-      if (s == _OpenDcc) { DccTCP::csMesg << c; return _OpenDcc; };
-      if (s == _OpenDiag) { DccTCP::dMesg << c; return _OpenDiag; };
-      fmt::print(fg(fmt::color::magenta), "{}", c); // print the char
-      return _Text;
-    }
-  }
-  ERR("Can't understand incomming message");
-  return _Text;
-}
-
 /**
- * @brief  Reciever callback
- *
- * @param data
- * @param len
+ * @brief Opens the connection from tcp://<ip>[:<port>]; the port defaults to 2560
  */
-void DccTCP::recieve(const char *data, unsigned int len)
+bool DccTCP::open(const DccUri &uri)
 {
-  std::vector<char> v(data, data + len);
+  if (uri.host.empty())
+  {
+    auto s = fmt::format("No address given in [{}]", uri.text);
+    throw ShellCmdExecException(s);
+  }
 
-  for (unsigned int i = 0; i < v.size(); i++)
+  AsyncTCPOptions o;
+  o.noDelay = uri.getInt("nodelay", 1) != 0;
+  o.keepAlive = uri.getInt("keepalive", 1) != 0;
+  o.sendBuffer = uri.getInt("sndbuf", 0);
+  o.recieveBuffer = uri.getInt("rcvbuf", 0);
+  int coalesce = uri.getInt("coalesce", 0);
+  int timeout = uri.getInt("timeout", ASYNC_TCP_CONNECT_TIMEOUT);
+  if (coalesce < 0 || coalesce > DCC_TCP_MAX_COALESCE || o.sendBuffer < 0 || o.recieveBuffer < 0 || timeout <= 0)
   {
-      auto s = nState(state, v[i]);
-      //  fmt::print("{} {} {} {}\n", state, v[i], s, "action" );
-      state = s;
-      std::cout.flush(); // Flush screen buffer
+    auto s = fmt::format("Wrong tcp settings in [{}]; coalesce is 0..{}us", uri.text, DCC_TCP_MAX_COALESCE);
+    throw ShellCmdExecException(s);
   }
+  o.coalesce = std::chrono::microseconds(coalesce);
+  o.connectTimeout = std::chrono::milliseconds(timeout);
+  server.setOptions(o);
+
+  bool ok = openConnection(uri.host, uri.port.empty() ? fmt::format("{}", DCC_DEFAULT_PORT) : uri.port);
+  server.unsent(); // a new connection doesn't send what an earlier one left behind
+  return ok;
 }
+
+std::string DccTCP::describe()
+{
+  // every setting applied to the socket so the description opens the same connection again
+  auto &o = server.getOptions();
+  auto host = (ipAddress.find(':') != std::string::npos) ? fmt::format("[{}]", ipAddress) : ipAddress;
+  return fmt::format("tcp://{}:{}?nodelay={}&keepalive={}&sndbuf={}&rcvbuf={}&coalesce={}&timeout={}",
+                     host, port, o.noDelay ? 1 : 0, o.keepAlive ? 1 : 0, o.sendBuffer, o.recieveBuffer,
+                     o.coalesce.count(), o.connectTimeout.count());
+}
+
   /**
  * @brief
  *
@@ -117,7 +78,8 @@ void DccTCP::recieve(const char *data, unsigned int len)
   {
     // That means that ipAddress and port are properly initalized!!
     // INFO("openConnection ...");
-    server.setCallback(recieve);
+    server.setCallback([this](const char *data, size_t len) { recieve(data, len); });
+    server.setErrorCallback([this](const std::error_code &ec) { linkDown(ec.message()); });
     server.open(ipAddress, port);
     return server.isOpen();
   };
@@ -125,7 +87,7 @@ void DccTCP::recieve(const char *data, unsigned int len)
   bool DccTCP::openConnection(std::string ip, std::string p)
   {
     // if already open and same ip --> warning that the ip is already connected --> did you mean to open another ip?
-    if (open)
+    if (connected)
     {
       if (ip.compare(ipAddress) == 0)
       {
@@ -137,6 +99,7 @@ void DccTCP::recieve(const char *data, unsigned int len)
         // if open and open request to different ip --> warning changing ip --> close old ip first before moving on
         WARN("switching connection {} to {}", ipAddress, ip);
         server.close();
+        connected = false;
       }
     }
 
@@ -145,7 +108,7 @@ void DccTCP::recieve(const char *data, unsigned int len)
 
     if (openConnection())
     {
-      open = true;
+      connected = true;
     }
     else
     {
@@ -161,11 +124,14 @@ void DccTCP::recieve(const char *data, unsigned int len)
  */
   void DccTCP::closeConnection()
   {
+    if (!connected)
+      return;
     server.clearCallback();
     server.close();
+    connected = false;
   };
 
-  void DccTCP::write(const std::string *cmd)
+  void DccTCP::transmit(const char *data, size_t len)
   {
-    server.write(cmd->c_str(), cmd->size());
+    server.write(data, len);
   };
\ No newline at end of file
@@ -22,30 +22,43 @@
 #ifndef DccTCP_h
 #define DccTCP_h
 
-#include "CliReciever.hpp"
+#include "DccTransport.hpp"
 #include "AsyncTCP.hpp"
 
+#define DCC_TCP_MAX_COALESCE 2000 // us; longer windows would be noticed when driving
 
-class DccTCP {
+/**
+ * @brief Network connection to the commandstation;
+ * tcp://<host>:<port>?nodelay=1|0&keepalive=1|0&sndbuf=<bytes>&rcvbuf=<bytes>&coalesce=<us>&timeout=<ms>
+ * coalesce holds writes back for up to 2000us so commands send in a burst go out in one
+ * segment; waiting for a reply flushes them right away. timeout bounds the resolve and the
+ * connect so an unreachable address doesn't hold up the shell.
+ */
+class DccTCP : public DccTransport {
 
 private:
   CallbackAsyncTCP  server;           
   std::string       ipAddress;            // IP Address 1.2.3.4
   std::string       port;                 // port number; default is 2560 for the command station
-  bool              open = false;
+  bool              connected = false;
 
-  static std::stringstream  csMesg;       // commandstation message e.g. reslut of status, reda etc i;e. <> -> magenta
-  static std::stringstream  dMesg;        // comandstation diag message i.e. <* *> tagged -> yellowish 
-  static recvState state; 
-  static void recieve(const char *data, unsigned int len); // callback for reading 
-  static recvState nState(recvState s, char c);            // state machine for reading incomming message flow 
-  
   bool openConnection();                                   // open the connection / setting the callback for reception
 
+protected:
+  void transmit(const char *data, size_t len) override;
+  size_t queued() override { return server.queued(); }
+  void flushLink() override { server.flush(); }
+  bool reconnect() override { return openConnection(); }
+  std::string unsent() override { return server.unsent(); }
+  void closeLink() override { closeConnection(); }
+
 public:
+  bool open(const DccUri &uri) override;                   // open from tcp://<ip>:<port>
+  bool isOpen() override { return connected; };
+  std::string describe() override;
+
   bool openConnection(std::string ip, std::string port);   // open the connection  
   void closeConnection();                                  // close the connection                                    
-  void write(const std::string *cmd); 
 
   void setIpAddress(std::string a) { ipAddress = a; }
   void setPort(std::string p) { port = p; }
@@ -54,10 +67,8 @@ public:
   std::string getPort() { return port; }
   CallbackAsyncTCP *getServer() { return &server; }
 
-  bool isOpen() { return open; };
-
   DccTCP() = default;
-  ~DccTCP() = default;
+  ~DccTCP() { closeConnection(); }
   DccTCP(std::string a, std::string p) : ipAddress(a), port(p) {};
 };
 
@@ -0,0 +1,409 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include "DccTransport.hpp"
+#include "DccResponse.hpp"
+#include "DccRequest.hpp"
+#include "DccSupervisor.hpp"
+#include "DccCapture.hpp"
+#include "ShellCmdExec.hpp"
+#include "Diag.hpp"
+
+std::map<std::string, DccTransportFactory> DccTransportRegistry::_factories;
+
+bool DccUri::parse(const std::string &s, DccUri &uri)
+{
+  auto sep = s.find("://");
+  if (sep == std::string::npos || sep == 0)
+  {
+    return false;
+  }
+
+  uri = DccUri();
+  uri.text = s;
+  uri.scheme = s.substr(0, sep);
+
+  auto rest = s.substr(sep + 3);
+  auto q = rest.find('?');
+  if (q != std::string::npos)
+  {
+    auto query = rest.substr(q + 1);
+    rest.resize(q);
+
+    size_t pos = 0;
+    while (pos <= query.size())
+    {
+      auto amp = query.find('&', pos);
+      auto kv = query.substr(pos, amp == std::string::npos ? std::string::npos : amp - pos);
+      auto eq = kv.find('=');
+      if (!kv.empty())
+      {
+        if (eq == std::string::npos)
+          uri.query[kv] = "";
+        else
+          uri.query[kv.substr(0, eq)] = kv.substr(eq + 1);
+      }
+      if (amp == std::string::npos)
+        break;
+      pos = amp + 1;
+    }
+  }
+
+  // serial:///dev/ttyACM0 has an empty authority; everything after it is the path
+  auto slash = rest.find('/');
+  auto authority = rest.substr(0, slash);
+  if (slash != std::string::npos)
+  {
+    uri.path = rest.substr(slash);
+  }
+
+  auto colon = authority.rfind(':');
+  auto bracket = authority.find(']');
+  if (!authority.empty() && authority[0] == '[' && bracket != std::string::npos) // [::1] or [::1]:2560
+  {
+    uri.host = authority.substr(1, bracket - 1);
+    if (colon != std::string::npos && colon > bracket)
+      uri.port = authority.substr(colon + 1);
+  }
+  else if (colon != std::string::npos && authority.find(':') == colon)
+  {
+    uri.host = authority.substr(0, colon);
+    uri.port = authority.substr(colon + 1);
+  }
+  else
+  {
+    uri.host = authority;
+  }
+  return true;
+}
+
+int DccUri::getInt(const std::string &key, int def) const
+{
+  auto v = get(key);
+  if (v.empty())
+  {
+    return def;
+  }
+  try
+  {
+    return std::stoi(v);
+  }
+  catch (std::exception &e)
+  {
+    auto s = fmt::format("Wrong value for {} supplied: [{}] is not a valid number", key, v);
+    throw ShellCmdExecException(s);
+  }
+}
+
+DccTransport::DccTransport()
+{
+  parser.setCallback([this](DccFrame type, std::string_view frame)
+                     {
+    if (type == DccFrame::DCC)
+    {
+      stats.frames.fetch_add(1, std::memory_order_relaxed);
+      if (!DccResponseDecoder::dispatch(frame, this))
+      {
+        stats.parseErrors.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    else if (type == DccFrame::DIAG)
+    {
+      stats.diags.fetch_add(1, std::memory_order_relaxed);
+    }
+    console.print(type, frame); });
+}
+
+/**
+ * @brief Reciever callback; the chunk is parsed in place and printed in one go
+ */
+void DccTransport::recieve(const char *data, size_t len)
+{
+  stats.reads.fetch_add(1, std::memory_order_relaxed);
+  stats.bytesIn.fetch_add(len, std::memory_order_relaxed);
+  if (DccCapture::active())
+  {
+    DccCapture::record(this, DccCaptureType::IN, data, len);
+  }
+  if (parser.parse(data, len) > 0)
+  {
+    stats.parseErrors.fetch_add(1, std::memory_order_relaxed);
+  }
+  console.flush(); // Flush screen buffer
+}
+
+void DccTransport::send(const char *data, size_t len)
+{
+  if (DccCapture::active())
+  {
+    DccCapture::record(this, DccCaptureType::OUT, data, len);
+  }
+  transmit(data, len);
+  stats.writes.fetch_add(1, std::memory_order_relaxed);
+  stats.bytesOut.fetch_add(len, std::memory_order_relaxed);
+  stats.commands.fetch_add(std::count(data, data + len, '<'), std::memory_order_relaxed);
+
+  // only the writing thread raises the mark; a relaxed load and store are enough
+  uint64_t q = queued();
+  if (q > stats.queueHighWater.load(std::memory_order_relaxed))
+  {
+    stats.queueHighWater.store(q, std::memory_order_relaxed);
+  }
+}
+
+void DccTransport::roundTrip(const void *source, std::chrono::nanoseconds rtt)
+{
+  if (source == nullptr)
+  {
+    return;
+  }
+  // the request table only keeps the address; the transport is alive while it recieves
+  const_cast<DccTransport *>(static_cast<const DccTransport *>(source))->stats.roundTrip.record(rtt);
+}
+
+void DccTransport::flush(const void *source)
+{
+  if (source == nullptr)
+  {
+    return;
+  }
+  auto t = const_cast<DccTransport *>(static_cast<const DccTransport *>(source));
+  if (t->state.load(std::memory_order_acquire) == DccLinkState::OPEN)
+  {
+    t->flushLink();
+  }
+}
+
+void DccTransportStats::reset()
+{
+  bytesIn = 0;
+  bytesOut = 0;
+  reads = 0;
+  writes = 0;
+  frames = 0;
+  diags = 0;
+  commands = 0;
+  parseErrors = 0;
+  queueHighWater = 0;
+  reconnects = 0;
+  roundTrip.reset();
+}
+
+nlohmann::json DccTransportStats::toJson() const
+{
+  return {
+      {"bytesIn", bytesIn.load()},
+      {"bytesOut", bytesOut.load()},
+      {"reads", reads.load()},
+      {"writes", writes.load()},
+      {"framesIn", frames.load() + diags.load()},
+      {"framesOut", commands.load()},
+      {"replies", frames.load()},
+      {"diags", diags.load()},
+      {"parseErrors", parseErrors.load()},
+      {"writeQueueHighWater", queueHighWater.load()},
+      {"reconnects", reconnects.load()},
+      {"roundTripUs", {{"count", roundTrip.count()},
+                       {"mean", roundTrip.mean()},
+                       {"p50", roundTrip.percentile(0.5)},
+                       {"p90", roundTrip.percentile(0.9)},
+                       {"p99", roundTrip.percentile(0.99)},
+                       {"p999", roundTrip.percentile(0.999)},
+                       {"max", roundTrip.max()}}}};
+}
+
+void DccTransport::write(const char *data, size_t len, const std::vector<uint64_t> &requests)
+{
+  // the write queues of the backends take one producer at a time; retry() sends from the
+  // supervisor thread under the same lock
+  std::lock_guard<std::mutex> l(linkMutex);
+  if (state == DccLinkState::RECONNECTING)
+  {
+    if (backlog.size() >= DCC_RECONNECT_BACKLOG)
+    {
+      auto s = fmt::format("Connection {} is down; {} commands are waiting already.", describe(), backlog.size());
+      throw ShellCmdExecException(s);
+    }
+    backlog.emplace_back(std::string(data, len), requests);
+    return;
+  }
+  if (!isOpen())
+  {
+    auto s = fmt::format("Connection {} is closed, please call open first.", describe());
+    throw ShellCmdExecException(s);
+  }
+  send(data, len);
+}
+
+void DccTransport::close()
+{
+  {
+    std::lock_guard<std::mutex> l(linkMutex);
+    state = DccLinkState::CLOSED;
+    backlog.clear();
+  }
+  std::lock_guard<std::mutex> r(reconnectMutex); // lets a reconnect in progress finish first
+  closeLink();
+}
+
+void DccTransport::linkDown(const std::string &reason)
+{
+  auto expected = DccLinkState::OPEN;
+  if (!state.compare_exchange_strong(expected, DccLinkState::RECONNECTING))
+  {
+    return; // closed or already reconnecting e.g. the read and the write failed
+  }
+  // no lock; retry() doesn't run before the schedule below
+  lostAt = std::chrono::steady_clock::now();
+  attempts = 0;
+  WARN("Lost connection {} ({}); reconnecting", describe(), reason);
+  DccSupervisor::schedule(weak_from_this(), backoff());
+}
+
+/**
+ * @brief Exponential backoff with up to a quarter of jitter so several connections
+ * lost at the same time don't retry in lockstep
+ */
+std::chrono::milliseconds DccTransport::backoff()
+{
+  static thread_local std::mt19937 rng{std::random_device{}()};
+  std::uniform_real_distribution<double> jitter(0.75, 1.0);
+
+  auto d = std::min<double>(DCC_RECONNECT_MAX, DCC_RECONNECT_INITIAL * static_cast<double>(1u << std::min(attempts, 16u)));
+  return std::chrono::milliseconds(std::max<long>(1, static_cast<long>(d * jitter(rng))));
+}
+
+std::chrono::milliseconds DccTransport::retry()
+{
+  // the reconnect can take up to the connect timeout; writes only need linkMutex and go to
+  // the backlog in the meantime
+  std::lock_guard<std::mutex> r(reconnectMutex);
+  {
+    std::lock_guard<std::mutex> l(linkMutex);
+    if (state != DccLinkState::RECONNECTING)
+    {
+      return std::chrono::milliseconds(0);
+    }
+  }
+
+  attempts++;
+  bool up = false;
+  parser.reset(); // drop whatever was half recieved on the old connection
+  try
+  {
+    up = reconnect();
+  }
+  catch (const std::exception &e)
+  {
+    DBG("Reconnecting {} failed: {}", describe(), e.what());
+  }
+
+  std::lock_guard<std::mutex> l(linkMutex);
+  if (state != DccLinkState::RECONNECTING)
+  {
+    return std::chrono::milliseconds(0); // closed while reconnecting; close() takes it down again
+  }
+  if (!up)
+  {
+    if (attempts % 10 == 0)
+    {
+      WARN("Still trying to reconnect {} ({} attempts)", describe(), attempts);
+    }
+    return backoff();
+  }
+
+  // commands which may have been lost with the connection; a request registered before the
+  // loss but written after it is in the backlog already and is send from there. What the
+  // backend hadn't sent yet goes out again as it was written, with the commands nobody waits
+  // for; a request found in there isn't replayed on its own
+  std::vector<uint64_t> queued;
+  for (auto &b : backlog)
+  {
+    queued.insert(queued.end(), b.second.begin(), b.second.end());
+  }
+  auto left = unsent();
+  auto search = left;
+  size_t resent = 0;
+  for (auto &u : DccRequest::unacknowledged(this, lostAt))
+  {
+    if (std::find(queued.begin(), queued.end(), u.first) != queued.end())
+    {
+      continue;
+    }
+    auto pos = search.find(u.second);
+    if (pos != std::string::npos)
+    {
+      search.erase(pos, u.second.size());
+      continue;
+    }
+    send(u.second.data(), u.second.size());
+    resent++;
+  }
+  if (!left.empty())
+  {
+    send(left.data(), left.size());
+    resent++;
+  }
+  for (auto &b : backlog)
+  {
+    send(b.first.data(), b.first.size());
+  }
+  resent += backlog.size();
+  backlog.clear();
+
+  stats.reconnects.fetch_add(1, std::memory_order_relaxed);
+  state = DccLinkState::OPEN;
+
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lostAt).count();
+  INFO("Reconnected {} after {} ms; {} writes resent", describe(), ms, resent);
+  return std::chrono::milliseconds(0);
+}
+
+std::shared_ptr<DccTransport> DccTransportRegistry::open(const std::string &s)
+{
+  DccUri uri;
+  if (!DccUri::parse(s, uri))
+  {
+    auto e = fmt::format("[{}] is not a valid connection; expected e.g. serial:///dev/ttyACM0 or tcp://10.0.0.5:2560", s);
+    throw ShellCmdExecException(e);
+  }
+
+  auto f = _factories.find(uri.scheme);
+  if (f == _factories.end())
+  {
+    auto e = fmt::format("Unknown connection type: [{}]", uri.scheme);
+    throw ShellCmdExecException(e);
+  }
+
+  auto transport = f->second();
+  DBG("Opening {}", uri.text);
+  if (!transport->open(uri))
+  {
+    return nullptr;
+  }
+  transport->state = DccLinkState::OPEN;
+  return transport;
+}
@@ -0,0 +1,227 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class DccTransport
+ * @brief Common interface of all connections to the commandstation ( serial, tcp, mqtt ... ).
+ * A transport opens from an URI, writes asynchronously and hands whatever it reads to
+ * recieve() which runs the frame parser owned by the transport. Transports are created
+ * through the DccTransportRegistry by the scheme of the URI e.g.
+ *  - serial:///dev/ttyACM0?baud=115200
+ *  - tcp://10.0.0.5:2560
+ *  - mqtt://test.mosquitto.org:1883
+ * so new backends only need to be registered and don't touch the command execution.
+ * When an open connection fails the transport goes to RECONNECTING and DccSupervisor reopens
+ * it with a jittered exponential backoff. Commands written in the meantime are kept and send
+ * after the reconnect together with the commands still waiting for a reply ( see DccRequest ).
+ * @author grbba
+ */
+
+#ifndef DccTransport_h
+#define DccTransport_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <nlohmann/json_fwd.hpp>
+
+#include "DccFrameParser.hpp"
+#include "DccHistogram.hpp"
+
+struct DccUri
+{
+  std::string text;       // as given
+  std::string scheme;     // serial, tcp, mqtt ...
+  std::string host;
+  std::string port;
+  std::string path;       // device for serial
+  std::map<std::string, std::string> query;
+
+  /**
+   * @brief Splits scheme://host:port/path?key=value&key=value
+   * @return false if there is no scheme
+   */
+  static bool parse(const std::string &s, DccUri &uri);
+
+  std::string get(const std::string &key, const std::string &def = "") const
+  {
+    auto it = query.find(key);
+    return it == query.end() ? def : it->second;
+  }
+
+  /**
+   * @throws ShellCmdExecException if the value isn't a number
+   */
+  int getInt(const std::string &key, int def) const;
+};
+
+#define DCC_RECONNECT_INITIAL 20   // ms before the first reconnect attempt
+#define DCC_RECONNECT_MAX 5000     // ms; upper bound of the backoff
+#define DCC_RECONNECT_BACKLOG 256  // commands kept while reconnecting
+
+enum class DccLinkState
+{
+  CLOSED,
+  OPEN,
+  RECONNECTING
+};
+
+struct DccTransportStats
+{
+  std::atomic<uint64_t> bytesIn{0};
+  std::atomic<uint64_t> bytesOut{0};
+  std::atomic<uint64_t> reads{0};     // chunks recieved
+  std::atomic<uint64_t> writes{0};
+  std::atomic<uint64_t> frames{0};    // <...> replies
+  std::atomic<uint64_t> diags{0};     // <* ... *> messages
+  std::atomic<uint64_t> commands{0};  // <...> commands send
+  std::atomic<uint64_t> parseErrors{0}; // replies which couldn't be decoded and garbage dropped by the parser
+  std::atomic<uint64_t> queueHighWater{0}; // most bytes seen in the write queue
+  std::atomic<uint64_t> reconnects{0};
+  DccHistogram roundTrip;             // us from sending a command to its reply
+
+  void reset();
+  nlohmann::json toJson() const;
+};
+
+class DccTransport : public std::enable_shared_from_this<DccTransport>
+{
+private:
+  DccFrameParser parser;              // one per transport; only used from the reading thread
+  DccFrameConsole console;
+
+  std::atomic<DccLinkState> state{DccLinkState::CLOSED};
+  std::mutex linkMutex;               // state changes, the backlog and sending; never held while connecting
+  std::mutex reconnectMutex;          // a reconnect in progress; close waits for it
+  std::vector<std::pair<std::string, std::vector<uint64_t>>> backlog; // written while reconnecting with the ids of its requests
+  std::chrono::steady_clock::time_point lostAt;
+  unsigned int attempts = 0;
+
+  std::chrono::milliseconds backoff();
+  void send(const char *data, size_t len); // transmit, count and capture
+
+protected:
+  DccTransportStats stats;
+
+  /**
+   * @brief To be called by the backend when the open connection fails; starts the reconnects
+   */
+  void linkDown(const std::string &reason);
+
+  /**
+   * @brief Reopens the connection with the settings of the last open; called by DccSupervisor
+   * @return true if the connection is up again
+   */
+  virtual bool reconnect() = 0;
+  virtual void closeLink() = 0;
+
+  /**
+   * @brief Called by the backend with every chunk read from the connection
+   */
+  void recieve(const char *data, size_t len);
+
+  /**
+   * @brief Queues the data for writing; must not block on the connection
+   */
+  virtual void transmit(const char *data, size_t len) = 0;
+  virtual size_t queued() { return 0; } // bytes waiting in the write queue of the backend
+  virtual void flushLink() {}           // send what the backend holds back for coalescing
+
+  /**
+   * @brief Takes what the backend had queued but not sent when the connection was lost;
+   * called once after the reconnect so it goes out again through write's single path
+   */
+  virtual std::string unsent() { return std::string(); }
+
+public:
+  virtual bool open(const DccUri &uri) = 0;
+  virtual bool isOpen() = 0;
+  virtual std::string describe() = 0;   // URI of the connection
+
+  void close();                         // stops reconnecting and closes the connection
+  DccLinkState getState() const { return state; }
+
+  /**
+   * @brief One reconnect attempt; on success the unacknowledged commands and the backlog are send
+   * @return the delay until the next attempt; 0 if there is nothing more to do
+   */
+  std::chrono::milliseconds retry();
+
+  /**
+   * @brief Writes to the connection or keeps the data while reconnecting
+   * @param requests ids of the DccRequests the data carries; they aren't replayed twice
+   */
+  void write(const char *data, size_t len, const std::vector<uint64_t> &requests = {});
+  void write(std::string_view data, const std::vector<uint64_t> &requests = {}) { write(data.data(), data.size(), requests); }
+
+  const DccTransportStats &getStats() const { return stats; }
+  void resetStats() { stats.reset(); }
+
+  /**
+   * @brief Records the round trip of a command; called by DccRequest when the reply came in
+   * @param source the transport the reply has been recieved on
+   */
+  static void roundTrip(const void *source, std::chrono::nanoseconds rtt);
+
+  /**
+   * @brief Sends the commands held back for coalescing right away; called by DccRequest before
+   * waiting for a reply so only commands nobody waits for are delayed
+   */
+  static void flush(const void *source);
+
+  friend class DccTransportRegistry;
+
+  DccTransport();
+  virtual ~DccTransport() = default;
+};
+
+typedef std::function<std::shared_ptr<DccTransport>()> DccTransportFactory;
+
+class DccTransportRegistry
+{
+private:
+  static std::map<std::string, DccTransportFactory> _factories;
+
+public:
+  static void add(const std::string &scheme, DccTransportFactory factory)
+  {
+    _factories.insert({scheme, factory});
+  }
+
+  /**
+   * @brief Creates the transport for the scheme of the uri and opens it
+   * @throws ShellCmdExecException if the uri can't be parsed or the scheme is unknown
+   * @return the open transport or nullptr if the connection failed
+   */
+  static std::shared_ptr<DccTransport> open(const std::string &uri);
+
+  DccTransportRegistry() = default;
+  ~DccTransportRegistry() = default;
+};
+
+#endif
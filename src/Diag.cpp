@@ -1,5 +1,9 @@
 
 #include <stack>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/sinks/rotating_file_sink.h>
+#include <spdlog/sinks/dist_sink.h>
+#include <spdlog/pattern_formatter.h>
 #include "Diag.hpp"
 // inital Logging Level
 
@@ -8,7 +12,46 @@ spdlog::level::level_enum Diag::_nLogLevel = LOGV_ERROR;    // default loglevel
 bool Diag::fileInfo = true;
 bool Diag::println = true;
 bool Diag::printLabel = true;
+bool Diag::color = true;
 std::stack<DiagConfig *> Diag::config;
+std::shared_ptr<spdlog::details::thread_pool> Diag::_pool;
+spdlog::sink_ptr Diag::_console;
+std::shared_ptr<spdlog::sinks::dist_sink_mt> Diag::_sinks;
+
+#define DIAG_PATTERN "[%Y-%m-%d %H:%M:%S.%e] [%^%l%$] %v" // spdlog's default without the logger name
+#define DIAG_PATTERN_FILEINFO "[%Y-%m-%d %H:%M:%S.%e] [%^%l%$] [%s:%#] %v"
+
+/**
+ * @brief %j : the message escaped as a JSON string (without the quotes)
+ */
+class DiagJsonMessage : public spdlog::custom_flag_formatter
+{
+public:
+    void format(const spdlog::details::log_msg &msg, const std::tm &, spdlog::memory_buf_t &dest) override
+    {
+        auto payload = msg.payload;
+        for (auto c : payload) {
+            switch (c) {
+            case '"':  dest.append(std::string_view("\\\"")); break;
+            case '\\': dest.append(std::string_view("\\\\")); break;
+            case '\n': dest.append(std::string_view("\\n")); break;
+            case '\r': dest.append(std::string_view("\\r")); break;
+            case '\t': dest.append(std::string_view("\\t")); break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    fmt::format_to(std::back_inserter(dest), "\\u{:04x}", static_cast<unsigned int>(c));
+                } else {
+                    dest.push_back(c);
+                }
+            }
+        }
+    }
+
+    std::unique_ptr<custom_flag_formatter> clone() const override
+    {
+        return spdlog::details::make_unique<DiagJsonMessage>();
+    }
+};
 
 const std::map<std::string, DiagLevel> Diag::diagMapStr
 {
@@ -46,6 +89,92 @@ const DiagLevel Diag::getDiagLevel(std::string level) {
     return diagMapStr.find(level)->second;
 }
 
+void Diag::setColor(bool value) {
+    color = value;
+    auto mode = value ? spdlog::color_mode::automatic : spdlog::color_mode::never;
+    auto sinks = _console ? std::vector<spdlog::sink_ptr>{_console} : spdlog::default_logger()->sinks();
+    for (auto &sink : sinks) {
+        auto cs = std::dynamic_pointer_cast<spdlog::sinks::stdout_color_sink_mt>(sink);
+        if (cs) {
+            cs->set_color_mode(mode);
+        }
+    }
+}
+
+void Diag::setFileInfo(bool value) {
+    fileInfo = value;
+    if (_console) {
+        _console->set_pattern(value ? DIAG_PATTERN_FILEINFO : DIAG_PATTERN);
+    }
+}
+
+void Diag::setup(size_t queueSize, spdlog::async_overflow_policy policy) {
+    if (_pool) {
+        return;
+    }
+    _pool = std::make_shared<spdlog::details::thread_pool>(queueSize, 1);
+    auto console = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+    console->set_color_mode(color ? spdlog::color_mode::automatic : spdlog::color_mode::never);
+    console->set_pattern(fileInfo ? DIAG_PATTERN_FILEINFO : DIAG_PATTERN);
+    _console = console;
+    _sinks = std::make_shared<spdlog::sinks::dist_sink_mt>(std::vector<spdlog::sink_ptr>{_console});
+
+    // the logger is never replaced while the io threads are running as they log through a raw
+    // pointer to it; sinks are changed on the distributing sink instead
+    auto logger = std::make_shared<spdlog::async_logger>("dcccli", _sinks, _pool, policy);
+    logger->set_level(spdlog::default_logger()->level());
+    logger->flush_on(spdlog::level::warn);
+    spdlog::set_default_logger(logger);
+    spdlog::flush_every(std::chrono::seconds(1)); // files are only flushed on warnings otherwise
+}
+
+void Diag::setSink(DiagSink sink, const std::string &file) {
+    if (!_pool) {
+        setup();
+    }
+    switch (sink) {
+    case DiagSink::CONSOLE:
+        _sinks->set_sinks({_console});
+        break;
+    case DiagSink::FILE:
+    {
+        auto f = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(file.empty() ? "dcccli.log" : file, DIAG_FILE_SIZE, DIAG_FILE_COUNT);
+        f->set_pattern(DIAG_PATTERN_FILEINFO);
+        _sinks->set_sinks({_console, f});
+        break;
+    }
+    case DiagSink::JSON:
+    {
+        auto f = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(file.empty() ? "dcccli.jsonl" : file, DIAG_FILE_SIZE, DIAG_FILE_COUNT);
+        auto formatter = std::make_unique<spdlog::pattern_formatter>();
+        formatter->add_flag<DiagJsonMessage>('j').set_pattern(
+            "{\"time\":\"%Y-%m-%dT%H:%M:%S.%f%z\",\"level\":\"%l\",\"thread\":%t,\"msg\":\"%j\"}");
+        f->set_formatter(std::move(formatter));
+        _sinks->set_sinks({_console, f});
+        break;
+    }
+    }
+}
+
+size_t Diag::dropped() {
+    return _pool ? _pool->overrun_counter() : 0;
+}
+
+void Diag::shutdown() {
+    if (!_pool) {
+        return;
+    }
+    auto lost = dropped();
+    // anything logged from here on, e.g. from destructors, is written directly
+    auto logger = std::make_shared<spdlog::logger>("dcccli", _sinks);
+    logger->set_level(spdlog::default_logger()->level());
+    spdlog::set_default_logger(logger);
+    _pool.reset(); // joins the logging thread once the queue is written out
+    if (lost > 0) {
+        fmt::print(stderr, "{} log messages have been dropped\n", lost);
+    }
+}
+
 void Diag::push() {
 
     auto *dc = new DiagConfig();
@@ -66,7 +195,7 @@ void Diag::pop() {
     println = dc->println;
     // _nLogLevel = dc->_nLogLevel;
     Diag::setLogLevel(dc->_nLogLevel);
-    fileInfo = dc->fileInfo;
+    setFileInfo(dc->fileInfo);
     printLabel = dc->printLabel;
     config.pop();
     delete dc;
@@ -32,22 +32,77 @@
 #include <iostream>
 #include <stack>
 #include <map>
+#include <vector>
+
+// Log statements below this level are compiled out; set by DCCCLI_LOG_LEVEL in cmake
+#ifndef SPDLOG_ACTIVE_LEVEL
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
 
 #include <fmt/core.h>
 #include <fmt/color.h>
 #include <spdlog/spdlog.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/dist_sink.h>
 
 #define DCC_SUCCESS 1
 #define DCC_FAILURE 0
 
+#define DIAG_QUEUE_SIZE 8192              // log messages waiting for the logging thread
+#define DIAG_FILE_SIZE (5 * 1024 * 1024)  // log files are rotated at this size
+#define DIAG_FILE_COUNT 3                 // rotated log files kept
+
 typedef spdlog::level::level_enum DiagLevel;
 
-#define INFO spdlog::info
-#define ERR spdlog::error
-#define WARN spdlog::warn
-#define DBG spdlog::debug
-#define TRC spdlog::trace // highest logging level
-#define CRITICAL spdlog::critical // This is always shown excpet when the log level is set to off
+/**
+ * The arguments are only evaluated if the message passes the runtime level, so e.g. a
+ * DBG("{}", s.str()) costs a level check when debugging is off. Levels below
+ * SPDLOG_ACTIVE_LEVEL don't generate any code.
+ */
+#define DIAG_LOG(logmacro, level, ...)                               \
+  do                                                                 \
+  {                                                                  \
+    auto *diagLogger = spdlog::default_logger_raw();                 \
+    if (diagLogger->should_log(level))                               \
+      logmacro(diagLogger, __VA_ARGS__);                             \
+  } while (0)
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_TRACE
+#define TRC(...) DIAG_LOG(SPDLOG_LOGGER_TRACE, spdlog::level::trace, __VA_ARGS__) // highest logging level
+#else
+#define TRC(...) (void)0
+#endif
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define DBG(...) DIAG_LOG(SPDLOG_LOGGER_DEBUG, spdlog::level::debug, __VA_ARGS__)
+#else
+#define DBG(...) (void)0
+#endif
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_INFO
+#define INFO(...) DIAG_LOG(SPDLOG_LOGGER_INFO, spdlog::level::info, __VA_ARGS__)
+#else
+#define INFO(...) (void)0
+#endif
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_WARN
+#define WARN(...) DIAG_LOG(SPDLOG_LOGGER_WARN, spdlog::level::warn, __VA_ARGS__)
+#else
+#define WARN(...) (void)0
+#endif
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_ERROR
+#define ERR(...) DIAG_LOG(SPDLOG_LOGGER_ERROR, spdlog::level::err, __VA_ARGS__)
+#else
+#define ERR(...) (void)0
+#endif
+
+// This is always shown excpet when the log level is set to off
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_CRITICAL
+#define CRITICAL(...) DIAG_LOG(SPDLOG_LOGGER_CRITICAL, spdlog::level::critical, __VA_ARGS__)
+#else
+#define CRITICAL(...) (void)0
+#endif
 
 
 #define LOGV_SILENT DiagLevel::off
@@ -57,7 +112,14 @@ typedef spdlog::level::level_enum DiagLevel;
 #define LOGV_TRACE DiagLevel::trace
 #define LOGV_DEBUG DiagLevel::debug
 
-#define CLI_INFO fmt::print("[");fmt::print(fg(fmt::color::medium_turquoise),"DccCli");fmt::print("] "); 
+#define CLI_INFO fmt::print("[");fmt::print(Diag::style(fg(fmt::color::medium_turquoise)),"DccCli");fmt::print("] "); 
+
+enum class DiagSink
+{
+  CONSOLE, // console only; drops a file sink
+  FILE,    // console and a rotating log file
+  JSON     // console and a rotating file with one JSON object per line
+};
 
 struct DiagConfig
 {
@@ -79,10 +141,15 @@ private:
   static bool fileInfo;
   static bool println;
   static bool printLabel;
+  static bool color;
   static const std::map<DiagLevel, std::string> diagMap;
   static const std::map<std::string, DiagLevel> diagMapStr;
   static std::stack<DiagConfig *> config;
 
+  static std::shared_ptr<spdlog::details::thread_pool> _pool;
+  static spdlog::sink_ptr _console;
+  static std::shared_ptr<spdlog::sinks::dist_sink_mt> _sinks; // console and the optional file
+
 public:
   static auto getDiagMap() -> std::map<DiagLevel, std::string>
   {
@@ -105,7 +172,7 @@ public:
 
   static spdlog::level::level_enum getLogLevel() { return _nLogLevel; }
 
-  static void setFileInfo(bool value) { fileInfo = value; }
+  static void setFileInfo(bool value); // adds [file:line] to the messages on the console
   static bool getFileInfo() { return fileInfo; }
 
   static void setPrintln(bool value) { println = value; }
@@ -114,6 +181,33 @@ public:
   static void setPrintLabel(bool value) { printLabel = value; }
   static bool getPrintLabel() { return printLabel; }
 
+  static void setColor(bool value);   // false removes all color escape codes e.g. when running a script
+  static bool getColor() { return color; }
+
+  // style to use for colored output; empty if colors are switched off
+  static fmt::text_style style(fmt::text_style s) { return color ? s : fmt::text_style(); }
+
+  /**
+   * @brief Replaces the default spdlog logger by an asynchronous one. Messages are queued
+   * and written by a logging thread so that e.g. a flood of diag messages recieved on
+   * an io thread doesn't wait for the terminal.
+   *
+   * @param queueSize number of messages the queue holds
+   * @param policy what to do if the queue is full; by default the oldest messages are
+   * dropped so that the caller never blocks
+   */
+  static void setup(size_t queueSize = DIAG_QUEUE_SIZE,
+                    spdlog::async_overflow_policy policy = spdlog::async_overflow_policy::overrun_oldest);
+
+  /**
+   * @brief Selects where the log goes in addition to the console
+   * @throws spdlog::spdlog_ex if the file can't be opened
+   */
+  static void setSink(DiagSink sink, const std::string &file = "");
+
+  static void shutdown();   // writes out what is queued and stops the logging thread; call once the io threads are stopped
+  static size_t dropped();  // messages lost because the queue was full
+
   static void push(); // pushes a Diag Config onto the stack
   static void pop();  // pops the last diagConfig from the stack and
                       // reinstatiates its values;
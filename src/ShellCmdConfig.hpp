@@ -42,17 +42,22 @@ const std::string rootMenuItems = R"(
         "name": "use",
         "params": 
         [
-          { "type": "string", "desc": "serial|ethernet", "mandatory": 1 }
+          { "type": "string", "desc": "name", "mandatory": 0 }
         ],
         "help": [ "Allows to set the active connection in case serial and a etehrnet connection have been opened.",
-                  "\tThe last opened connection will be the active one\n"
+                  "\tThe last opened connection will be the active one. Connections opened without a name",
+                  "\tare called serial, ethernet or mqtt. Without a name the open connections are listed.",
+                  "\tA single command can be send to another connection with @<name> <command>",
+                  "\te.g. '@yard status'\n"
                 ]
       },
       {
         "name": "loglevel",
         "params": 
         [
-          { "type": "string", "desc": "silent|info|trace|debug", "mandatory": 1 }
+          { "type": "string", "desc": "silent|info|trace|debug", "mandatory": 1 },
+          { "type": "string", "desc": "console|file|json", "mandatory": 0 },
+          { "type": "string", "desc": "file", "mandatory": 0 }
         ],
         "help": [ 
           "Sets the logging level of the commandline interface to one of the following values",
@@ -60,6 +65,11 @@ const std::string rootMenuItems = R"(
           "\t- info: some more basic information will be shown",
           "\t- trace: more detailed information on the execution of various commands",
           "\t- debug: full debugging information. This can be extremly verbose use with care",
+          "\tThe log can also be written to a file which is rotated at 5MB:",
+          "\t- file: as shown on the console, by default to dcccli.log",
+          "\t- json: one JSON object per line, by default to dcccli.jsonl",
+          "\t- console: stops writing to the file",
+          "\te.g. 'loglevel info json diag.jsonl'",
           "\tFor commandstation diagnostics use diag in the cs menu\n"
           ]
       },
@@ -67,22 +77,82 @@ const std::string rootMenuItems = R"(
         "name": "mqtt",
         "params": 
         [
-          { "type": "string", "desc": "broker|subscribe", "mandatory": 1 },
-          { "type": "string", "desc": "domain|topic", "mandatory": 0 },
-          { "type": "string", "desc": "port", "mandatory": 0 }
+          { "type": "string", "desc": "broker|subscribe|publish", "mandatory": 1 },
+          { "type": "string", "desc": "domain|station|session", "mandatory": 0 },
+          { "type": "string", "desc": "port|interval", "mandatory": 0 }
         ],
         "help": [ 
-            "open a mqtt connection to the broker e.g. test.mosqitto.org or localhost",
-            "\tif the mqtt broker is on the same machine as the cli is executed or the",
-            "\tIP address of the broker;",
+            "open a mqtt connection to the broker; localhost if none is given i.e. a broker",
+            "\ton the same machine as the cli e.g. mosquitto or dcccli-broker, otherwise the",
+            "\tdomain or IP address of the broker;",
             "\tPort of the mqtt broker to connect to. The default port is 1883. For example:",
-            "\t- 'mqtt broker test.mosquitto.org 1883' will connect you to the the test",
-            "\tbroker of the mosquitto project. TLS/SSL is not yet supported.",
-            "\t- 'mqtt subscribe test' will subscribe the cli to the topic 'test' on the broker.",
-            "\tIn order to communicate with the command station you need to subscribe to the clientId shown",
-            "\twhen connecting over the serial line to the command station.",
+            "\t- 'mqtt broker 192.168.1.10 1883' will connect you to the broker on that machine.",
+            "\tTLS/SSL is not yet supported.",
+            "\t- 'mqtt subscribe <station>' sends the commands to the station with that id on the broker;",
+            "\tcommands are published to dcc/<station>/cmd and the replies are read from dcc/<station>/reply.",
+            "\tThe station can also be given when opening e.g. 'open mqtt://localhost/layout1?qos=1'.",
+            "\t- 'mqtt publish <session> [ms]' publishes the state the current session reports as retained",
+            "\tmessages through the mqtt session on dcc/<station>/power, turnout/<id>, sensor/<id>, output/<id>",
+            "\tand loco/<cab>; only changes and one object at most every ms (default 100). 'mqtt publish off' stops.",
             "\n"
         ]
+      },
+      {
+        "name": "batch",
+        "params": 
+        [
+          { "type": "string", "desc": "begin|commit|abort", "mandatory": 1 },
+          { "type": "integer", "desc": "window", "mandatory": 0 }
+        ],
+        "help": [ 
+            "Pipelines commands to the commandstation.",
+            "\t- begin: commands issued after begin are collected instead of being send",
+            "\t- commit: sends the collected commands. Up to <window> commands (default 8) are",
+            "\t  send in one write and wait for their reply at the same time; each reply lets the next",
+            "\t  command go. A summary of the replies, failures and timeouts is shown at the end",
+            "\t- abort: drops the collected commands\n"
+        ]
+      },
+      {
+        "name": "capture",
+        "params": 
+        [
+          { "type": "string", "desc": "start|stop", "mandatory": 1 },
+          { "type": "string", "desc": "file", "mandatory": 0 }
+        ],
+        "help": [ 
+            "Records the traffic with the commandstation in both directions with timestamps",
+            "\t- start <file>: writes everything send and recieved on any connection to file",
+            "\t- stop: closes the file and shows what has been captured",
+            "\tThe file is binary; use replay to look at it\n"
+        ]
+      },
+      {
+        "name": "replay",
+        "params": 
+        [
+          { "type": "string", "desc": "file", "mandatory": 1 },
+          { "type": "string", "desc": "real|max", "mandatory": 0 }
+        ],
+        "help": [ 
+            "Replays a capture through the parser",
+            "\t- real: with the original timing, showing the replies and diags as they came in; the default",
+            "\t- max: as fast as possible without output; shows the throughput of the parser\n"
+        ]
+      },
+      {
+        "name": "stats",
+        "params": 
+        [
+          { "type": "string", "desc": "show|json|reset", "mandatory": 0 },
+          { "type": "string", "desc": "file", "mandatory": 0 }
+        ],
+        "help": [ 
+            "Shows the traffic counters and the round trip times of the commands per connection",
+            "\t- show: as a table; the default",
+            "\t- json [file]: as json on the console or written to file",
+            "\t- reset: sets all counters to 0\n"
+        ]
       }
     ]
   }
@@ -125,15 +195,21 @@ const std::string csMenuItems = R"(
         "name": "open",
         "params": 
         [
-          { "type": "string", "desc": "serial|ethernet", "mandatory": 1 },
-          { "type": "string", "desc": "serial port|ip address", "mandatory": 1 },
-          { "type": "integer", "desc": "baud", "mandatory": 0 }
+          { "type": "string", "desc": "serial|ethernet|uri", "mandatory": 1 },
+          { "type": "string", "desc": "serial port|ip address", "mandatory": 0 },
+          { "type": "string", "desc": "baud|port|name", "mandatory": 0 }
         ],
         "help": [ 
             "open <serial|ethernet> <port> <baud>; If serial indicate the used USB",
             "\tport and for ethernet indicate the IP address of the commandstation",
             "\tbaud will be ignored for ethernet and, if not specified for serial,",
-            "\tthe default of 115200 will be used.\n"
+            "\tthe default of 115200 will be used.",
+            "\tThe connection can also be given as uri e.g. serial:///dev/ttyACM0?baud=115200",
+            "\tor tcp://10.0.0.5:2560 followed by a name for the connection e.g.",
+            "\t'open tcp://10.0.0.5:2560 yard'. See use for switching between connections.",
+            "\tNetwork connections are opened in the background; the prompt comes back right",
+            "\taway and the connection becomes the active one once it is up, within the",
+            "\ttimeout of the uri (3000ms by default for tcp). In a script open waits for it.\n"
         ]
       },
       {
@@ -41,6 +41,11 @@
 #include "DccShellCmd.hpp"
 #include "DccSerial.hpp"
 #include "DccConfig.hpp"
+#include "DccRequest.hpp"
+#include "DccBatch.hpp"
+#include "DccCapture.hpp"
+#include "DccSession.hpp"
+#include "DccLayoutCache.hpp"
 #include "ShellCmdExec.hpp"
 
 using namespace std::this_thread;     // sleep_for, sleep_until
@@ -134,73 +139,99 @@ std::string exec(const char *cmd)
 }
 
 /**
- * @brief send a the command to the commandstation over the active connection (serial or ethernet)
- * ! There is only one connection per type now i.e. serial / ethernet
- * ! as there can be multiple interfaces on the this should be chnaged to support multiple onnections esp for ethernet
+ * @brief the connection commands go to i.e. the session given with @name or the active one
+ */
+static std::shared_ptr<DccTransport> currentConnection()
+{
+    auto c = DccSession::current();
+    if (!c)
+    {
+        auto s = fmt::format("No active connection to the commandstation. Open serial or network connection first.");
+        throw ShellCmdExecException(s);
+    }
+    return c;
+}
+
+// a motorshield setup is waiting in the open batch; the commands after it go through
+static bool batchMshield = false;
+
+/**
+ * @brief send a the command to the commandstation over the active connection
+ * The reply expected for the command is registered before writing so it can't be missed.
  *
  * @param cmd The command in DCC++ EX format to be send to the commandstation
+ * @return the pending reply; use DccRequest::wait to get the reply
  */
-void sendCmd(const std::string csCmd)
+DccPendingReply sendCmd(const std::string csCmd)
 {
     DBG("Sending: {}", csCmd);
-    if (DccConfig::mshield == NOT_CONFIGURED && DccConfig::setMshield == false)
+    if (DccConfig::mshield == NOT_CONFIGURED && DccConfig::setMshield == false && !(DccBatch::isOpen() && batchMshield))
     {
         auto s = fmt::format("No Motorshield has been configured. Call mshield -s <sid> first.");
         throw ShellCmdExecException(s);
-        return;
     }
-    // check for the active Connection
-    switch (DccConfig::active)
-    {
-    case DCC_SERIAL:
+
+    if (DccBatch::isOpen())
     {
-        DBG("Sending over serial");
-        if (DccConfig::serial.isOpen())
-        {
-            DccConfig::serial.write(&csCmd);
-        }
-        else
-        {
-            auto s = fmt::format("Serial port is closed, please call open first.");
-            throw ShellCmdExecException(s);
-        }
-        break;
+        // will be send on batch commit
+        DccBatch::add(csCmd);
+        return DccRequest::completed();
     }
-    case DCC_ETHERNET:
+
+    auto connection = currentConnection();
+    auto pending = DccRequest::expect(csCmd, connection.get());
+    try
     {
-        DBG("Sending over ethernet");
-        if (DccConfig::ethernet.isOpen())
-        {
-            DccConfig::ethernet.write(&csCmd);
-        }
-        else
-        {
-            auto s = fmt::format("Network connection is closed, please call open first.");
-            throw ShellCmdExecException(s);
-        }
-        break;
+        DBG("Sending over {}", connection->describe());
+        connection->write(csCmd, {pending.id});
     }
-    case DCC_MQTT:
+    catch (ShellCmdExecException &ex)
     {
-        DBG("Sending over mqtt");
-        INFO("Sending over MQTT is not yet implemented");
-        break;
+        DccRequest::cancel(pending.id);
+        throw(ex);
     }
-    case DCC_CONN_UNKOWN:
+    return pending;
+}
+
+/**
+ * @brief Waits for the commandstation to answer after the port has been opened. Opening the
+ * port resets the mcu so <s> is repeated until the commandstation is up or the time is over.
+ *
+ * @param connection the port which has just been opened
+ * @param deadline maximum time to wait
+ * @return true if the commandstation replied
+ */
+bool awaitCommandStation(std::shared_ptr<DccTransport> connection, std::chrono::milliseconds deadline)
+{
+    auto until = std::chrono::steady_clock::now() + deadline;
+
+    while (std::chrono::steady_clock::now() < until)
     {
-        auto s = fmt::format("No active connection to the commandstation. Open serial or network connection first.");
-        throw ShellCmdExecException(s);
-        break;
-    }
+        auto pending = DccRequest::expect("<s>", connection.get());
+        connection->write("<s>");
+        auto reply = DccRequest::wait(pending, 1s);
+        if (!reply.timedOut)
+        {
+            return true;
+        }
+        // the mcu is still resetting; a late answer to this probe mustn't be taken for the next one
+        DccRequest::cancel(pending.id);
     }
+    return false;
 }
 
 // Executors
+/**
+ * @brief loglevel <level> [console|file|json] [file]; file and json write the log to a rotating
+ * file in addition to the console, console goes back to the console only
+ */
 static void rootLogLevel(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
 {
     switch (params.size())
     {
     case 1:
+    case 2:
+    case 3:
     {
         auto map = Diag::getDiagMapStr();
         try
@@ -209,12 +240,35 @@ static void rootLogLevel(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::v
             auto it = map.at(params[0]);
             DccConfig::level = it; // replace ev by an observer on the Diag class
             Diag::setLogLevel(it);
+            if (it < SPDLOG_ACTIVE_LEVEL)
+            {
+                WARN("This build only contains {} messages and above", spdlog::level::to_string_view(static_cast<DiagLevel>(SPDLOG_ACTIVE_LEVEL)));
+            }
         }
         catch (std::exception &e)
         {
             auto s = fmt::format("Wrong keyword");
             throw ShellCmdExecException(s);
         }
+        if (params.size() == 1)
+        {
+            break;
+        }
+        const std::map<std::string, DiagSink> sinks{
+            {"console", DiagSink::CONSOLE}, {"file", DiagSink::FILE}, {"json", DiagSink::JSON}};
+        auto sink = sinks.find(params[1]);
+        if (sink == sinks.end())
+        {
+            throw ShellCmdExecException(fmt::format("Unknown log output {}; use console, file or json", params[1]));
+        }
+        try
+        {
+            Diag::setSink(sink->second, params.size() == 3 ? params[2] : "");
+        }
+        catch (const spdlog::spdlog_ex &e)
+        {
+            throw ShellCmdExecException(fmt::format("Can't log to {}: {}", params[2], e.what()));
+        }
         break;
     }
     default:
@@ -226,10 +280,207 @@ static void rootLogLevel(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::v
     }
 }
 
-// For testing only
-// const std::string SERVER_ADDRESS("test.mosquitto.org:1883");
-// const std::string CLIENT_ID("dcccli");
-// const std::string TOPIC("hello");
+/**
+ * @brief capture start <file> | capture stop
+ */
+static void rootCapture(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
+{
+    if (params[0].compare("start") == 0)
+    {
+        if (params.size() != 2)
+        {
+            throw ShellCmdExecException("capture start needs a file");
+        }
+        DccCapture::start(params[1]);
+        INFO("Capturing to {}", params[1]);
+        return;
+    }
+    if (params[0].compare("stop") == 0)
+    {
+        if (!DccCapture::active())
+        {
+            throw ShellCmdExecException("No capture running");
+        }
+        auto file = DccCapture::file();
+        auto s = DccCapture::stop();
+        INFO("Captured {} records ({} bytes) to {}", s.records, s.bytes, file);
+        if (s.dropped > 0)
+        {
+            WARN("{} records have been dropped as the disk didn't keep up", s.dropped);
+        }
+        return;
+    }
+    throw ShellCmdExecException(fmt::format("Unknown capture command {}; use start or stop", params[0]));
+}
+
+/**
+ * @brief replay <file> [real|max]
+ */
+static void rootReplay(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
+{
+    bool realtime = true;
+    if (params.size() == 2)
+    {
+        if (params[1].compare("max") == 0)
+        {
+            realtime = false;
+        }
+        else if (params[1].compare("real") != 0)
+        {
+            throw ShellCmdExecException(fmt::format("Unknown replay speed {}; use real or max", params[1]));
+        }
+    }
+    auto s = DccCapture::replay(params[0], realtime);
+    auto seconds = std::chrono::duration<double>(s.elapsed).count();
+    INFO("Replayed {} records in {:.3f}s (captured over {:.3f}s): {} bytes, {} replies, {} diags",
+         s.records, seconds, std::chrono::duration<double>(s.captured).count(), s.bytes, s.frames, s.diags);
+    if (!realtime && seconds > 0)
+    {
+        INFO("Parser throughput {:.1f} MB/s", s.bytes / seconds / 1e6);
+    }
+}
+
+/**
+ * @brief stats [show|json|reset] [file]
+ */
+static void rootStats(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
+{
+    auto what = params.empty() ? std::string("show") : params[0];
+    auto sessions = DccSession::list();
+
+    if (what.compare("reset") == 0)
+    {
+        for (auto &s : sessions)
+        {
+            s.second->resetStats();
+            if (auto mqtt = std::dynamic_pointer_cast<DccMQTT>(s.second))
+            {
+                mqtt->resetMqttStats();
+            }
+        }
+        INFO("Statistics reset for {} connection(s)", sessions.size());
+        return;
+    }
+    if (what.compare("json") == 0)
+    {
+        nlohmann::json j = nlohmann::json::object();
+        for (auto &s : sessions)
+        {
+            j[s.first] = {{"uri", s.second->describe()}, {"stats", s.second->getStats().toJson()}};
+            if (auto mqtt = std::dynamic_pointer_cast<DccMQTT>(s.second))
+            {
+                j[s.first]["mqtt"] = mqtt->getMqttStats().toJson();
+            }
+        }
+        if (params.size() == 2)
+        {
+            std::ofstream f(params[1]);
+            if (!f)
+            {
+                throw ShellCmdExecException(fmt::format("Can't write to {}", params[1]));
+            }
+            f << j.dump(2) << "\n";
+            INFO("Statistics written to {}", params[1]);
+            return;
+        }
+        out << j.dump(2) << "\n";
+        return;
+    }
+    if (what.compare("show") != 0)
+    {
+        throw ShellCmdExecException(fmt::format("Unknown stats command {}; use show, json or reset", what));
+    }
+    if (sessions.empty())
+    {
+        INFO("No open connections");
+        return;
+    }
+
+    out << fmt::format("{:<12} {:>10} {:>10} {:>8} {:>8} {:>7} {:>6} {:>6} {:>7} {:>5} {:>8} {:>8} {:>8} {:>8}\n",
+                       "session", "bytes in", "bytes out", "replies", "diags", "cmds", "errors", "queue",
+                       "reconn", "", "rtt p50", "p99", "max", "count");
+    for (auto &s : sessions)
+    {
+        auto &st = s.second->getStats();
+        out << fmt::format("{:<12} {:>10} {:>10} {:>8} {:>8} {:>7} {:>6} {:>6} {:>7} {:>5} {:>8} {:>8} {:>8} {:>8}\n",
+                           s.first, st.bytesIn.load(), st.bytesOut.load(), st.frames.load(), st.diags.load(),
+                           st.commands.load(), st.parseErrors.load(), st.queueHighWater.load(),
+                           st.reconnects.load(), "us", st.roundTrip.percentile(0.5), st.roundTrip.percentile(0.99),
+                           st.roundTrip.max(), st.roundTrip.count());
+    }
+    for (auto &s : sessions)
+    {
+        if (auto mqtt = std::dynamic_pointer_cast<DccMQTT>(s.second))
+        {
+            auto &m = mqtt->getMqttStats();
+            out << fmt::format("{:<12} mqtt: {} publishes ({} packed, {} failed, window {}), {} states, delivery p50 {}us p99 {}us max {}us\n",
+                               s.first, m.publishes.load(), m.packed.load(), m.failed.load(), mqtt->getWindow(), m.states.load(),
+                               m.delivery.percentile(0.5), m.delivery.percentile(0.99), m.delivery.max());
+        }
+    }
+}
+
+/**
+ * @brief batch begin|commit|abort [window]; between begin and commit commands are collected
+ * and then pipelined to the commandstation on commit
+ */
+static void rootBatch(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
+{
+    if (params[0].compare("begin") == 0)
+    {
+        if (!DccBatch::isOpen())
+            batchMshield = false;
+        DccBatch::begin();
+        INFO("Collecting commands until batch commit");
+        return;
+    }
+    if (params[0].compare("abort") == 0)
+    {
+        INFO("Dropping {} batched commands", DccBatch::size());
+        DccBatch::abort();
+        batchMshield = false;
+        return;
+    }
+    if (params[0].compare("commit") == 0)
+    {
+        int window = DCC_BATCH_WINDOW;
+        if (params.size() == 2)
+        {
+            try
+            {
+                window = d77::from_string<int>(params[1]); // type conversion
+            }
+            catch (std::exception &e)
+            {
+                auto s = fmt::format("Wrong value for window supplied: [{}] is not a valid number", params[1]);
+                throw ShellCmdExecException(s);
+            }
+            if (window <= 0)
+            {
+                auto s = fmt::format("Wrong value for window supplied: [{}]; at least one command has to be in flight", params[1]);
+                throw ShellCmdExecException(s);
+            }
+        }
+        if (!DccBatch::isOpen())
+        {
+            auto s = fmt::format("No open batch; call batch begin first");
+            throw ShellCmdExecException(s);
+        }
+
+        auto connection = currentConnection();
+        batchMshield = false;
+        auto r = DccBatch::commit([connection](const std::string &cmds, const std::vector<uint64_t> &ids)
+                                  { connection->write(cmds, ids); },
+                                  static_cast<size_t>(window), connection.get());
+        auto secs = r.elapsed.count() / 1e6;
+        INFO("Batch of {} commands in {} writes: {} ok, {} failed, {} timed out, {} without reply",
+             r.sent, r.writes, r.ok, r.failed, r.timedOut, r.noReply);
+        INFO("Completed in {:.3f}s ({:.0f} commands/s)", secs, secs > 0 ? r.sent / secs : 0.0);
+        return;
+    }
+    auto s = fmt::format("Unknown batch command [{}]", params[0]);
+    throw ShellCmdExecException(s);
+}
 
 // Executors
 static void rootMqtt(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
@@ -240,13 +491,79 @@ static void rootMqtt(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vecto
     case 'b':
     {
         INFO("MQTT connecting to broker ...");
-        DccConfig::broker.connect();
+        auto host = params.size() > 1 ? params[1] : std::string(DCC_MQTT_HOST);
+        auto port = params.size() > 2 ? params[2] : std::string(DCC_MQTT_PORT);
+        if (!DccSession::open("mqtt", fmt::format("mqtt://{}:{}", host, port)))
+        {
+            ERR("Failed to connect to the MQTT broker {}:{}", host, port);
+        }
         break;
     }
     case 's':
     {
-        // subscribe to a topic
-        INFO("MQTT topic subcriptions are not yet implemented");
+        // talk to the station with this id on the broker of the current session
+        if (params.size() != 2)
+        {
+            throw ShellCmdExecException("mqtt subscribe needs the id of the station");
+        }
+        auto mqtt = std::dynamic_pointer_cast<DccMQTT>(currentConnection());
+        if (!mqtt)
+        {
+            auto s = fmt::format("Session {} is not an mqtt connection", DccSession::currentName());
+            throw ShellCmdExecException(s);
+        }
+        mqtt->setStation(params[1]);
+        INFO("Commands go to station {} [{}]", params[1], mqtt->describe());
+        break;
+    }
+    case 'p':
+    {
+        // publish the state of the current session through an mqtt session
+        if (params.size() < 2)
+        {
+            throw ShellCmdExecException("mqtt publish needs the mqtt session or off");
+        }
+        if (params[1] == "off")
+        {
+            DccMQTTState::stop();
+            INFO("State publishing stopped");
+            break;
+        }
+        auto target = std::dynamic_pointer_cast<DccMQTT>(DccSession::get(params[1]));
+        if (!target)
+        {
+            auto s = fmt::format("{} is not an open mqtt session", params[1]);
+            throw ShellCmdExecException(s);
+        }
+        int interval = DCC_MQTT_STATE_INTERVAL;
+        if (params.size() > 2)
+        {
+            try
+            {
+                interval = std::stoi(params[2]);
+            }
+            catch (const std::exception &)
+            {
+                interval = -1;
+            }
+            if (interval < 0)
+            {
+                auto s = fmt::format("Wrong interval [{}]; give the ms between two publishes of an object", params[2]);
+                throw ShellCmdExecException(s);
+            }
+        }
+        auto source = currentConnection();
+        if (source == target)
+        {
+            auto s = fmt::format("{} is the active session; publish the state of another session on it", params[1]);
+            throw ShellCmdExecException(s);
+        }
+        DccMQTTState::start(source, target, std::chrono::milliseconds(interval));
+        // ask for what the cs knows so the retained topics are filled right away
+        source->write("<s>");
+        source->write("<Q>");
+        INFO("Publishing the state of {} on {} every {}ms at most per object",
+             DccSession::currentName(), target->describe(), interval);
         break;
     }
     default:
@@ -258,9 +575,8 @@ static void rootMqtt(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vecto
     }
 }
 /**
- * @brief switching the active connection
- * ! ERROR when switching between connections esp when returning to the ethernet connection the read loop doesn't come back live
- * ! that works for the serial with no pb ...
+ * @brief switching the active session; without a name the open sessions are listed.
+ * Sessions opened without a name are called after their type i.e. serial, ethernet or mqtt
  *
  * @param out
  * @param cmd
@@ -268,47 +584,31 @@ static void rootMqtt(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vecto
  */
 static void rootUseConnection(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
 {
-    DBG("{} Setting active connection to {}", params.size(), params[0]);
-
     switch (params.size())
     {
-    case 1:
+    case 0:
     {
-        // params shall be serial or ethernet otherwise error
-        if (params[0].compare("serial") == 0)
+        auto active = DccSession::activeName();
+        for (auto &s : DccSession::list())
         {
-            if (DccConfig::serial.isOpen())
-            {
-                DccConfig::active = DCC_SERIAL;
-                INFO("Connection set to serial: [{} at {} baud]", DccConfig::serial.getDevice(), DccConfig::serial.getBaud());
-            }
-            else
-            {
-                ERR("No open serial connection available.");
-            }
-            break;
+            out << fmt::format("{} {:<12} {}{}\n", (s.first == active) ? "*" : " ", s.first, s.second->describe(),
+                               s.second->isOpen() ? "" : " (closed)");
         }
-        if (params[0].compare("ethernet") == 0)
+        for (auto &c : DccSession::connecting())
         {
-
-            // close the connection and reopen it ....
-            // DccConfig::ethernet.closeConnection();
-            // DccConfig::ethernet.openConnection(DccConfig::ethernet.getIpAddress(), DccConfig::ethernet.getPort());
-
-            if (DccConfig::ethernet.isOpen())
-            {
-                DccConfig::active = DCC_ETHERNET;
-                INFO("Connection set to network: [{}:{}]", DccConfig::ethernet.getIpAddress(), DccConfig::ethernet.getPort());
-            }
-            else
-            {
-                ERR("No open network connection available.");
-            }
+            out << fmt::format("  {:<12} {} (connecting)\n", c.first, c.second);
+        }
+        break;
+    }
+    case 1:
+    {
+        DBG("Setting active connection to {}", params[0]);
+        if (!DccSession::use(params[0]))
+        {
+            ERR("No open session [{}] available.", params[0]);
             break;
         }
-        // Here we don't know
-        auto s = fmt::format("Unknown connection type [{}]", params[0]);
-        throw ShellCmdExecException(s);
+        INFO("Connection set to {} [{}]", params[0], DccSession::get(params[0])->describe());
         break;
     }
     default:
@@ -334,68 +634,49 @@ static void rootConfig(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vec
     INFO("> Errors and Warnings will always be shown independent of the logging level set");
     INFO("Show file information in logging messages: {}", DccConfig::fileInfo);
     INFO("Executable: {}", DccConfig::getPath());
+    auto active = DccSession::activeName();
+    for (auto &c : DccSession::list())
+    {
+        auto &st = c.second->getStats();
+        INFO("Session {} [{}]{}: {} bytes in ({} reads, {} replies, {} diags), {} bytes out ({} writes)",
+             c.first, c.second->describe(), (c.first == active) ? " (active)" : "",
+             st.bytesIn.load(), st.reads.load(), st.frames.load(), st.diags.load(),
+             st.bytesOut.load(), st.writes.load());
+    }
 
     Diag::pop();
 }
 
-void csOpenTCP(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
+/**
+ * @brief builds the uri for open ethernet <ip> [port]
+ */
+static std::string csTCPUri(std::shared_ptr<cmdItem> cmd, std::vector<std::string> &params)
 {
-    std::string arduinoIP;
-    std::string arduinoPort;
-
     switch (params.size())
     {
     case 2:
-    {
-        arduinoIP = params[1];
-        arduinoPort = fmt::format("{}", DCC_DEFAULT_PORT);
-        break;
-    }
+        return fmt::format("tcp://{}:{}", params[1], DCC_DEFAULT_PORT);
     case 3:
-    {
-        arduinoIP = params[1];
-        arduinoPort = params[2];
-        break;
-    }
+        return fmt::format("tcp://{}:{}", params[1], params[2]);
     default:
     {
         auto s = fmt::format("Wrong number of arguments for [{}]", cmd->name);
         throw ShellCmdExecException(s);
-        break;
-    }
     }
-
-    if (DccConfig::ethernet.openConnection(arduinoIP, arduinoPort))
-    {
-        DccConfig::active = DCC_ETHERNET; // set the active connection to ethernet; the last one wins ...
-
-        fmt::print(fg(fmt::color::green), "Network connected to {}:{}\n", arduinoIP, arduinoPort);
-        // sleep_for(8s); // let the cs reply bfore shoing the prompt again
-    }
-    else
-    {
-        ERR("Failed to open connection to {}:{} baud\n", arduinoIP, arduinoPort);
     }
 }
 
-void csOpenSerial(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
+/**
+ * @brief builds the uri for open serial <port> [baud]
+ */
+static std::string csSerialUri(std::shared_ptr<cmdItem> cmd, std::vector<std::string> &params)
 {
-
-    bool isOpen = false;
     int baudRate = DCC_DEFAULT_BAUDRATE;
     switch (params.size())
     {
     case 2:
     {
-        try
-        {
-            isOpen = DccConfig::serial.openPort(params[1], baudRate);
-        }
-        catch (std::exception &e)
-        {
-            auto s = fmt::format("Failed to open serial port [{}] at [{}] baud", params[1], baudRate);
-            throw ShellCmdExecException(s);
-        }
+        fmt::print(Diag::style(fg(fmt::color::orange)), "Using default baud rate\n");
         break;
     }
     case 3:
@@ -409,38 +690,15 @@ void csOpenSerial(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<s
             auto s = fmt::format("Wrong value for baud supplied: [{}] is not a valid number", params[2]);
             throw ShellCmdExecException(s);
         }
-        try
-        {
-            isOpen = DccConfig::serial.openPort(params[1], baudRate);
-        }
-        catch (std::exception &e)
-        {
-            auto s = fmt::format("Failed to open serial port [{}] at [{}] baud", params[1], baudRate);
-            throw ShellCmdExecException(s);
-        }
         break;
     }
     default:
     {
         auto s = fmt::format("Wrong number of arguments for [{}]", cmd->name);
         throw ShellCmdExecException(s);
-        break;
     }
     }
-    if (isOpen)
-    {
-        DccConfig::active = DCC_SERIAL; // set the active connection to serial
-        fmt::print(fg(fmt::color::green), "Serial port {} opened at {} baud\n", params[1], baudRate);
-        if (params.size() == 2)
-        {
-            fmt::print(fg(fmt::color::orange), "Using default baud rate\n");
-        }
-        sleep_for(8s); // let the cs reply bfore shoing the prompt again
-    }
-    else
-    {
-        fmt::print(fg(fmt::color::red), "Failed to open serial port {} at {} baud\n");
-    }
+    return fmt::format("serial://{}?baud={}", params[1], baudRate);
 }
 
 /**
@@ -448,6 +706,8 @@ void csOpenSerial(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<s
  * depending on the capabilities of the CommandStation ( as installed / compiled by the user )
  * Serial should always be possible ( Ethernet / WiFi / MQTT your mileage may vary. Direct
  * MQ support may not be available bc of rss constraints on the MCU with respsect
+ * Instead of the type any uri known to the transport registry can be given e.g. tcp://10.0.0.5:2560
+ * followed by the name of the session; without a name the session is called after the type
  *
  * @param out
  * @param cmd
@@ -455,65 +715,94 @@ void csOpenSerial(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<s
  */
 void csOpen(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
 {
-    int cType;
+    std::string uri;
+    std::string name;
 
-    if (params[0].compare("serial") == 0)
+    if (params[0].find("://") != std::string::npos)
     {
-        cType = DCC_SERIAL;
-    }
-    else
-    {
-        if (params[0].compare("ethernet") == 0)
+        // open <uri> [name]
+        if (params.size() > 2)
         {
-            cType = DCC_ETHERNET;
+            auto s = fmt::format("Wrong number of arguments for [{}]", cmd->name);
+            throw ShellCmdExecException(s);
         }
-        else
+        uri = params[0];
+        if (params.size() == 2)
         {
-            cType = DCC_CONN_UNKOWN;
+            name = params[1];
         }
     }
-    switch (cType)
-    {
-    case DCC_SERIAL:
+    else if (params[0].compare("serial") == 0)
     {
-        try
-        {
-            csOpenSerial(out, cmd, params);
-        }
-        catch (ShellCmdExecException &ex)
-        {
-            ERR("Failed to open port: possible reasons: wrong port, wrong baud settings or port in use by another application");
-            throw(ex);
-        }
-        break;
+        uri = csSerialUri(cmd, params);
     }
-    case DCC_ETHERNET:
+    else if (params[0].compare("ethernet") == 0)
     {
-        try
-        {
-            csOpenTCP(out, cmd, params);
-        }
-        catch (ShellCmdExecException &ex)
-        {
-            ERR("Failed to connect: possible reasons: wrong address, non standard port on the command station");
-            throw(ex);
-        }
-        break;
+        uri = csTCPUri(cmd, params);
     }
-    default:
+    else
     {
         auto s = fmt::format("Unknown connection type: [{}]", params[0]);
         throw ShellCmdExecException(s);
-        break;
     }
+
+    if (name.empty())
+    {
+        name = DccSession::defaultName(uri);
+    }
+
+    if (uri.compare(0, 9, "serial://") != 0 && !DccConfig::isScript)
+    {
+        // an address which doesn't answer would hold up the prompt for the whole connect
+        // timeout; a script waits since its next commands go to the connection
+        DccSession::openAsync(name, uri, [name, uri](std::shared_ptr<DccTransport> connection, const std::string &error)
+                              {
+            if (!connection)
+            {
+                ERR("Failed to open {}: {}", uri, error.empty() ? std::string("no answer from the address") : error);
+                return;
+            }
+            fmt::print(Diag::style(fg(fmt::color::green)), "Connected to {} as {}\n", connection->describe(), name); });
+        INFO("Connecting to {} as {}", uri, name);
+        return;
+    }
+
+    std::shared_ptr<DccTransport> connection;
+    try
+    {
+        connection = DccSession::open(name, uri);
+    }
+    catch (std::exception &e)
+    {
+        auto s = fmt::format("Failed to open [{}]: {}", uri, e.what());
+        throw ShellCmdExecException(s);
+    }
+
+    if (!connection)
+    {
+        ERR("Failed to open {}: possible reasons: wrong port or address, wrong baud settings or port in use by another application", uri);
+        return;
+    }
+
+    fmt::print(Diag::style(fg(fmt::color::green)), "Connected to {} as {}\n", connection->describe(), name);
+    if (uri.compare(0, 9, "serial://") == 0)
+    {
+        // opening the port resets the mcu
+        if (!awaitCommandStation(connection, 8s)) // let the cs reply before showing the prompt again
+        {
+            WARN("No reply from the commandstation on {}", connection->describe());
+        }
     }
 }
 
 void csStatus(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
 {
     out.flush();
-    sendCmd("<s>");
-    sleep_for(40ms); // leave some time for the cs to reply before showing the prompt again
+    auto pending = sendCmd("<s>");
+    if (DccRequest::wait(pending).timedOut) // the prompt comes back as soon as the cs has replied
+    {
+        WARN("No status reply from the commandstation");
+    }
     out << "\n";
 }
 
@@ -587,11 +876,23 @@ void csRead(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::st
     }
 
     std::string csCmd = fmt::format("<R {} {} {}>", cv, callback, callbacksub);
-    sendCmd(csCmd);
+    auto pending = sendCmd(csCmd);
 
-    sleep_for(2s);
+    // reading a cv may take some time on the programming track; the timeout can be set with -t
+    auto reply = DccRequest::wait(pending);
+    if (reply.timedOut)
+    {
+        WARN("No reply from the commandstation for reading CV {}", cv);
+    }
+    else
+    {
+        DccResponse r;
+        if (DccResponse::decode(reply.frame, r) && r.intArg(3) == -1)
+        {
+            ERR("Reading CV {} failed", cv);
+        }
+    }
     out << '\n';
-    // leave some time for the cs to reply before showing the prompt again check if diag ack is on to allow for more time
 }
 
 void csDiag(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
@@ -892,10 +1193,47 @@ void csMshield(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std:
                 // std::string csCmd = fmt::format("<+cli[{}]{}>", payload.length(), payload);
                 std::string csCmd = fmt::format("<cli {} {}>", cstate, sid);
                 // INFO("Sending {}", csCmd);
+                if (DccBatch::isOpen())
+                {
+                    // takes effect once the commandstation accepted it on commit
+                    auto name = s->second.name;
+                    DccBatch::add(csCmd, [sid, name](const DccReply &reply)
+                                  {
+                        if (reply.timedOut || reply.frame.rfind("<X", 0) == 0)
+                        {
+                            ERR("Motorshield [{}] not configured", name);
+                            return;
+                        }
+                        INFO("Motorshield [{}] is configured and operational", name);
+                        DccConfig::mshield = (CsMotorShield)sid; });
+                    batchMshield = true;
+                    INFO("Motorshield [{}] will be configured on batch commit", name);
+                    return;
+                }
+
                 DccConfig::setMshield = true;
-                sendCmd(csCmd);
-                sleep_for(1s); // let the cs reply before showing the prompt again
+                DccPendingReply pending;
+                try
+                {
+                    pending = sendCmd(csCmd);
+                }
+                catch (...)
+                {
+                    DccConfig::setMshield = false;
+                    throw;
+                }
                 DccConfig::setMshield = false;
+                auto reply = DccRequest::wait(pending);
+                if (reply.timedOut)
+                {
+                    ERR("No reply from the commandstation; motorshield [{}] not configured", s->second.name);
+                    return;
+                }
+                if (reply.frame.rfind("<X", 0) == 0)
+                {
+                    ERR("The commandstation rejected motorshield [{}]", s->second.name);
+                    return;
+                }
                 INFO("Motorshield [{}] is configured and operational", s->second.name);
 
                 DccConfig::mshield = (CsMotorShield)sid;
@@ -922,8 +1260,15 @@ void csMshield(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std:
 void loLoadLayout(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
 {
     INFO("Loading layout: {}", params[0]);
+    // an unchanged layout isn't read, validated and searched for paths again
+    auto layout = DccLayoutCache::build(params[0], DccConfig::dccSchemaFile);
+    if (!layout)
+    {
+        auto s = fmt::format("Can't build the layout from {}; the layout loaded before is kept", params[0]);
+        throw ShellCmdExecException(s);
+    }
     DccConfig::dccLayoutFile = params[0];
-    DccConfig::_playout->build(params[0], DccConfig::dccSchemaFile);
+    DccConfig::_playout = layout;
 }
 
 void loLoadSchema(std::ostream &out, std::shared_ptr<cmdItem> cmd, std::vector<std::string> params)
@@ -948,6 +1293,10 @@ void ShellCmdExec::setup()
     add(1, "use", rootUseConnection);
     add(1, "loglevel", rootLogLevel);
     add(1, "mqtt", rootMqtt);
+    add(1, "batch", rootBatch);
+    add(1, "capture", rootCapture);
+    add(1, "replay", rootReplay);
+    add(1, "stats", rootStats);
     add(2, "open", csOpen);
     add(2, "read", csRead);
     add(2, "diag", csDiag);
@@ -32,11 +32,16 @@
 #ifndef ShellCmdExec_h
 #define ShellCmdExec_h
 
+#include <chrono>
 #include <map>
+#include <memory>
 #include <string>
 #include <exception>
 #include "DccShellCmd.hpp"
 #include "ShellCmdConfig.hpp"
+#include "DccRequest.hpp"
+
+class DccTransport;
 
 typedef void _fShellCmd(std::ostream &, std::shared_ptr<cmdItem>, std::vector<std::string>);
 typedef void (*_fpShellCmd)(std::ostream &, std::shared_ptr<cmdItem>, std::vector<std::string>);
@@ -86,4 +91,16 @@ public:
     ~ShellCmdExecException() = default;
 };
 
+/**
+ * @brief Sends the command over the current session and registers the expected reply
+ * @throws ShellCmdExecException if there is no open session
+ */
+DccPendingReply sendCmd(const std::string csCmd);
+
+/**
+ * @brief Repeats <s> on a port which has just been opened until the commandstation answers
+ * @return false if there was no reply within the deadline
+ */
+bool awaitCommandStation(std::shared_ptr<DccTransport> connection, std::chrono::milliseconds deadline);
+
 #endif
\ No newline at end of file
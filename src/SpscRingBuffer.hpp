@@ -0,0 +1,113 @@
+/*
+ * © 2021 Gregor Baues. All rights reserved.
+ *
+ * This is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * See the GNU General Public License for more details
+ * <https://www.gnu.org/licenses/>
+ */
+
+/**
+ * @class SpscRingBuffer
+ * @brief Fixed capacity single producer / single consumer byte ring buffer.
+ * The producer (the thread calling write on the connection) copies the data in,
+ * the consumer (the io thread) gets the queued data as at most two contiguous spans
+ * which can be handed over as is to a scatter-gather write and releases them once
+ * written. Neither side allocates nor locks.
+ * @note Size has to be a power of two
+ * @author grbba
+ */
+
+#ifndef SpscRingBuffer_h
+#define SpscRingBuffer_h
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+template <size_t Size>
+class SpscRingBuffer
+{
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0, "Size of the ring buffer has to be a power of two");
+
+private:
+  alignas(64) std::atomic<size_t> head{0}; ///< total bytes pushed; written by the producer only
+  alignas(64) std::atomic<size_t> tail{0}; ///< total bytes consumed; written by the consumer only
+  std::array<char, Size> buffer;
+
+public:
+  struct Spans
+  {
+    const char *first;
+    size_t firstSize;
+    const char *second;
+    size_t secondSize;
+
+    size_t size() const { return firstSize + secondSize; }
+  };
+
+  /**
+   * Producer side. Copies as much of data as fits.
+   * \return number of bytes queued
+   */
+  size_t push(const char *data, size_t size)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load();
+    size_t n = std::min(size, Size - (h - t));
+    size_t idx = h & (Size - 1);
+    size_t n1 = std::min(n, Size - idx);
+
+    memcpy(&buffer[idx], data, n1);
+    memcpy(&buffer[0], data + n1, n - n1);
+    head.store(h + n);
+    return n;
+  }
+
+  /**
+   * Consumer side. The queued data; the first span runs up to the end of the buffer
+   * the second one, if any, restarts at the beginning.
+   */
+  Spans spans() const
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t n = head.load() - t;
+    size_t idx = t & (Size - 1);
+    size_t n1 = std::min(n, Size - idx);
+
+    return {&buffer[idx], n1, &buffer[0], n - n1};
+  }
+
+  /**
+   * Consumer side. Releases size bytes from the front of the queue.
+   */
+  void consume(size_t size) { tail.store(tail.load(std::memory_order_relaxed) + size); }
+
+  size_t used() const { return head.load() - tail.load(); }
+  bool empty() const { return used() == 0; }
+  static constexpr size_t capacity() { return Size; }
+
+  /**
+   * Only to be called when neither producer nor consumer are active.
+   */
+  void clear()
+  {
+    head.store(0);
+    tail.store(0);
+  }
+};
+
+#endif
@@ -20,6 +20,8 @@
 
 #include <fmt/core.h>
 #include <fmt/color.h>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -28,76 +30,105 @@
 #include "Diag.hpp"
 #include "DccConfig.hpp"
 #include "DccLayout.hpp"
+#include "DccLayoutCache.hpp"
 #include "DccShell.hpp"
-
-// Version information
-#define MAJOR 0
-#define MINOR 1
-#define PATCH 12
+#include "DccScript.hpp"
+#include "DccSession.hpp"
+#include "DccIoContext.hpp"
+#include "DccSupervisor.hpp"
+#include "DccCapture.hpp"
+#include "DccMetrics.hpp"
+#include "DccMQTT.hpp"
+#include "DccVersion.hpp"
 
 
 #ifdef WIN32
 #define HEADING(x)  fmt::print(x);
 #define SUBHEADING(x)  fmt::print(x);
 #else
-#define HEADING(x)  fmt::print(fg(fmt::color::medium_turquoise) | fmt::emphasis::bold, x);
-#define SUBHEADING(x)  fmt::print(fg(fmt::color::medium_turquoise), x);
+#define HEADING(x)  fmt::print(Diag::style(fg(fmt::color::medium_turquoise) | fmt::emphasis::bold), x);
+#define SUBHEADING(x)  fmt::print(Diag::style(fg(fmt::color::medium_turquoise)), x);
 #endif
 
 auto main(int argc, char **argv) -> int {
-  // clear screen
-  #ifndef WIN32
+  Diag::setup(); // log from a background thread; the io threads must not wait for the terminal
+
+  // setup the configuration including default log levels
+  if (!DccConfig::setup(argc, argv)) {
+    // only continue if the configuration has been set properly
+    Diag::shutdown();
+    return EXIT_FAILURE;
+  };
+
+  // in script mode the output goes to logs/files; no banner and no escape codes
+  if (DccConfig::isScript) {
+    Diag::setColor(false);
+  }
+
+  if (Diag::getColor()) {
+    // clear screen
+#ifndef WIN32
     std::cout << "\e[2J\e[1;1H";
-  #endif
-  char month[4];
-  int day, year, hour, min, sec;
-  sscanf(__DATE__, "%s %i %i", &month[0], &day, &year);
-  sscanf(__TIME__, "%i:%i:%i", &hour, &min, &sec);
+#endif
+    char month[4];
+    int day, year, hour, min, sec;
+    sscanf(__DATE__, "%s %i %i", &month[0], &day, &year);
+    sscanf(__TIME__, "%i:%i:%i", &hour, &min, &sec);
 
-  std::string version = fmt::format("Version {}.{}.{}", MAJOR, MINOR, PATCH);
-  std::string build = fmt::format("-{}{}{}\n", day, hour, min);
+    std::string version = fmt::format("Version {}.{}.{}", MAJOR, MINOR, PATCH);
+    std::string build = fmt::format("-{}{}{}\n", day, hour, min);
 
 #ifdef WIN32
-  rang::setWinTermMode(rang::winTerm::Auto);
-  std::cout << rang::fg::cyan << rang::style::bold;
+    rang::setWinTermMode(rang::winTerm::Auto);
+    std::cout << rang::fg::cyan << rang::style::bold;
 #endif
-  
-  HEADING("Welcome to the DCC++ EX Commandline Interface\n");
-  SUBHEADING(version); SUBHEADING(build);
-  SUBHEADING("(c) 2021 grbba\n\n");
+
+    HEADING("Welcome to the DCC++ EX Commandline Interface\n");
+    SUBHEADING(version); SUBHEADING(build);
+    SUBHEADING("(c) 2021 grbba\n\n");
 
 #ifdef WIN32
-  std::cout << rang::style::reset;
+    std::cout << rang::style::reset;
 #endif
+  }
 
-  // setup the configuration including default log levels
-  if (!DccConfig::setup(argc, argv)) {
-    // only continue if the configuration has been set properly
-    return DCC_SUCCESS;
-  };
+  if (DccConfig::isConnect) {
+    DccConfig::connect();
+  }
 
   DccShell s;
   Diag::setLogLevel(LOGV_INFO);
   
-  if (DccConfig::isInteractive) {
+  int rc = EXIT_SUCCESS;
+  if (DccConfig::isScript) {
+    rc = (DccScript::run(DccConfig::scriptFile) == DCC_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (DccConfig::isInteractive) {
     s.runShell();  // run in interactive mode
   } else {
     // read layout and schema
-    DccLayout myLayout;
     // reads the layout validates and builds the model by means of the supplied
     // schema; creates the graph and calculates all paths through the layout
-    // (direct and indirect)
+    // (direct and indirect). A layout validated before is taken from the cache
     
     Diag::setFileInfo(true);
-    if(!myLayout.build(DccConfig::dccLayoutFile,DccConfig::dccSchemaFile)) {
-      return DCC_FAILURE;
+    auto myLayout = DccLayoutCache::build(DccConfig::dccLayoutFile, DccConfig::dccSchemaFile);
+    if(!myLayout) {
+      rc = EXIT_FAILURE;
+    } else {
+      // get some info
+      myLayout->info();
+      // print out all paths
+      myLayout->listPaths();
     }
-
-    // get some info
-    myLayout.info();
-    // print out all paths
-    myLayout.listPaths();
   }
 
-  return DCC_SUCCESS;
+  // whatever ran may have left connections, captures or the exporter behind
+  DccSupervisor::stop();
+  DccCapture::stop();
+  DccMetrics::stop();
+  DccMQTTState::stop();
+  DccSession::closeAll();
+  DccIoContext::stop();
+  Diag::shutdown();
+  return rc;
 }